@@ -1,21 +1,57 @@
 #include <iostream>
 #include <fstream>
 #include <vector>
-#include <stack>
 #include <cstdint>
 #include <cstring>
 #include <unordered_map>
+#include <map>
 #include <string>
 #include <memory>
 #include <stdexcept>
 #include <iomanip>
 #include <sstream>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <string_view>
+#include <filesystem>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <deque>
+#include <cmath>
+#include <charconv>
+#include <limits>
+#include <utility>
+#ifdef _WIN32
 #include <windows.h>
+#include <io.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#define JVM_READ _read
+#define JVM_WRITE _write
+#define JVM_CLOSE _close
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define JVM_READ ::read
+#define JVM_WRITE ::write
+#define JVM_CLOSE ::close
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
 using namespace std;
 
 // JVM data types
 using jbyte = int8_t;
 using jshort = int16_t;
+using jchar = uint16_t;
 using jint = int32_t;
 using jlong = int64_t;
 using jfloat = float;
@@ -27,53 +63,425 @@ struct Class;
 struct Method;
 struct Field;
 
-using ObjectPtr = shared_ptr<Object>;
 using ClassPtr = shared_ptr<Class>;
 using MethodPtr = shared_ptr<Method>;
 
 // Forward declarations
 struct JVMInstance;
 struct Frame;
+struct JitCode;
+// Decrypted class file bytes. Parsers check bounds once per structure with
+// take() and decode the big-endian fields straight from the returned pointer.
 struct MemoryFile {
-    vector<uint8_t> data;
-    vector<uint8_t> key; // key array
+    const uint8_t* data;
+    size_t size;
     size_t pos = 0;
+    // Encrypted class images: take() decrypts into data (the plain buffer)
+    // as it reaches bytes, so bytes passed over with skip() never are.
+    const uint8_t* encrypted = nullptr;
+    size_t decrypted = 0;   // end of what has been decrypted
 
-    // //////
-    MemoryFile(const vector<uint8_t>& d, const uint8_t* k, size_t ksize)
-        : data(d), key(k, k + ksize) {}
+    MemoryFile(const uint8_t* d, size_t n) : data(d), size(n) {}
+    MemoryFile(const uint8_t* image, uint8_t* plain, size_t n) : data(plain), size(n), encrypted(image) {}
 
-    uint8_t read_u1() {
-        if (pos >= data.size()) throw runtime_error("End of memory");
-        uint8_t b = data[pos] ^ key[pos % key.size()]; // 
-        pos++;
-        return b;
+    static uint16_t be16(const uint8_t* p) {
+        return static_cast<uint16_t>((p[0] << 8) | p[1]);
+    }
+    static uint32_t be32(const uint8_t* p) {
+        return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+            (static_cast<uint32_t>(p[2]) << 8) | p[3];
     }
 
-    uint16_t read_u2() {
-        return (static_cast<uint16_t>(read_u1()) << 8) | read_u1();
+    const uint8_t* take(size_t len) {
+        if (len > size - pos) throw runtime_error("End of memory");
+        if (encrypted && pos + len > decrypted) decryptThrough(pos + len);
+        const uint8_t* p = data + pos;
+        pos += len;
+        return p;
     }
 
-    uint32_t read_u4() {
-        return (static_cast<uint32_t>(read_u1()) << 24) |
-            (static_cast<uint32_t>(read_u1()) << 16) |
-            (static_cast<uint32_t>(read_u1()) << 8) |
-            read_u1();
+    uint8_t read_u1() { return *take(1); }
+    uint16_t read_u2() { return be16(take(2)); }
+    uint32_t read_u4() { return be32(take(4)); }
+
+    void skip(size_t len) {
+        if (len > size - pos) throw runtime_error("End of memory");
+        pos += len;
     }
+    size_t tell() const { return pos; }
+
+    // Decrypts from pos through at least end, on to the next key block so
+    // the many small reads of a constant pool make few calls.
+    void decryptThrough(size_t end);
+};
 
-    void read_bytes(char* buffer, size_t len) {
-        for (size_t i = 0; i < len; ++i) {
-            buffer[i] = read_u1();
+// Read-only view of a whole file: memory-mapped where possible, read into a
+// private buffer otherwise (empty files, pipes).
+struct MappedFile {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    vector<uint8_t> fallback;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+    void* mapped = nullptr;
+
+    explicit MappedFile(const string& path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) throw runtime_error("Cannot open file: " + path);
+        LARGE_INTEGER length;
+        if (GetFileSizeEx(file, &length) && length.QuadPart > 0) {
+            size = static_cast<size_t>(length.QuadPart);
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (mapping) mapped = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            data = static_cast<const uint8_t*>(mapped);
+        }
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw runtime_error("Cannot open file: " + path);
+        struct stat st;
+        if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            size = static_cast<size_t>(st.st_size);
+            void* p = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p != MAP_FAILED) {
+                mapped = p;
+                data = static_cast<const uint8_t*>(p);
+            }
+        }
+        close(fd);
+#endif
+        if (!data) {
+            ifstream f(path, ios::binary);
+            if (!f) throw runtime_error("Cannot open file: " + path);
+            fallback.assign(istreambuf_iterator<char>(f), istreambuf_iterator<char>());
+            data = fallback.data();
+            size = fallback.size();
         }
     }
+    ~MappedFile() {
+#ifdef _WIN32
+        if (mapped) UnmapViewOfFile(mapped);
+        if (mapping) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (mapped) munmap(mapped, size);
+#endif
+    }
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+};
 
-    void seek(size_t p) { pos = p; }
-    size_t tell() const { return pos; }
+// Class files are XORed with this repeating key.
+static const uint8_t CLASS_KEY[20] = { 0xAA, 0x3F, 0xC2, 0x7D, 0x91, 0x4B, 0x6E, 0xF0, 0x12, 0x8D,
+                                       0x55, 0x99, 0x0A, 0xDE, 0x6B, 0x3C, 0x47, 0x81, 0x2F, 0xB4 };
+
+// Decrypts n bytes from src into dst in one pass. The key stream repeats
+// every 160 bytes (a whole number of keys and of 32-byte vectors), so whole
+// blocks are XORed a register at a time against a precomputed stream.
+static void decryptClassBytes(const uint8_t* src, uint8_t* dst, size_t n) {
+    constexpr size_t BLOCK = 160;
+    alignas(32) static const auto stream = [] {
+        struct { uint8_t bytes[BLOCK]; } s;
+        for (size_t i = 0; i < BLOCK; ++i) s.bytes[i] = CLASS_KEY[i % sizeof(CLASS_KEY)];
+        return s;
+    }();
+    const uint8_t* key = stream.bytes;
+    size_t i = 0;
+    for (; i + BLOCK <= n; i += BLOCK) {
+#if defined(__AVX2__)
+        for (size_t j = 0; j < BLOCK; j += 32) {
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i + j));
+            __m256i k = _mm256_load_si256(reinterpret_cast<const __m256i*>(key + j));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i + j), _mm256_xor_si256(v, k));
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        for (size_t j = 0; j < BLOCK; j += 16) {
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i + j));
+            __m128i k = _mm_load_si128(reinterpret_cast<const __m128i*>(key + j));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i + j), _mm_xor_si128(v, k));
+        }
+#else
+        for (size_t j = 0; j < BLOCK; j += 8) {
+            uint64_t v, k;
+            memcpy(&v, src + i + j, 8);
+            memcpy(&k, key + j, 8);
+            v ^= k;
+            memcpy(dst + i + j, &v, 8);
+        }
+#endif
+    }
+    for (; i < n; ++i) dst[i] = src[i] ^ key[i % BLOCK];
+}
+
+// The same for the bytes at offset at of a class image, which may start
+// mid key: bytes up to the next 160-byte block, then whole blocks as above.
+static void decryptClassBytes(const uint8_t* src, uint8_t* dst, size_t n, size_t at) {
+    size_t head = min(n, (160 - at % 160) % 160);
+    for (size_t i = 0; i < head; ++i) dst[i] = src[i] ^ CLASS_KEY[(at + i) % sizeof(CLASS_KEY)];
+    decryptClassBytes(src + head, dst + head, n - head);
+}
+
+void MemoryFile::decryptThrough(size_t end) {
+    size_t from = max(pos, decrypted);
+    end = min(size, (end + 159) / 160 * 160);
+    decryptClassBytes(encrypted + from, const_cast<uint8_t*>(data) + from, end - from, from);
+    decrypted = end;
+}
+
+// Many classes in one file, found through a hash index stored in the file,
+// so opening it costs the same for any number of classes and a class is
+// only decrypted when first loaded. The whole file is XORed with CLASS_KEY
+// from offset 0; all integers are big-endian.
+//
+//   u4 magic 'MJAR', u4 bucket_count (a power of two), u4 main_entry,
+//   u4 bucket[bucket_count]        offset of the first entry in the chain
+//   entry: u4 next, u4 offset, u4 length, u2 name_length, name
+//
+// Class images start at multiples of 160 bytes, where the key stream is back
+// at its start, so each one is a byte-for-byte copy of its .class file.
+struct ClassArchive {
+    static constexpr uint32_t MAGIC = 0x4D4A4152;
+    static constexpr size_t HEADER_SIZE = 12;
+    static constexpr size_t IMAGE_ALIGN = 160;
+
+    MappedFile file;
+    uint32_t bucketCount;
+    uint32_t mainEntry;
+
+    explicit ClassArchive(const string& path) : file(path) {
+        if (file.size < HEADER_SIZE || !isArchive(file.data)) throw runtime_error("Invalid archive: " + path);
+        bucketCount = u4(4);
+        mainEntry = u4(8);
+        if (bucketCount == 0 || (bucketCount & (bucketCount - 1)) ||
+            bucketCount > (file.size - HEADER_SIZE) / 4)
+            throw runtime_error("Invalid archive index: " + path);
+    }
+
+    static bool isArchive(const uint8_t* data) {
+        uint8_t magic[4];
+        decryptClassBytes(data, magic, 4);
+        return MemoryFile::be32(magic) == MAGIC;
+    }
+
+    static uint32_t hashName(string_view name) {
+        uint32_t h = 2166136261u;   // FNV-1a
+        for (char c : name) h = (h ^ static_cast<uint8_t>(c)) * 16777619u;
+        return h;
+    }
+
+    // Decrypted bytes at an absolute file offset; the index is small enough
+    // to decode in place.
+    void read(size_t pos, uint8_t* out, size_t len) const {
+        if (pos > file.size || len > file.size - pos) throw runtime_error("Invalid archive index");
+        for (size_t i = 0; i < len; ++i)
+            out[i] = file.data[pos + i] ^ CLASS_KEY[(pos + i) % sizeof(CLASS_KEY)];
+    }
+    uint32_t u4(size_t pos) const {
+        uint8_t b[4];
+        read(pos, b, 4);
+        return MemoryFile::be32(b);
+    }
+
+    // Entry header at pos: next, offset, length, name_length.
+    struct Entry {
+        uint32_t next, offset, length;
+        string name;
+    };
+    Entry entryAt(uint32_t pos) const {
+        uint8_t b[14];
+        read(pos, b, sizeof b);
+        Entry e{ MemoryFile::be32(b), MemoryFile::be32(b + 4), MemoryFile::be32(b + 8), string() };
+        e.name.resize(MemoryFile::be16(b + 12));
+        read(pos + sizeof b, reinterpret_cast<uint8_t*>(&e.name[0]), e.name.size());
+        return e;
+    }
+
+    bool find(string_view name, uint32_t& offset, uint32_t& length) const {
+        uint32_t pos = u4(HEADER_SIZE + 4 * (hashName(name) & (bucketCount - 1)));
+        for (int hops = 0; pos; ++hops) {
+            if (hops > 1 << 20) throw runtime_error("Invalid archive index");
+            Entry e = entryAt(pos);
+            if (e.name == name) {
+                if (e.offset > file.size || e.length > file.size - e.offset)
+                    throw runtime_error("Invalid archive entry: " + e.name);
+                offset = e.offset;
+                length = e.length;
+                return true;
+            }
+            pos = e.next;
+        }
+        return false;
+    }
+
+    string mainClass() const {
+        if (!mainEntry) throw runtime_error("Archive has no main class");
+        return entryAt(mainEntry).name;
+    }
+
+    // Every entry, in file order.
+    vector<Entry> entries() const {
+        vector<Entry> all;
+        for (uint32_t b = 0; b < bucketCount; ++b) {
+            for (uint32_t pos = u4(HEADER_SIZE + 4 * b); pos; pos = all.back().next) {
+                if (all.size() > file.size / 14) throw runtime_error("Invalid archive index");
+                all.push_back(entryAt(pos));
+                if (all.back().offset > file.size || all.back().length > file.size - all.back().offset)
+                    throw runtime_error("Invalid archive entry: " + all.back().name);
+            }
+        }
+        sort(all.begin(), all.end(), [](const Entry& a, const Entry& b) { return a.offset < b.offset; });
+        return all;
+    }
+};
+
+// Class data sharing image: the parsed and decoded form of an application's
+// classes, written by -Xshare:dump and mapped at startup. It holds plain
+// records that refer to each other by offset from the start of the image, so
+// it works at any address. A class is built from its records on first
+// reference, with no decryption, constant pool parsing or bytecode decoding.
+// The image is only valid for the build that wrote it and for the exact
+// application file it was dumped from.
+struct SharedString { uint32_t offset, length; };
+struct SharedCPEntry {
+    uint8_t tag;
+    uint16_t class_index, name_and_type_index, string_index, name_index, descriptor_index;
+    uint32_t int_value;
+    uint64_t long_value;
+    SharedString utf8;
+};
+struct SharedField {
+    SharedString name, descriptor;
+    uint32_t isStatic;
+};
+struct SharedInsn {
+    uint32_t pc;
+    jint a, b;
+    uint32_t opcode;
+};
+struct SharedHandler {
+    uint32_t start, end, target, catchType;   // insn indices, as in ExceptionHandler
+};
+struct SharedMethod {
+    SharedString name, descriptor;
+    uint32_t maxStack, maxLocals, isStatic, isPrivate, isSynchronized;
+    uint32_t codeOffset, codeLength;
+    uint32_t insnOffset, insnCount;
+    uint32_t handlerOffset, handlerCount;
+};
+struct SharedClass {
+    uint64_t sourceSize;            // class file next to the main class, if the
+    int64_t sourceTime;             // class came from one; else 0
+    SharedString name, superName;   // superName.length 0: no superclass
+    uint32_t next;                  // next record in the hash chain
+    uint32_t cpOffset, cpCount;
+    uint32_t fieldOffset, fieldCount;
+    uint32_t methodOffset, methodCount;
+    uint32_t accessFlags;
+    uint32_t interfaceOffset, interfaceCount;   // SharedString names
+};
+struct SharedHeader {
+    char magic[8];
+    char build[32];                 // __DATE__ " " __TIME__ of the writer
+    uint64_t sourceSize;            // application file the image came from
+    int64_t sourceTime;
+    uint32_t classCount;
+    uint32_t bucketCount;           // power of two
+    uint32_t bucketOffset;          // u4 offsets of SharedClass records
+    SharedString mainClass;
+};
+
+struct SharedImage {
+    static constexpr char MAGIC[8] = { 'M', 'J', 'V', 'M', 'C', 'D', 'S', '6' };
+
+    MappedFile file;
+    const SharedHeader* header = nullptr;
+
+    static const char* buildId() { return __DATE__ " " __TIME__; }
+    static string pathFor(const string& appPath) { return appPath + ".jsa"; }
+
+    // Size and modification time of a file; both 0 if it cannot be read.
+    static void sourceStamp(const string& path, uint64_t& size, int64_t& time) {
+        error_code ec;
+        size = filesystem::file_size(path, ec);
+        auto modified = filesystem::last_write_time(path, ec);
+        if (ec) size = 0;
+        time = ec ? 0 : static_cast<int64_t>(modified.time_since_epoch().count());
+    }
+
+    // Throws if the image is malformed or was made for a different build or
+    // application file.
+    SharedImage(const string& imagePath, const string& appPath) : file(imagePath) {
+        header = at<SharedHeader>(0, 1);
+        uint64_t size;
+        int64_t time;
+        sourceStamp(appPath, size, time);
+        if (memcmp(header->magic, MAGIC, sizeof MAGIC) != 0 ||
+            strncmp(header->build, buildId(), sizeof header->build) != 0)
+            throw runtime_error("Shared image " + imagePath + " was written by a different VM build");
+        if (size == 0 || header->sourceSize != size || header->sourceTime != time)
+            throw runtime_error("Shared image " + imagePath + " does not match " + appPath);
+        if (header->bucketCount == 0 || (header->bucketCount & (header->bucketCount - 1)))
+            throw runtime_error("Invalid shared image: " + imagePath);
+        at<uint32_t>(header->bucketOffset, header->bucketCount);
+        str(header->mainClass);
+    }
+
+    // count records of T at offset, bounds checked against the mapping.
+    template <typename T>
+    const T* at(uint32_t offset, uint32_t count) const {
+        if (offset % alignof(T) || offset > file.size || (file.size - offset) / sizeof(T) < count)
+            throw runtime_error("Invalid shared image");
+        return reinterpret_cast<const T*>(file.data + offset);
+    }
+    string_view str(SharedString s) const {
+        return string_view(reinterpret_cast<const char*>(at<char>(s.offset, s.length)), s.length);
+    }
+
+    const SharedClass* find(string_view name) const {
+        const uint32_t* buckets = at<uint32_t>(header->bucketOffset, header->bucketCount);
+        uint32_t pos = buckets[ClassArchive::hashName(name) & (header->bucketCount - 1)];
+        for (uint32_t hops = 0; pos; ++hops) {
+            if (hops > header->classCount) throw runtime_error("Invalid shared image");
+            const SharedClass* rec = at<SharedClass>(pos, 1);
+            if (str(rec->name) == name) return rec;
+            pos = rec->next;
+        }
+        return nullptr;
+    }
 };
 
 
 
 
+struct OperandStack;
+
+// Native method implementation. It pops its arguments (the receiver too, for
+// instance methods) from the caller's operand stack and pushes its result.
+using NativeFn = void (*)(JVMInstance& vm, OperandStack& stack);
+
+// An atomic that can still be copied, as constant pool entries and methods
+// are while their class is being built, before other threads can see them.
+// Flags are published with a release store and tested with an acquire load.
+template <typename T>
+struct CopyableAtomic : atomic<T> {
+    CopyableAtomic(T v = T()) : atomic<T>(v) {}
+    CopyableAtomic(const CopyableAtomic& o) : atomic<T>(o.load(memory_order_relaxed)) {}
+    CopyableAtomic& operator=(const CopyableAtomic& o) {
+        this->store(o.load(memory_order_relaxed), memory_order_relaxed);
+        return *this;
+    }
+
+    // Counts one more without a locked instruction. Racing threads may lose
+    // an update, which only delays compilation.
+    T bump() {
+        T v = this->load(memory_order_relaxed) + 1;
+        this->store(v, memory_order_relaxed);
+        return v;
+    }
+};
+
 // Constant pool entry types
 struct CPEntry {
     uint8_t tag;
@@ -83,23 +491,378 @@ struct CPEntry {
     uint16_t string_index;
     uint16_t name_index;
     uint16_t descriptor_index;
-    uint32_t int_value;
+    uint32_t int_value;     // Integer, or the bits of a Float
+    uint64_t long_value = 0; // Long, or the bits of a Double
+
+    // Fieldref/Methodref resolution, cached in the entry the first time an
+    // instruction referencing it runs. Set last, after everything it publishes.
+    CopyableAtomic<bool> resolved;
+    NativeFn native = nullptr;             // native bound to the method, if any
+    CopyableAtomic<Object*> stringObject;  // String entry: its interned object, set like resolved
+    uint16_t argSlots = 0;                 // argument slots, receiver excluded
+    string memberKey;                      // name + descriptor, for virtual lookup
+    Class* refClass = nullptr;             // referenced class, if loaded
+    Method* method = nullptr;
+    Field* field = nullptr;
     
     CPEntry() : tag(0), class_index(0), name_and_type_index(0), 
                 string_index(0), name_index(0), descriptor_index(0), int_value(0) {}
 };
 
+// Opcodes handled by the interpreters. Values below 0xCA are the JVM ones;
+// the range 0xCB..0xFD is unused by the spec and holds internal opcodes that
+// only appear in the pre-decoded instruction stream.
+enum Opcode : uint8_t {
+    OP_NOP = 0x00,
+    OP_ACONST_NULL = 0x01,
+    OP_BIPUSH = 0x10,
+    OP_SIPUSH = 0x11,
+    OP_LDC = 0x12,
+    OP_LDC_W = 0x13,
+    OP_LDC2_W = 0x14,
+    OP_ILOAD = 0x15,
+    OP_LLOAD = 0x16,
+    OP_FLOAD = 0x17,
+    OP_DLOAD = 0x18,
+    OP_ALOAD = 0x19,
+    OP_IALOAD = 0x2E,
+    OP_LALOAD = 0x2F,       // daload too
+    OP_FALOAD = 0x30,
+    OP_AALOAD = 0x32,
+    OP_BALOAD = 0x33,
+    OP_CALOAD = 0x34,
+    OP_SALOAD = 0x35,
+    OP_ISTORE = 0x36,
+    OP_LSTORE = 0x37,
+    OP_FSTORE = 0x38,
+    OP_DSTORE = 0x39,
+    OP_ASTORE = 0x3A,
+    OP_IASTORE = 0x4F,
+    OP_LASTORE = 0x50,      // dastore too
+    OP_FASTORE = 0x51,
+    OP_AASTORE = 0x53,
+    OP_BASTORE = 0x54,
+    OP_CASTORE = 0x55,
+    OP_SASTORE = 0x56,
+    OP_POP = 0x57,
+    OP_POP2 = 0x58,
+    OP_DUP = 0x59,
+    OP_DUP2 = 0x5C,
+    OP_IADD = 0x60,
+    OP_LADD = 0x61, OP_FADD = 0x62, OP_DADD = 0x63,
+    OP_ISUB = 0x64,
+    OP_LSUB = 0x65, OP_FSUB = 0x66, OP_DSUB = 0x67,
+    OP_IMUL = 0x68,
+    OP_LMUL = 0x69, OP_FMUL = 0x6A, OP_DMUL = 0x6B,
+    OP_IDIV = 0x6C,
+    OP_LDIV = 0x6D, OP_FDIV = 0x6E, OP_DDIV = 0x6F,
+    OP_LREM = 0x71, OP_FREM = 0x72, OP_DREM = 0x73,
+    OP_LNEG = 0x75, OP_FNEG = 0x76, OP_DNEG = 0x77,
+    OP_LSHL = 0x79, OP_LSHR = 0x7B, OP_LUSHR = 0x7D,
+    OP_LAND = 0x7F, OP_LOR = 0x81, OP_LXOR = 0x83,
+    OP_IINC = 0x84,
+    OP_I2L = 0x85, OP_I2F = 0x86, OP_I2D = 0x87,
+    OP_L2I = 0x88, OP_L2F = 0x89, OP_L2D = 0x8A,
+    OP_F2I = 0x8B, OP_F2L = 0x8C, OP_F2D = 0x8D,
+    OP_D2I = 0x8E, OP_D2L = 0x8F, OP_D2F = 0x90,
+    OP_LCMP = 0x94, OP_FCMPL = 0x95, OP_FCMPG = 0x96, OP_DCMPL = 0x97, OP_DCMPG = 0x98,
+    OP_IFEQ = 0x99, OP_IFNE = 0x9A, OP_IFLT = 0x9B, OP_IFGE = 0x9C, OP_IFGT = 0x9D, OP_IFLE = 0x9E,
+    OP_IF_ICMPEQ = 0x9F, OP_IF_ICMPNE = 0xA0, OP_IF_ICMPLT = 0xA1,
+    OP_IF_ICMPGE = 0xA2, OP_IF_ICMPGT = 0xA3, OP_IF_ICMPLE = 0xA4,
+    OP_IF_ACMPEQ = 0xA5, OP_IF_ACMPNE = 0xA6,
+    OP_GOTO = 0xA7,
+    OP_IRETURN = 0xAC,      // freturn too
+    OP_LRETURN = 0xAD,      // dreturn too
+    OP_ARETURN = 0xB0,
+    OP_RETURN = 0xB1,
+    OP_GETSTATIC = 0xB2,
+    OP_GETFIELD = 0xB4,
+    OP_PUTFIELD = 0xB5,
+    OP_INVOKEVIRTUAL = 0xB6,
+    OP_INVOKESPECIAL = 0xB7,
+    OP_INVOKESTATIC = 0xB8,
+    OP_INVOKEINTERFACE = 0xB9,
+    OP_NEW = 0xBB,
+    OP_NEWARRAY = 0xBC,
+    OP_ANEWARRAY = 0xBD,
+    OP_ARRAYLENGTH = 0xBE,
+    OP_ATHROW = 0xBF,
+    OP_MONITORENTER = 0xC2,
+    OP_MONITOREXIT = 0xC3,
+    OP_WIDE = 0xC4,
+
+    // Internal opcodes
+    OP_ICONST = 0xCB,       // push a (iconst_*, bipush, sipush, int ldc; fconst_*, float ldc as bits)
+    OP_LOAD = 0xCC,         // push locals[a] (iload*, fload*, aload*)
+    OP_STORE = 0xCD,        // locals[a] = pop (istore*, fstore*, astore*)
+    OP_LDC_STRING = 0xCE,   // push the interned String for constant pool entry a
+    OP_END = 0xCF,          // falling off the end of the code
+    // getfield/putfield rewrite themselves to one of these once the field is
+    // resolved; b is then the field's offset (see Field::offset)
+    OP_GETFIELD_REF = 0xD0,
+    OP_GETFIELD_INT = 0xD1,   // I, F
+    OP_GETFIELD_BYTE = 0xD2,  // B, Z
+    OP_GETFIELD_CHAR = 0xD3,
+    OP_GETFIELD_SHORT = 0xD4,
+    OP_PUTFIELD_REF = 0xD5,
+    OP_PUTFIELD_INT = 0xD6,
+    OP_PUTFIELD_BYTE = 0xD7,
+    OP_PUTFIELD_SHORT = 0xD8, // C, S
+    // Superinstructions, see fuseInsns(). Each replaces the first
+    // instruction of its sequence; the others stay in place behind it.
+    OP_LOAD_LOAD = 0xD9,            // load; load
+    OP_LOAD_LOAD_IADD_STORE = 0xDA, // load; load; iadd; store
+    OP_LOAD_LOAD_IF_ICMP = 0xDB,    // load; load; if_icmp<cond>
+    OP_IINC_GOTO = 0xDC,            // iinc; goto
+    OP_GETSTATIC_LDC_STRING = 0xDD, // getstatic; ldc "..."
+    OP_LOAD_GETFIELD_REF = 0xDE,    // load; getfield (quick), b = field offset
+    OP_LOAD_GETFIELD_INT = 0xDF,
+    OP_LOAD_ICONST = 0xE0,          // load; iconst
+    OP_LOAD_ICONST_IF_ICMP = 0xE1,  // load; iconst; if_icmp<cond>
+    // Long and double values take two slots (see wideAt())
+    OP_LCONST = 0xE2,       // push a, b: low and high word (lconst_*, dconst_*, ldc2_w)
+    OP_LOAD2 = 0xE3,        // push locals[a], locals[a + 1] (lload*, dload*)
+    OP_STORE2 = 0xE4,       // the reverse (lstore*, dstore*)
+    OP_GETFIELD_LONG = 0xE5, // J, D
+    OP_PUTFIELD_LONG = 0xE6,
+    OP_LDC_CLASS = 0xE7,    // push the Class object for constant pool entry a
+};
+
+// Monomorphic inline cache entry: the method a call site dispatched to for
+// receivers of one class. Entries never change once made, so a site moves
+// to another class by storing one pointer, and no thread can see a class
+// paired with another class's method.
+struct InlineCache {
+    Class* receiver;
+    Method* target;
+};
+
+// One pre-decoded instruction. Operands are widened and resolved once at
+// load time; branch targets are absolute indices into Method::insns.
+// handler and opcode change while other threads run the method (see
+// REWRITE), so they are atomics.
+struct Insn {
+    CopyableAtomic<const void*> handler; // threaded-code label, bound on first run
+    CopyableAtomic<uint8_t> opcode = OP_NOP;
+    bool untypedReceiver = false;  // field access whose receiver class the verifier could not prove
+    uint32_t pc = 0;               // offset of the original bytecode
+    jint a = 0;
+    jint b = 0;
+    CopyableAtomic<const InlineCache*> ic; // invokevirtual: last receiver class and its method
+};
+
+// The instruction a superinstruction starts with; what the verifier-like
+// passes and the JIT, which work one instruction at a time, see it as.
+static uint8_t unfusedOpcode(uint8_t op) {
+    switch (op) {
+        case OP_LOAD_LOAD: case OP_LOAD_LOAD_IADD_STORE: case OP_LOAD_LOAD_IF_ICMP:
+        case OP_LOAD_GETFIELD_REF: case OP_LOAD_GETFIELD_INT: case OP_LOAD_ICONST: case OP_LOAD_ICONST_IF_ICMP:
+            return OP_LOAD;
+        case OP_IINC_GOTO: return OP_IINC;
+        case OP_GETSTATIC_LDC_STRING: return OP_GETSTATIC;
+        default: return op;
+    }
+}
+
+// Mnemonic of an opcode in the pre-decoded stream, for -Xprof:insns.
+static string opName(uint8_t op) {
+    switch (op) {
+        case OP_NOP: return "nop";
+        case OP_ACONST_NULL: return "aconst_null";
+        case OP_ICONST: return "iconst";
+        case OP_LCONST: return "lconst";
+        case OP_LDC_STRING: return "ldc_string";
+        case OP_LDC_CLASS: return "ldc_class";
+        case OP_LOAD: return "load";
+        case OP_STORE: return "store";
+        case OP_LOAD2: return "load2";
+        case OP_STORE2: return "store2";
+        case OP_POP: return "pop";
+        case OP_POP2: return "pop2";
+        case OP_DUP: return "dup";
+        case OP_DUP2: return "dup2";
+        case OP_IADD: return "iadd";
+        case OP_LADD: return "ladd";
+        case OP_FADD: return "fadd";
+        case OP_DADD: return "dadd";
+        case OP_ISUB: return "isub";
+        case OP_LSUB: return "lsub";
+        case OP_FSUB: return "fsub";
+        case OP_DSUB: return "dsub";
+        case OP_IMUL: return "imul";
+        case OP_LMUL: return "lmul";
+        case OP_FMUL: return "fmul";
+        case OP_DMUL: return "dmul";
+        case OP_IDIV: return "idiv";
+        case OP_LDIV: return "ldiv";
+        case OP_FDIV: return "fdiv";
+        case OP_DDIV: return "ddiv";
+        case OP_LREM: return "lrem";
+        case OP_FREM: return "frem";
+        case OP_DREM: return "drem";
+        case OP_LNEG: return "lneg";
+        case OP_FNEG: return "fneg";
+        case OP_DNEG: return "dneg";
+        case OP_LSHL: return "lshl";
+        case OP_LSHR: return "lshr";
+        case OP_LUSHR: return "lushr";
+        case OP_LAND: return "land";
+        case OP_LOR: return "lor";
+        case OP_LXOR: return "lxor";
+        case OP_IINC: return "iinc";
+        case OP_I2L: return "i2l";
+        case OP_I2F: return "i2f";
+        case OP_I2D: return "i2d";
+        case OP_L2I: return "l2i";
+        case OP_L2F: return "l2f";
+        case OP_L2D: return "l2d";
+        case OP_F2I: return "f2i";
+        case OP_F2L: return "f2l";
+        case OP_F2D: return "f2d";
+        case OP_D2I: return "d2i";
+        case OP_D2L: return "d2l";
+        case OP_D2F: return "d2f";
+        case OP_LCMP: return "lcmp";
+        case OP_FCMPL: return "fcmpl";
+        case OP_FCMPG: return "fcmpg";
+        case OP_DCMPL: return "dcmpl";
+        case OP_DCMPG: return "dcmpg";
+        case OP_IFEQ: return "ifeq";
+        case OP_IFNE: return "ifne";
+        case OP_IFLT: return "iflt";
+        case OP_IFGE: return "ifge";
+        case OP_IFGT: return "ifgt";
+        case OP_IFLE: return "ifle";
+        case OP_IF_ICMPEQ: return "if_icmpeq";
+        case OP_IF_ICMPNE: return "if_icmpne";
+        case OP_IF_ICMPLT: return "if_icmplt";
+        case OP_IF_ICMPGE: return "if_icmpge";
+        case OP_IF_ICMPGT: return "if_icmpgt";
+        case OP_IF_ICMPLE: return "if_icmple";
+        case OP_IF_ACMPEQ: return "if_acmpeq";
+        case OP_IF_ACMPNE: return "if_acmpne";
+        case OP_GOTO: return "goto";
+        case OP_IRETURN: return "ireturn";
+        case OP_LRETURN: return "lreturn";
+        case OP_ARETURN: return "areturn";
+        case OP_RETURN: return "return";
+        case OP_END: return "end";
+        case OP_GETSTATIC: return "getstatic";
+        case OP_GETFIELD: return "getfield";
+        case OP_PUTFIELD: return "putfield";
+        case OP_GETFIELD_REF: return "getfield_ref";
+        case OP_GETFIELD_INT: return "getfield_int";
+        case OP_GETFIELD_BYTE: return "getfield_byte";
+        case OP_GETFIELD_CHAR: return "getfield_char";
+        case OP_GETFIELD_SHORT: return "getfield_short";
+        case OP_PUTFIELD_REF: return "putfield_ref";
+        case OP_PUTFIELD_INT: return "putfield_int";
+        case OP_PUTFIELD_BYTE: return "putfield_byte";
+        case OP_PUTFIELD_SHORT: return "putfield_short";
+        case OP_GETFIELD_LONG: return "getfield_long";
+        case OP_PUTFIELD_LONG: return "putfield_long";
+        case OP_INVOKEVIRTUAL: return "invokevirtual";
+        case OP_INVOKESPECIAL: return "invokespecial";
+        case OP_INVOKESTATIC: return "invokestatic";
+        case OP_INVOKEINTERFACE: return "invokeinterface";
+        case OP_NEW: return "new";
+        case OP_NEWARRAY: return "newarray";
+        case OP_ANEWARRAY: return "anewarray";
+        case OP_ARRAYLENGTH: return "arraylength";
+        case OP_ATHROW: return "athrow";
+        case OP_MONITORENTER: return "monitorenter";
+        case OP_MONITOREXIT: return "monitorexit";
+        case OP_IALOAD: return "iaload";
+        case OP_LALOAD: return "laload";
+        case OP_FALOAD: return "faload";
+        case OP_AALOAD: return "aaload";
+        case OP_BALOAD: return "baload";
+        case OP_CALOAD: return "caload";
+        case OP_SALOAD: return "saload";
+        case OP_IASTORE: return "iastore";
+        case OP_LASTORE: return "lastore";
+        case OP_FASTORE: return "fastore";
+        case OP_AASTORE: return "aastore";
+        case OP_BASTORE: return "bastore";
+        case OP_CASTORE: return "castore";
+        case OP_SASTORE: return "sastore";
+        default: {
+            char hexName[8];
+            snprintf(hexName, sizeof hexName, "0x%02x", op);
+            return hexName;
+        }
+    }
+}
+
+// Computed goto is a GNU extension; other compilers dispatch the decoded
+// stream through a switch.
+#ifndef JVM_COMPUTED_GOTO
+#if defined(__GNUC__) || defined(__clang__)
+#define JVM_COMPUTED_GOTO 1
+#else
+#define JVM_COMPUTED_GOTO 0
+#endif
+#endif
+
+// The template JIT emits x86-64 code and needs Linux mmap/mprotect.
+#ifndef JVM_JIT
+#if defined(__x86_64__) && defined(__linux__)
+#define JVM_JIT 1
+#else
+#define JVM_JIT 0
+#endif
+#endif
+
+// When buffered console output reaches the file descriptor. A full buffer
+// and VM exit always flush.
+enum class FlushPolicy {
+    Line,   // after every line, like the old cout << endl
+    Input,  // before blocking on stdin, so prompts show up first
+    Exit,   // only when full or at exit; for pipelines with no prompts
+};
+
+// Use of the class data sharing image (see SharedImage).
+enum class ShareMode {
+    Off,
+    Auto,   // use the image if it exists and matches the application
+    On,     // fail if the image cannot be used
+    Dump,   // write the image and exit
+};
+
+struct VMOptions {
+    bool switchInterpreter = false; // -Xint:switch, run raw bytecode through executeOpcode
+    size_t maxHeap = 64 << 20;      // -Xmx<size>
+    size_t stackSize = 8 << 20;     // -Xss<size>
+    bool logGC = false;             // -Xlog:gc
+    bool logClassLoad = false;      // -Xlog:class+load
+    bool jit = JVM_JIT;             // -Xjit:on|off
+    bool jitDump = false;           // -Xjit:dump
+    bool fuse = true;               // -Xfuse:on|off, superinstructions
+    bool profileInsns = false;      // -Xprof:insns
+    uint32_t sampleRate = 0;        // -Xprof:sample[=<hz>], stack samples a second; 0 for off
+    bool profileHot = false;        // -Xprof:hot, also list the hottest methods and instructions
+    bool verify = true;             // -Xverify:all|none
+    uint32_t jitCalls = 1000;       // -Xjit:threshold=<calls>,<backedges>: calls before
+    uint32_t jitBackedges = 10000;  // a method is compiled, or taken backward branches
+    ShareMode share = ShareMode::Auto; // -Xshare:auto|on|off|dump
+    FlushPolicy flush = FlushPolicy::Input; // -Xio:flush=line|input|exit
+    uint64_t budgetSteps = 0;       // -Xbudget:steps=<n>, calls and taken backward branches
+    uint32_t budgetMillis = 0;      // -Xbudget:ms=<n>, wall time; 0 for no limit
+    unsigned parseThreads = 0;      // -Xparse:threads=<n>, archive class parsing; 0 for one per core
+};
+
 struct Field {
     string name;
     string descriptor;
     bool isStatic = false;
-    ObjectPtr refValue;
+    Object* refValue = nullptr;
     jint intValue = 0;
+    uint32_t offset = 0;    // instance fields: reference slot, or byte offset into Object::data()
 
     Field() = default;
     Field(const Field& other) : name(other.name), descriptor(other.descriptor), 
                                 isStatic(other.isStatic), refValue(other.refValue), 
-                                intValue(other.intValue) {}
+                                intValue(other.intValue), offset(other.offset) {}
     Field& operator=(const Field& other) {
         if (this != &other) {
             name = other.name;
@@ -107,28 +870,479 @@ struct Field {
             isStatic = other.isStatic;
             refValue = other.refValue;
             intValue = other.intValue;
+            offset = other.offset;
         }
         return *this;
     }
 };
 
+// Guest object header. The payload follows inline: numRefs reference slots,
+// then raw bytes. Objects are allocated by Heap and never move.
 struct Object {
-    ClassPtr clazz;
-    vector<ObjectPtr> refs;
-    vector<jbyte> bytes;
-    string stringValue; // For String objects
-    
-    Object(ClassPtr c) : clazz(c) {}
+    enum Kind : uint8_t { FILLER, PLAIN, STRING, ARRAY, OBJECT_ARRAY };
+
+    // Array payload: jint length, padded so the elements start 16-byte
+    // aligned, then the elements. OBJECT_ARRAY elements are references.
+    static constexpr size_t ARRAY_HEADER = 8;
+
+    // Lock word (see JVMInstance::monitorEnter): 0 when unlocked; a thin
+    // lock is the owner's JavaThread::lockId plus RECURSION_ONE per
+    // reentry; an inflated one is a Monitor pointer plus INFLATED.
+    static constexpr uintptr_t INFLATED = 1;
+    static constexpr uintptr_t RECURSION_ONE = 2;
+    static constexpr uintptr_t RECURSION_MASK = 0xFFFE;
+
+    Class* clazz;
+    uint32_t size;      // bytes including this header, multiple of Heap::ALIGN
+    uint16_t numRefs;
+    Kind kind;
+    uint8_t marked;
+    atomic<uintptr_t> lock;
+
+    Object** refs() { return reinterpret_cast<Object**>(this + 1); }
+    char* data() { return reinterpret_cast<char*>(refs() + numRefs); }
+
+    // String payload: jint length followed by the UTF-8 bytes
+    string_view stringValue() {
+        jint len;
+        memcpy(&len, data(), sizeof(len));
+        return string_view(data() + sizeof(len), len);
+    }
+
+    jint arrayLength() {
+        jint len;
+        memcpy(&len, data(), sizeof(len));
+        return len;
+    }
+    char* elements() { return data() + ARRAY_HEADER; }
+};
+static_assert(sizeof(Object) == 24, "Object header must stay three words");
+static_assert(atomic<uintptr_t>::is_always_lock_free, "lock words need a lock-free CAS");
+
+// Array kernels behind the System.arraycopy and java.util.Arrays natives.
+// They work on whole element ranges, a vector register at a time with AVX2.
+
+// Stores count copies of the elemSize-byte value at element into dst.
+static void fillElements(char* dst, size_t count, const void* element, size_t elemSize) {
+    alignas(32) uint8_t pattern[32];
+    for (size_t j = 0; j < sizeof(pattern); j += elemSize) memcpy(pattern + j, element, elemSize);
+    size_t n = count * elemSize, i = 0;
+#if defined(__AVX2__)
+    __m256i v = _mm256_load_si256(reinterpret_cast<const __m256i*>(pattern));
+    for (; i + 32 <= n; i += 32) _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), v);
+#endif
+    for (; i + 8 <= n; i += 8) memcpy(dst + i, pattern, 8);
+    for (; i < n; ++i) dst[i] = static_cast<char>(pattern[i & 7]);
+}
+
+static bool elementsEqual(const char* a, const char* b, size_t n) {
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+        __m256i y = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)) != -1) return false;
+    }
+#endif
+    return memcmp(a + i, b + i, n - i) == 0;
+}
+
+#if defined(__AVX2__)
+static __m256i widen8(const jint* p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)); }
+static __m256i widen8(const jbyte* p) { return _mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))); }
+static __m256i widen8(const jshort* p) { return _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+static __m256i widen8(const jchar* p) { return _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p))); }
+#endif
+
+// Arrays.hashCode: h = 31 * h + e over the elements, starting from 1. The
+// vector loop keeps eight partial sums, one per lane, each scaled by 31^8
+// per block; weighting lane i by 31^(7-i) and adding them up gives the
+// same value as the scalar recurrence, mod 2^32.
+template <typename T>
+static jint hashElements(const T* e, size_t n) {
+    uint32_t h = 1;
+    size_t i = 0;
+#if defined(__AVX2__)
+    if (n >= 8) {
+        uint32_t pow[9] = { 1 };
+        for (int k = 1; k <= 8; ++k) pow[k] = pow[k - 1] * 31;
+        __m256i acc = _mm256_setzero_si256();
+        __m256i scale = _mm256_set1_epi32(static_cast<int>(pow[8]));
+        for (; i + 8 <= n; i += 8) acc = _mm256_add_epi32(_mm256_mullo_epi32(acc, scale), widen8(e + i));
+        __m256i weights = _mm256_setr_epi32(pow[7], pow[6], pow[5], pow[4], pow[3], pow[2], pow[1], pow[0]);
+        alignas(32) uint32_t lanes[8];
+        _mm256_store_si256(reinterpret_cast<__m256i*>(lanes), _mm256_mullo_epi32(acc, weights));
+        uint32_t sum = 0, hScale = 1;
+        for (uint32_t lane : lanes) sum += lane;
+        for (size_t k = 0; k < i; k += 8) hScale *= pow[8];
+        h = h * hScale + sum;
+    }
+#endif
+    for (; i < n; ++i) h = 31 * h + static_cast<uint32_t>(static_cast<jint>(e[i]));
+    return static_cast<jint>(h);
+}
+
+// The standard errors and exceptions the VM raises itself, by the simple
+// name of their class; vmErrorNames holds the binary names in this order.
+enum class VMErrorKind : uint8_t {
+    AbstractMethodError, ArithmeticException, ArrayIndexOutOfBoundsException, ArrayStoreException,
+    IllegalArgumentException, IllegalMonitorStateException, IllegalThreadStateException,
+    IncompatibleClassChangeError, InstantiationError, NegativeArraySizeException, NoClassDefFoundError,
+    NoSuchElementException, NoSuchFieldError, NoSuchMethodError, NullPointerException, NumberFormatException, OutOfMemoryError,
+    StackOverflowError, StringIndexOutOfBoundsException, VerifyError, COUNT
+};
+static const char* const vmErrorNames[] = {
+    "java/lang/AbstractMethodError", "java/lang/ArithmeticException", "java/lang/ArrayIndexOutOfBoundsException",
+    "java/lang/ArrayStoreException", "java/lang/IllegalArgumentException", "java/lang/IllegalMonitorStateException",
+    "java/lang/IllegalThreadStateException", "java/lang/IncompatibleClassChangeError", "java/lang/InstantiationError",
+    "java/lang/NegativeArraySizeException", "java/lang/NoClassDefFoundError", "java/util/NoSuchElementException",
+    "java/lang/NoSuchFieldError",
+    "java/lang/NoSuchMethodError", "java/lang/NullPointerException", "java/lang/NumberFormatException",
+    "java/lang/OutOfMemoryError", "java/lang/StackOverflowError", "java/lang/StringIndexOutOfBoundsException",
+    "java/lang/VerifyError",
+};
+static_assert(sizeof(vmErrorNames) / sizeof(vmErrorNames[0]) == size_t(VMErrorKind::COUNT), "one name per VMErrorKind");
+
+// An error raised below the interpreter loop that guest code can catch. It
+// becomes an instance of its kind's class (see JVMInstance::errorClass)
+// with message as the detail message; what() reads like that object's
+// toString(), "java.lang.X: message". Anything else thrown is internal.
+struct VMError : runtime_error {
+    VMErrorKind kind;
+    string message;
+
+    explicit VMError(VMErrorKind k, const string& msg = string())
+        : runtime_error(describe(k, msg)), kind(k), message(msg) {}
+
+    static string describe(VMErrorKind k, const string& msg) {
+        string text = vmErrorNames[size_t(k)];
+        replace(text.begin(), text.end(), '/', '.');
+        return msg.empty() ? text : text + ": " + msg;
+    }
+};
+
+// Stop-the-world coordination between guest threads. A thread is either
+// running guest code, polling requested at calls and backward branches, or
+// in a safe region (waiting for a lock, in join() or wait(), reading input)
+// where it leaves the heap alone and its frames stay as it last synced
+// them. A collection sets requested and waits until it is the only thread
+// running; the others park at their next poll until it is over.
+struct Safepoint {
+    atomic<bool> requested{ false };
+    mutex lock;
+    condition_variable changed;
+    size_t running = 1;     // the main thread
+    bool stopped = false;   // by stopTheWorld(), until resume()
+
+    void park() {
+        unique_lock<mutex> hold(lock);
+        --running;
+        changed.notify_all();
+        changed.wait(hold, [this] { return !requested; });
+        ++running;
+    }
+    void enterSafe() {
+        lock_guard<mutex> hold(lock);
+        --running;
+        changed.notify_all();
+    }
+    void leaveSafe() {
+        unique_lock<mutex> hold(lock);
+        changed.wait(hold, [this] { return !requested; });
+        ++running;
+    }
+
+    // Locks m, waiting for it in a safe region, so the thread holding it
+    // can still stop the world. The collector must not need m itself.
+    template <typename M>
+    unique_lock<M> acquire(M& m) {
+        unique_lock<M> hold(m, try_to_lock);
+        if (!hold) {
+            enterSafe();
+            hold.lock();
+            leaveSafe();
+        }
+        return hold;
+    }
+
+    // Returns once every other thread is parked or in a safe region. self
+    // is 0 for a caller that is not a guest thread (the -Xprof:sample
+    // sampler). Stops do not overlap: a guest thread finding the world
+    // stopped by another waits for it as if parked.
+    void stopTheWorld(size_t self = 1) {
+        unique_lock<mutex> hold(lock);
+        if (stopped) {
+            running -= self;
+            changed.notify_all();
+            changed.wait(hold, [this] { return !stopped; });
+            running += self;
+        }
+        stopped = requested = true;
+        changed.wait(hold, [this, self] { return running == self; });
+    }
+    void resume() {
+        lock_guard<mutex> hold(lock);
+        stopped = requested = false;
+        changed.notify_all();
+    }
+
+    struct Region {
+        Safepoint& safepoint;
+        explicit Region(Safepoint& s) : safepoint(s) { safepoint.enterSafe(); }
+        ~Region() { safepoint.leaveSafe(); }
+        Region(const Region&) = delete;
+        Region& operator=(const Region&) = delete;
+    };
+};
+
+// Thread-local allocation buffer: the part of a free span one thread bumps
+// through without touching the shared heap state.
+struct Tlab {
+    char* top = nullptr;
+    char* end = nullptr;
+};
+
+// VM-owned guest heap. Memory is committed in fixed-size regions; threads
+// bump-allocate from TLABs carved out of free spans, and a non-moving
+// mark-sweep collector turns dead objects back into free spans. Every byte of
+// a region is covered by an object or a FILLER, except unused TLAB tails,
+// which retire() formats before a collection walks the regions. lock guards
+// everything but the TLABs; the collector runs with it held and the world
+// stopped.
+struct Heap {
+    static constexpr size_t ALIGN = 16;
+    static constexpr size_t REGION_SIZE = 1 << 20;
+    static constexpr size_t TLAB_SIZE = 32 * 1024;
+    static constexpr size_t MIN_SPAN = 256;   // smaller holes stay fillers
+
+    struct Region {
+        char* start;
+        size_t size;
+    };
+    struct Span {
+        char* start;
+        char* end;
+    };
+
+    size_t maxSize;
+    bool logGC;
+    size_t committed = 0;
+    size_t liveAfterGC = 0;      // bytes surviving the last collection
+    size_t allocatedSinceGC = 0; // counted a whole TLAB at a time
+    int gcCount = 0;
+    vector<Region> regions;
+    vector<Span> freeSpans;
+    vector<Object*> markStack;
+    function<void()> collect;    // runs a full collection; set by the VM
+    Safepoint& safepoint;
+    mutex lock;
+
+    Heap(size_t max, bool log, Safepoint& sp) : maxSize(max), logGC(log), safepoint(sp) {}
+    ~Heap() {
+        for (auto& r : regions) ::operator delete(r.start);
+    }
+    Heap(const Heap&) = delete;
+    Heap& operator=(const Heap&) = delete;
+
+    Object* allocate(Tlab& tlab, Class* clazz, Object::Kind kind, uint16_t numRefs, size_t dataBytes) {
+        size_t bytes = (sizeof(Object) + numRefs * sizeof(Object*) + dataBytes + ALIGN - 1) & ~(ALIGN - 1);
+        char* p;
+        if (size_t(tlab.end - tlab.top) >= bytes) {
+            p = tlab.top;
+            tlab.top += bytes;
+        } else {
+            p = allocateSlow(tlab, bytes);
+        }
+        memset(p, 0, bytes);
+        auto obj = reinterpret_cast<Object*>(p);
+        obj->clazz = clazz;
+        obj->size = static_cast<uint32_t>(bytes);
+        obj->numRefs = numRefs;
+        obj->kind = kind;
+        return obj;
+    }
+
+    // Hands the unused tail of a TLAB back to the heap. Needs lock.
+    void retire(Tlab& tlab) {
+        if (tlab.top < tlab.end) {
+            allocatedSinceGC -= tlab.end - tlab.top;
+            makeFiller(tlab.top, tlab.end);
+            if (size_t(tlab.end - tlab.top) >= MIN_SPAN) freeSpans.push_back({tlab.top, tlab.end});
+        }
+        tlab.top = tlab.end = nullptr;
+    }
+
+    size_t used() const { return liveAfterGC + allocatedSinceGC; }
+
+    void mark(Object* obj) {
+        if (!obj || obj->marked) return;
+        obj->marked = 1;
+        markStack.push_back(obj);
+    }
+
+    // Marks everything reachable from the roots marked so far.
+    void trace() {
+        while (!markStack.empty()) {
+            Object* obj = markStack.back();
+            markStack.pop_back();
+            Object** refs = obj->refs();
+            for (uint16_t i = 0; i < obj->numRefs; ++i) mark(refs[i]);
+            if (obj->kind == Object::OBJECT_ARRAY) {
+                auto elements = reinterpret_cast<Object**>(obj->elements());
+                for (jint i = 0, n = obj->arrayLength(); i < n; ++i) mark(elements[i]);
+            }
+        }
+    }
+
+    // Frees everything trace() left unmarked.
+    void sweep() {
+        freeSpans.clear();
+        size_t live = 0;
+        for (size_t r = 0; r < regions.size();) {
+            char* p = regions[r].start;
+            char* end = p + regions[r].size;
+            char* run = nullptr;    // start of the current free run
+            bool anyLive = false;
+            while (p < end) {
+                auto obj = reinterpret_cast<Object*>(p);
+                size_t size = obj->size;
+                if (obj->kind != Object::FILLER && obj->marked) {
+                    obj->marked = 0;
+                    live += size;
+                    anyLive = true;
+                    if (run) addFree(run, p);
+                    run = nullptr;
+                } else if (!run) {
+                    run = p;
+                }
+                p += size;
+            }
+            if (!anyLive && regions[r].size != REGION_SIZE) {
+                // dead large object: give the whole region back
+                committed -= regions[r].size;
+                ::operator delete(regions[r].start);
+                regions[r] = regions.back();
+                regions.pop_back();
+                continue;
+            }
+            if (run) addFree(run, end);
+            ++r;
+        }
+        liveAfterGC = live;
+        allocatedSinceGC = 0;
+    }
+
+private:
+    // A hole can be a single ALIGN unit, less than a whole header, so a
+    // filler only uses the fields before the lock word.
+    static void makeFiller(char* start, char* end) {
+        static_assert(offsetof(Object, lock) == ALIGN, "filler fields must fit in ALIGN bytes");
+        auto filler = reinterpret_cast<Object*>(start);
+        memset(static_cast<void*>(filler), 0, offsetof(Object, lock));
+        filler->size = static_cast<uint32_t>(end - start);
+        filler->kind = Object::FILLER;
+    }
+
+    char* allocateSlow(Tlab& tlab, size_t bytes) {
+        auto hold = safepoint.acquire(lock);
+        retire(tlab);
+        if (bytes > REGION_SIZE / 2) {
+            char* p = allocateLarge(bytes);
+            allocatedSinceGC += bytes;
+            return p;
+        }
+
+        bool collected = false;
+        for (;;) {
+            for (size_t i = 0; i < freeSpans.size(); ++i) {
+                Span& span = freeSpans[i];
+                size_t avail = span.end - span.start;
+                if (avail < bytes) continue;
+                size_t take = max(bytes, min(avail, TLAB_SIZE));
+                if (avail - take < MIN_SPAN) take = avail;
+                tlab.top = span.start + bytes;
+                tlab.end = span.start + take;
+                allocatedSinceGC += take;
+                char* p = span.start;
+                if (take == avail) {
+                    freeSpans[i] = freeSpans.back();
+                    freeSpans.pop_back();
+                } else {
+                    span.start += take;
+                    makeFiller(span.start, span.end);
+                }
+                return p;
+            }
+            if (committed + REGION_SIZE <= maxSize) {
+                char* start = addRegion(REGION_SIZE);
+                makeFiller(start, start + REGION_SIZE);
+                freeSpans.push_back({start, start + REGION_SIZE});
+                continue;
+            }
+            if (collected || !collect) break;
+            collect();
+            collected = true;
+        }
+        throw VMError(VMErrorKind::OutOfMemoryError, "Java heap space");
+    }
+
+    // Objects over half a region get a region of their own.
+    char* allocateLarge(size_t bytes) {
+        if (committed + bytes > maxSize && collect) collect();
+        if (committed + bytes > maxSize) throw VMError(VMErrorKind::OutOfMemoryError, "Java heap space");
+        return addRegion(bytes);
+    }
+
+    char* addRegion(size_t size) {
+        char* start = static_cast<char*>(::operator new(size));
+        regions.push_back({start, size});
+        committed += size;
+        return start;
+    }
+
+    void addFree(char* start, char* end) {
+        makeFiller(start, end);
+        if (size_t(end - start) >= MIN_SPAN) freeSpans.push_back({start, end});
+    }
+};
+
+// One exception table entry: the first whose range covers the throwing
+// instruction and whose class (any, for 0) the exception is an instance of
+// gets control. Read as bytecode offsets; decodeMethod() turns them into
+// indices into Method::insns.
+struct ExceptionHandler {
+    uint32_t start, end;   // covered instructions, end excluded
+    uint32_t target;       // first instruction of the handler
+    uint16_t catchType;    // constant pool Class entry
 };
 
 struct Method {
     string name;
     string descriptor;
-    vector<uint8_t> code;
+    vector<uint8_t> code;    // filled on the first call, see materialize()
+    vector<Insn> insns;      // decoded form of code, see decodeMethod()
+    vector<ExceptionHandler> handlers; // exception table, in table order
+    uint32_t codeOffset = 0; // of the bytecode in owner's still encrypted class image
+    uint32_t codeLength = 0; // 0 for abstract and native methods
+    CopyableAtomic<bool> materialized; // code and insns are ready to run
+    CopyableAtomic<bool> threaded; // insns[].handler bound to the threaded loop
     int max_stack = 0;
     int max_locals = 0;
     bool isStatic = false;
+    bool isPrivate = false;
+    bool isSynchronized = false;
+    NativeFn native = nullptr;
     ClassPtr owner;
+    int vtableIndex = -1;    // slot in the vtable of owner and its subclasses
+    int itableIndex = -1;    // interface methods: slot in itables for owner
+    shared_ptr<JitCode> jitCode;   // owns jit
+    CopyableAtomic<JitCode*> jit;  // compiled code, see TemplateJit; set once complete
+    CopyableAtomic<bool> jitTried;
+    bool verified = false;   // passed verifyMethod(), runs without checks
+    string argTypes;         // of verified methods: I or R per argument slot, this included
+    char resultType = 0;     // I, J (long and double: two I slots), R or V
+    CopyableAtomic<uint32_t> invocations;
+    vector<CopyableAtomic<uint32_t>> backedges; // taken backward branches, by branch insn index
 
     Method(ClassPtr cls) : owner(cls) {}
 };
@@ -136,359 +1350,5242 @@ struct Method {
 struct Class {
     string name;
     ClassPtr superClass;
+    vector<ClassPtr> interfaces;  // direct superinterfaces
+    bool isInterface = false;
+    bool isAbstract = false;
+    bool linked = false;
+    uint16_t instanceRefs = 0;    // reference fields of an instance, inherited ones first
+    char elementType = 0;         // array classes: component descriptor, 'L' for any reference
+    uint8_t elementSize = 0;
+    ClassPtr arrayClass;          // class of arrays of this class, once created
+    uint32_t instanceBytes = 0;   // primitive field bytes of an instance
     vector<Field> fields;
     vector<Method> methods;
     unordered_map<string, int> fieldMap;
     unordered_map<string, int> methodMap;
     vector<CPEntry> constantPool;
+    vector<Method*> vtable;       // virtual methods by Method::vtableIndex
+    vector<pair<Class*, vector<Method*>>> itables; // per implemented interface
+    Object* monitorObject = nullptr; // what static synchronized methods lock
+    unordered_map<const CPEntry*, InlineCache> inlineCaches; // by method ref, see lookupVirtual()
+    const uint8_t* image = nullptr;   // encrypted class file the method bodies are read from
+    shared_ptr<const MappedFile> imageFile; // keeps image mapped; an archive's stays with the VM
 
     Class(const string& n) : name(n) {}
 };
 
-// Stack slot that can hold either int or reference
+// Stack slot that can hold either int or reference, packed into one 64-bit
+// word. References are the raw pointer (user-space addresses never use the
+// top 16 bits); other values carry a tag there and keep their payload in the
+// low 32 bits, so reading an int is a plain 32-bit load.
 struct StackSlot {
-    enum Type { INT, REF } type;
-    jint intValue;
-    ObjectPtr refValue;
-    
-    StackSlot(jint i) : type(INT), intValue(i) {}
-    StackSlot(ObjectPtr r) : type(REF), refValue(r), intValue(0) {}
-    StackSlot() : type(INT), intValue(0) {}
+    static constexpr int TAG_SHIFT = 48;
+    static constexpr uint64_t INT_TAG = uint64_t(1) << TAG_SHIFT;
+
+    uint64_t bits;
+
+    StackSlot(jint i) : bits(INT_TAG | static_cast<uint32_t>(i)) {}
+    StackSlot(Object* r) : bits(reinterpret_cast<uintptr_t>(r)) {}
+    StackSlot() : bits(INT_TAG) {}
+
+    bool isInt() const { return (bits >> TAG_SHIFT) == 1; }
+    bool isRef() const { return (bits >> TAG_SHIFT) == 0; }
+    jint asInt() const { return static_cast<jint>(static_cast<uint32_t>(bits)); }
+    Object* asRef() const { return reinterpret_cast<Object*>(static_cast<uintptr_t>(bits)); }
 };
+static_assert(sizeof(StackSlot) == 8, "StackSlot must stay one machine word");
 
-struct Frame {
-    Method* method;
-    vector<StackSlot> locals;
-    stack<StackSlot> operands;
-    int pc = 0;
+// Operand stack over a fixed slice of the frame's slot array.
+struct OperandStack {
+    StackSlot* base = nullptr;
+    StackSlot* sp = nullptr;    // next free slot
+    StackSlot* limit = nullptr;
 
-    Frame(Method* m) : method(m) {
-        if (m) {
-            locals.resize(m->max_locals);
-        }
+    void push(StackSlot v) {
+        if (sp == limit) throw runtime_error("Operand stack overflow");
+        *sp++ = v;
     }
+    StackSlot& top() { return sp[-1]; }
+    void pop() { --sp; }
+    size_t size() const { return sp - base; }
+    bool empty() const { return sp == base; }
 };
 
-struct JVMInstance {
-    stack<Frame> callStack;
-    unordered_map<string, ClassPtr> loadedClasses;
-    ObjectPtr systemOut;
+// One method activation. Locals and operands are a window into the VM stack,
+// max_locals locals followed by max_stack operands; the first locals are the
+// caller's outgoing arguments, left where the caller pushed them.
+struct Frame {
+    Method* method = nullptr;
+    StackSlot* locals = nullptr;
+    OperandStack operands;
+    int pc = 0;              // bytecode offset (switch interpreter)
+    Insn* ip = nullptr;      // resume point in the caller (threaded interpreter)
+    Object* monitor = nullptr; // entered by a synchronized method, exited on return
+};
 
-    JVMInstance() {
-        bootstrap();
-    }
+// Slots for every frame's locals and operands, reserved once at startup so
+// calls never allocate. Left uninitialized; frames set up what they use.
+struct VMStack {
+    StackSlot* base;
+    StackSlot* end;
 
-    void bootstrap() {
-        auto objClass = make_shared<Class>("java/lang/Object");
-        auto strClass = make_shared<Class>("java/lang/String");
-        strClass->superClass = objClass;
-
-
-	// nextLine()
-	Method nextLine(scannerClass);
-	nextLine.name = "nextLine";
-	nextLine.descriptor = "()Ljava/lang/String;";
-	nextLine.isStatic = false;
-	scannerClass->methods.push_back(nextLine);
-	scannerClass->methodMap["nextLine()Ljava/lang/String;"] = 0;
-
-	
-	Method nextInt(scannerClass);
-	nextInt.name = "nextInt";
-	nextInt.descriptor = "()I";
-	nextInt.isStatic = false;
-	scannerClass->methods.push_back(nextInt);
-	scannerClass->methodMap["nextInt()I"] = 1;
-
-	loadedClasses["java/util/Scanner"] = scannerClass;
-
-
-        // Add String.equals method
-        Method equalsMethod(strClass);
-        equalsMethod.name = "equals";
-        equalsMethod.descriptor = "(Ljava/lang/Object;)Z";
-        equalsMethod.isStatic = false;
-        strClass->methods.push_back(equalsMethod);
-        strClass->methodMap["equals(Ljava/lang/Object;)Z"] = 0;
-
-        auto psClass = make_shared<Class>("java/io/PrintStream");
-        psClass->superClass = objClass;
-
-        // Add PrintStream.println(String) method
-        Method printlnStrMethod(psClass);
-        printlnStrMethod.name = "println";
-        printlnStrMethod.descriptor = "(Ljava/lang/String;)V";
-        printlnStrMethod.isStatic = false;
-        psClass->methods.push_back(printlnStrMethod);
-        psClass->methodMap["println(Ljava/lang/String;)V"] = 0;
-
-        // Add PrintStream.println(int) method  
-        Method printlnIntMethod(psClass);
-        printlnIntMethod.name = "println";
-        printlnIntMethod.descriptor = "(I)V";
-        printlnIntMethod.isStatic = false;
-        psClass->methods.push_back(printlnIntMethod);
-        psClass->methodMap["println(I)V"] = 1;
-
-        auto sysClass = make_shared<Class>("java/lang/System");
-        sysClass->superClass = objClass;
+    explicit VMStack(size_t bytes) {
+        size_t slots = max<size_t>(bytes / sizeof(StackSlot), 1024);
+        base = static_cast<StackSlot*>(::operator new(slots * sizeof(StackSlot)));
+        end = base + slots;
+    }
+    ~VMStack() { ::operator delete(base); }
+    VMStack(const VMStack&) = delete;
+    VMStack& operator=(const VMStack&) = delete;
+};
 
-        Field outField;
-        outField.name = "out";
-        outField.descriptor = "Ljava/io/PrintStream;";
-        outField.isStatic = true;
+// Machine code for one method. It works on the interpreter's own frame:
+// locals and operand stack stay in the VM stack slots, so control can pass
+// between compiled code and the interpreter at any instruction. entry()
+// starts at insns[start] with the operand stack depth[start] deep, runs
+// until it reaches an instruction it does not compile (or whose checks
+// fail), stores the operand stack pointer and returns that instruction's
+// index for the interpreter to execute.
+struct JitCode {
+    using Entry = uint32_t (*)(StackSlot* locals, StackSlot* operands, StackSlot** sp, uint32_t start);
+
+    Entry entry = nullptr;
+    vector<int> depth;          // operand stack depth before each insn; -1 unreachable
+    void* memory = nullptr;
+    size_t size = 0;
+
+    JitCode() = default;
+    ~JitCode() {
+#if JVM_JIT
+        if (memory) munmap(memory, size);
+#endif
+    }
+    JitCode(const JitCode&) = delete;
+    JitCode& operator=(const JitCode&) = delete;
+};
 
-        auto psObj = make_shared<Object>(psClass);
-        outField.refValue = psObj;
-        sysClass->fields.push_back(outField);
-        sysClass->fieldMap["out"] = 0;
+#if JVM_JIT
+// Baseline template compiler for the integer subset of the instruction set:
+// constants, loads and stores, int arithmetic, iinc and branches, and in
+// verified methods the common long and double arithmetic. Each
+// instruction becomes a fixed template against the frame in memory, so the
+// only savings are dispatch and decoding, but those dominate integer loops.
+// Everything else (calls, fields, arrays, returns) exits to the interpreter.
+//
+// Registers: rbx locals, r13 operand stack base, r15 where to store the
+// stack pointer on exit, r14 StackSlot::INT_TAG; rax, rcx, rdx scratch.
+//
+// Backward branches test the safepoint flag and exit at their target when
+// it is set, so a compiled loop never holds up a collection. Under a
+// -Xbudget they also count a step and exit when the slice runs out.
+struct TemplateJit {
+    const Method& method;
+    const vector<int>& depth;
+    const atomic<bool>& safepointRequested;
+    atomic<int64_t>* budgetTicks;           // null without a budget
+    bool checked;                           // tag checks; verified methods need none
+    vector<uint8_t> code;
+    vector<size_t> start;                   // code offset of each insn
+    vector<pair<size_t, size_t>> insnJumps; // rel32 offset, target insn
+    vector<pair<size_t, size_t>> exitJumps; // rel32 offset, insn to exit at
+    vector<pair<size_t, size_t>> pollJumps; // rel32 offset, loop header insn
+
+    TemplateJit(const Method& m, const vector<int>& d, const atomic<bool>& poll, atomic<int64_t>* ticks)
+        : method(m), depth(d), safepointRequested(poll), budgetTicks(ticks), checked(!m.verified) {}
+
+    void emit(initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); }
+    void emit32(uint32_t v) { for (int i = 0; i < 4; ++i) code.push_back(static_cast<uint8_t>(v >> (8 * i))); }
+    void emit64(uint64_t v) { emit32(static_cast<uint32_t>(v)); emit32(static_cast<uint32_t>(v >> 32)); }
+
+    static constexpr uint8_t RAX = 0, RCX = 1, RDX = 2, RBX = 3, R13 = 13;
+
+    // mov reg, [base + disp] / mov [base + disp], reg; 64-bit
+    void load(uint8_t reg, uint8_t base, int32_t disp) { memoryOp(0x8B, reg, base, disp); }
+    void store(uint8_t base, int32_t disp, uint8_t reg) { memoryOp(0x89, reg, base, disp); }
+    void memoryOp(uint8_t opcode, uint8_t reg, uint8_t base, int32_t disp) {
+        emit({ static_cast<uint8_t>(0x48 | (reg >> 3) << 2 | base >> 3), opcode,
+               static_cast<uint8_t>(0x80 | (reg & 7) << 3 | (base & 7)) });
+        emit32(static_cast<uint32_t>(disp));
+    }
+    static int32_t local(int index) { return index * static_cast<int32_t>(sizeof(StackSlot)); }
+    static int32_t slot(int d) { return d * static_cast<int32_t>(sizeof(StackSlot)); }
 
-        systemOut = psObj;
+    void jumpToInsn(uint8_t cc, size_t target) {   // cc 0: jmp
+        if (cc) emit({ 0x0F, cc }); else emit({ 0xE9 });
+        insnJumps.emplace_back(code.size(), target);
+        emit32(0);
+    }
+    // Branch from insn k; backward ones go through the safepoint poll.
+    void branch(uint8_t cc, size_t k, size_t target) {
+        if (target > k) { jumpToInsn(cc, target); return; }
+        if (cc) emit({ 0x0F, cc }); else emit({ 0xE9 });
+        pollJumps.emplace_back(code.size(), target);
+        emit32(0);
+    }
+    void exitIf(uint8_t cc, size_t at) {
+        emit({ 0x0F, cc });
+        exitJumps.emplace_back(code.size(), at);
+        emit32(0);
+    }
+    void exitAt(size_t at) {
+        emit({ 0xE9 });
+        exitJumps.emplace_back(code.size(), at);
+        emit32(0);
+    }
+    // Both of rax and rcx are ints (StackSlot tags are 0 or 1).
+    void checkInts(size_t at) {
+        if (!checked) return;
+        emit({ 0x48, 0x89, 0xC2 });             // mov rdx, rax
+        emit({ 0x48, 0x21, 0xCA });             // and rdx, rcx
+        emit({ 0x48, 0x0F, 0xBA, 0xE2, 48 });   // bt rdx, 48
+        exitIf(0x83, at);                       // jnc exit
+    }
+    // reg (rax or rcx) = the long in operand slots d and d + 1; uses rdx.
+    void loadWide(uint8_t reg, int d) {
+        load(reg, R13, slot(d + 1));
+        emit({ 0x48, 0xC1, static_cast<uint8_t>(0xE0 | reg), 32 });   // shl reg, 32: drops the tag
+        emit({ 0x41, 0x8B, 0x95 }); emit32(static_cast<uint32_t>(slot(d)));   // mov edx, [r13 + d]
+        emit({ 0x48, 0x09, static_cast<uint8_t>(0xD0 | reg) });      // or reg, rdx
+    }
+    // Operand slots d and d + 1 = the long in rax, each half tagged.
+    void storeWide(int d) {
+        emit({ 0x89, 0xC2 });                   // mov edx, eax
+        emit({ 0x4C, 0x09, 0xF2 });             // or rdx, r14
+        store(R13, slot(d), RDX);
+        emit({ 0x48, 0xC1, 0xE8, 32 });         // shr rax, 32
+        tagInt();
+        store(R13, slot(d + 1), RAX);
+    }
 
-        loadedClasses["java/lang/Object"] = objClass;
-        loadedClasses["java/lang/String"] = strClass;
-        loadedClasses["java/lang/System"] = sysClass;
-        loadedClasses["java/io/PrintStream"] = psClass;
+    // rax is an int.
+    void checkInt(size_t at) {
+        if (!checked) return;
+        emit({ 0x48, 0x0F, 0xBA, 0xE0, 48 });   // bt rax, 48
+        exitIf(0x83, at);                       // jnc exit
     }
+    void tagInt() { emit({ 0x4C, 0x09, 0xF0 }); } // or rax, r14
 
-    ObjectPtr createString(const string& value) {
-        auto strClass = loadedClasses["java/lang/String"];
-        auto strObj = make_shared<Object>(strClass);
-        strObj->stringValue = value;
-        return strObj;
+    // x86 condition codes for eq, ne, lt, ge, gt, le
+    static uint8_t jcc(int cond) {
+        static const uint8_t codes[6] = { 0x84, 0x85, 0x8C, 0x8D, 0x8F, 0x8E };
+        return codes[cond];
     }
 
+    bool compileInsn(size_t k) {
+        const Insn& in = method.insns[k];
+        int d = depth[k];
+        if (d < 0) return false;
+        switch (unfusedOpcode(in.opcode)) {
+            case OP_NOP: return true;
+            case OP_ACONST_NULL:
+                emit({ 0x49, 0xC7, 0x85 }); emit32(static_cast<uint32_t>(slot(d))); emit32(0);
+                return true;
+            case OP_ICONST:
+                emit({ 0x48, 0xB8 }); emit64(StackSlot(in.a).bits);   // mov rax, imm64
+                store(R13, slot(d), RAX);
+                return true;
+            case OP_LOAD: load(RAX, RBX, local(in.a)); store(R13, slot(d), RAX); return true;
+            case OP_STORE: load(RAX, R13, slot(d - 1)); store(RBX, local(in.a), RAX); return true;
+            case OP_POP: return true;
+            case OP_DUP: load(RAX, R13, slot(d - 1)); store(R13, slot(d), RAX); return true;
+
+            // Two-slot values move as their two words, whatever those hold.
+            case OP_LCONST:
+                emit({ 0x48, 0xB8 }); emit64(StackSlot(in.a).bits);
+                store(R13, slot(d), RAX);
+                emit({ 0x48, 0xB8 }); emit64(StackSlot(in.b).bits);
+                store(R13, slot(d + 1), RAX);
+                return true;
+            case OP_LOAD2:
+                load(RAX, RBX, local(in.a)); store(R13, slot(d), RAX);
+                load(RAX, RBX, local(in.a + 1)); store(R13, slot(d + 1), RAX);
+                return true;
+            case OP_STORE2:
+                load(RAX, R13, slot(d - 2)); store(RBX, local(in.a), RAX);
+                load(RAX, R13, slot(d - 1)); store(RBX, local(in.a + 1), RAX);
+                return true;
+            case OP_POP2: return true;
+            case OP_DUP2:
+                load(RAX, R13, slot(d - 2)); store(R13, slot(d), RAX);
+                load(RAX, R13, slot(d - 1)); store(R13, slot(d + 1), RAX);
+                return true;
+
+            // Long and double arithmetic trusts the verifier for the tags.
+            case OP_LADD: case OP_LSUB: case OP_LMUL: case OP_LAND: case OP_LOR: case OP_LXOR:
+                if (checked) return false;
+                loadWide(RAX, d - 4);
+                loadWide(RCX, d - 2);
+                switch (in.opcode) {
+                    case OP_LADD: emit({ 0x48, 0x01, 0xC8 }); break;          // add rax, rcx
+                    case OP_LSUB: emit({ 0x48, 0x29, 0xC8 }); break;          // sub rax, rcx
+                    case OP_LMUL: emit({ 0x48, 0x0F, 0xAF, 0xC1 }); break;    // imul rax, rcx
+                    case OP_LAND: emit({ 0x48, 0x21, 0xC8 }); break;          // and rax, rcx
+                    case OP_LOR: emit({ 0x48, 0x09, 0xC8 }); break;           // or rax, rcx
+                    default: emit({ 0x48, 0x31, 0xC8 }); break;               // xor rax, rcx
+                }
+                storeWide(d - 4);
+                return true;
+            case OP_LNEG:
+                if (checked) return false;
+                loadWide(RAX, d - 2);
+                emit({ 0x48, 0xF7, 0xD8 });             // neg rax
+                storeWide(d - 2);
+                return true;
+            case OP_LCMP:
+                if (checked) return false;
+                loadWide(RAX, d - 4);
+                loadWide(RCX, d - 2);
+                emit({ 0x48, 0x39, 0xC8 });             // cmp rax, rcx
+                emit({ 0x0F, 0x9F, 0xC0 });             // setg al
+                emit({ 0x0F, 0x9C, 0xC1 });             // setl cl
+                emit({ 0x0F, 0xB6, 0xC0 });             // movzx eax, al
+                emit({ 0x0F, 0xB6, 0xC9 });             // movzx ecx, cl
+                emit({ 0x29, 0xC8 });                   // sub eax, ecx
+                tagInt();
+                store(R13, slot(d - 4), RAX);
+                return true;
+            case OP_I2L:
+                if (checked) return false;
+                load(RAX, R13, slot(d - 1));
+                emit({ 0x48, 0x63, 0xC0 });             // movsxd rax, eax
+                storeWide(d - 1);
+                return true;
+            case OP_L2I:
+                return !checked;                        // the low word is the int
+            case OP_DADD: case OP_DSUB: case OP_DMUL: case OP_DDIV:
+                if (checked) return false;
+                loadWide(RAX, d - 4);
+                loadWide(RCX, d - 2);
+                emit({ 0x66, 0x48, 0x0F, 0x6E, 0xC0 }); // movq xmm0, rax
+                emit({ 0x66, 0x48, 0x0F, 0x6E, 0xC9 }); // movq xmm1, rcx
+                emit({ 0xF2, 0x0F, static_cast<uint8_t>(in.opcode == OP_DADD ? 0x58 : in.opcode == OP_DSUB ? 0x5C :
+                                                        in.opcode == OP_DMUL ? 0x59 : 0x5E), 0xC1 });  // addsd/subsd/mulsd/divsd xmm0, xmm1
+                emit({ 0x66, 0x48, 0x0F, 0x7E, 0xC0 }); // movq rax, xmm0
+                storeWide(d - 4);
+                return true;
+
+            case OP_IADD: case OP_ISUB: case OP_IMUL: case OP_IDIV:
+                load(RAX, R13, slot(d - 2));
+                load(RCX, R13, slot(d - 1));
+                checkInts(k);
+                if (in.opcode == OP_IADD) emit({ 0x01, 0xC8 });             // add eax, ecx
+                else if (in.opcode == OP_ISUB) emit({ 0x29, 0xC8 });        // sub eax, ecx
+                else if (in.opcode == OP_IMUL) emit({ 0x0F, 0xAF, 0xC1 });  // imul eax, ecx
+                else {
+                    emit({ 0x85, 0xC9 });                                   // test ecx, ecx
+                    exitIf(0x84, k);                                        // jz exit: let it throw
+                    emit({ 0x83, 0xF9, 0xFF });                             // cmp ecx, -1
+                    emit({ 0x75, 0x04 });                                   // jne div
+                    emit({ 0xF7, 0xD8 });                                   // neg eax (MIN_VALUE stays)
+                    emit({ 0xEB, 0x03 });                                   // jmp done
+                    emit({ 0x99, 0xF7, 0xF9 });                             // div: cdq; idiv ecx
+                }
+                tagInt();
+                store(R13, slot(d - 2), RAX);
+                return true;
+
+            case OP_IINC:
+                load(RAX, RBX, local(in.a));
+                checkInt(k);
+                emit({ 0x05 }); emit32(static_cast<uint32_t>(in.b));   // add eax, imm32
+                tagInt();
+                store(RBX, local(in.a), RAX);
+                return true;
+
+            case OP_IFEQ: case OP_IFNE: case OP_IFLT: case OP_IFGE: case OP_IFGT: case OP_IFLE:
+                load(RAX, R13, slot(d - 1));
+                checkInt(k);
+                emit({ 0x85, 0xC0 });                   // test eax, eax
+                branch(jcc(in.opcode - OP_IFEQ), k, in.a);
+                return true;
+            case OP_IF_ICMPEQ: case OP_IF_ICMPNE: case OP_IF_ICMPLT:
+            case OP_IF_ICMPGE: case OP_IF_ICMPGT: case OP_IF_ICMPLE:
+                load(RAX, R13, slot(d - 2));
+                load(RCX, R13, slot(d - 1));
+                checkInts(k);
+                emit({ 0x39, 0xC8 });                   // cmp eax, ecx
+                branch(jcc(in.opcode - OP_IF_ICMPEQ), k, in.a);
+                return true;
+            case OP_IF_ACMPEQ: case OP_IF_ACMPNE:
+                load(RAX, R13, slot(d - 2));
+                load(RCX, R13, slot(d - 1));
+                if (checked) {
+                    emit({ 0x48, 0x89, 0xC2 });         // mov rdx, rax
+                    emit({ 0x48, 0x09, 0xCA });         // or rdx, rcx
+                    emit({ 0x48, 0xC1, 0xEA, 48 });     // shr rdx, 48
+                    exitIf(0x85, k);                    // jnz exit: not both references
+                }
+                emit({ 0x48, 0x39, 0xC8 });             // cmp rax, rcx
+                branch(in.opcode == OP_IF_ACMPEQ ? 0x84 : 0x85, k, in.a);
+                return true;
+            case OP_GOTO: branch(0, k, in.a); return true;
+            default: return false;
+        }
+    }
 
-    pair<string, string> resolveMethodRef(const vector<CPEntry>& cp, uint16_t index) {
-        if (index >= cp.size() || (cp[index].tag != 10 && cp[index].tag != 11)) {
-            return {"", ""};
+    // Compiles the method, or returns null if there is nothing worth
+    // compiling. dump lists the code of each instruction on stderr.
+    shared_ptr<JitCode> compile(bool dump) {
+        const auto& insns = method.insns;
+        size_t compiled = 0;
+
+        emit({ 0x53, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57 });   // push rbx, r13, r14, r15
+        emit({ 0x48, 0x89, 0xFB });                         // mov rbx, rdi
+        emit({ 0x49, 0x89, 0xF5 });                         // mov r13, rsi
+        emit({ 0x49, 0x89, 0xD7 });                         // mov r15, rdx
+        emit({ 0x49, 0xBE }); emit64(StackSlot::INT_TAG);   // mov r14, INT_TAG
+        emit({ 0x89, 0xC9 });                               // mov ecx, ecx
+        emit({ 0x48, 0x8D, 0x05 });                         // lea rax, [rip + table]
+        size_t tableRef = code.size();
+        emit32(0);
+        emit({ 0xFF, 0x24, 0xC8 });                         // jmp [rax + rcx*8]
+
+        vector<size_t> insnCode(insns.size() + 1);
+        for (size_t k = 0; k < insns.size(); ++k) {
+            insnCode[k] = code.size();
+            if (compileInsn(k)) {
+                ++compiled;
+            } else {
+                code.resize(insnCode[k]);
+                exitAt(k);
+            }
         }
-        
-        uint16_t classIndex = cp[index].class_index;
-        uint16_t nameAndTypeIndex = cp[index].name_and_type_index;
-        
-        string className = "";
-        if (classIndex < cp.size() && cp[classIndex].tag == 7) {
-            uint16_t nameIndex = cp[classIndex].name_index;
-            if (nameIndex < cp.size() && cp[nameIndex].tag == 1) {
-                className = cp[nameIndex].utf8_value;
+        insnCode[insns.size()] = code.size();
+        if (compiled == 0) return nullptr;
+
+        // Safepoint polls, one per loop header: exit there if requested.
+        vector<size_t> poll(insns.size(), 0);
+        for (auto& jump : pollJumps) {
+            size_t at = jump.second;
+            if (!poll[at]) {
+                poll[at] = code.size();
+                emit({ 0x48, 0xB8 }); emit64(reinterpret_cast<uintptr_t>(&safepointRequested));  // mov rax, &flag
+                emit({ 0x80, 0x38, 0x00 });             // cmp byte [rax], 0
+                exitIf(0x85, at);                       // jne exit
+                if (budgetTicks) {
+                    emit({ 0x48, 0xB8 }); emit64(reinterpret_cast<uintptr_t>(budgetTicks));    // mov rax, &ticks
+                    emit({ 0x48, 0x83, 0x28, 0x01 });   // sub qword [rax], 1
+                    exitIf(0x88, at);                   // js exit
+                }
+                jumpToInsn(0, at);
             }
+            uint32_t rel = static_cast<uint32_t>(poll[at] - (jump.first + 4));
+            memcpy(&code[jump.first], &rel, 4);
         }
-        
-        string methodName = "", methodDescriptor = "";
-        if (nameAndTypeIndex < cp.size() && cp[nameAndTypeIndex].tag == 12) {
-            uint16_t nameIdx = cp[nameAndTypeIndex].name_index;
-            uint16_t descIdx = cp[nameAndTypeIndex].descriptor_index;
-            
-            if (nameIdx < cp.size() && cp[nameIdx].tag == 1) {
-                methodName = cp[nameIdx].utf8_value;
+
+        size_t epilogue = code.size();
+        emit({ 0x41, 0x5F, 0x41, 0x5E, 0x41, 0x5D, 0x5B, 0xC3 });   // pop r15, r14, r13, rbx; ret
+
+        // Exit stubs: store the stack pointer, return the insn index.
+        vector<size_t> stub(insns.size(), 0);
+        for (auto& jump : exitJumps) {
+            size_t at = jump.second;
+            if (!stub[at]) {
+                stub[at] = code.size();
+                emit({ 0x49, 0x8D, 0x85 }); emit32(static_cast<uint32_t>(slot(max(depth[at], 0))));   // lea rax, [r13 + depth]
+                emit({ 0x49, 0x89, 0x07 });                     // mov [r15], rax
+                emit({ 0xB8 }); emit32(static_cast<uint32_t>(at));   // mov eax, at
+                emit({ 0xE9 }); emit32(static_cast<uint32_t>(epilogue - (code.size() + 4)));
             }
-            if (descIdx < cp.size() && cp[descIdx].tag == 1) {
-                methodDescriptor = cp[descIdx].utf8_value;
+            uint32_t rel = static_cast<uint32_t>(stub[at] - (jump.first + 4));
+            memcpy(&code[jump.first], &rel, 4);
+        }
+        for (auto& jump : insnJumps) {
+            uint32_t rel = static_cast<uint32_t>(insnCode[jump.second] - (jump.first + 4));
+            memcpy(&code[jump.first], &rel, 4);
+        }
+
+        code.resize((code.size() + 7) & ~size_t(7));
+        size_t table = code.size();
+        uint32_t tableRel = static_cast<uint32_t>(table - (tableRef + 4));
+        memcpy(&code[tableRef], &tableRel, 4);
+        code.resize(table + insns.size() * sizeof(uint64_t));
+
+        auto jit = make_shared<JitCode>();
+        jit->size = code.size();
+        void* mem = mmap(nullptr, jit->size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED) return nullptr;
+        jit->memory = mem;
+        auto base = static_cast<uint8_t*>(mem);
+        for (size_t k = 0; k < insns.size(); ++k) {
+            uint64_t address = reinterpret_cast<uintptr_t>(base + insnCode[k]);
+            memcpy(&code[table + k * sizeof(uint64_t)], &address, sizeof(address));
+        }
+        memcpy(mem, code.data(), code.size());
+        if (mprotect(mem, jit->size, PROT_READ | PROT_EXEC) != 0) return nullptr;
+        jit->entry = reinterpret_cast<JitCode::Entry>(mem);
+        jit->depth = depth;
+
+        if (dump) {
+            cerr << "[jit] " << method.owner->name << "." << method.name << method.descriptor << ": "
+                 << compiled << "/" << insns.size() << " insns, " << code.size() << " bytes at "
+                 << mem << "\n";
+            for (size_t k = 0; k < insns.size(); ++k) {
+                cerr << "[jit]   " << setw(4) << k << " pc " << setw(4) << insns[k].pc << "  op 0x"
+                     << hex << setfill('0') << setw(2) << int(insns[k].opcode) << " ";
+                for (size_t i = insnCode[k]; i < insnCode[k + 1]; ++i) cerr << " " << setw(2) << int(code[i]);
+                cerr << dec << setfill(' ') << "\n";
             }
         }
-        
-        return {methodName, methodDescriptor};
+        return jit;
+    }
+};
+#endif
+
+// -Xprof:insns: how often pairs and triples of adjacent instructions ran
+// back to back, to pick the sequences fuseInsns() turns into
+// superinstructions.
+struct InsnProfile {
+    const Method* method = nullptr;
+    const Insn* last = nullptr;
+    const Insn* beforeLast = nullptr;   // when last ran right after it
+    uint64_t total = 0;
+    unordered_map<uint32_t, uint64_t> pairs, triples;
+
+    // Records ip about to run in m; returns its opcode.
+    uint8_t count(const Method* m, const Insn* ip) {
+        if (ip == last) return ip->opcode;  // rerun after rewriting itself
+        ++total;
+        bool follows = m == method && ip == last + 1;
+        if (follows) {
+            ++pairs[last->opcode << 8 | ip->opcode];
+            if (beforeLast) ++triples[beforeLast->opcode << 16 | last->opcode << 8 | ip->opcode];
+        }
+        method = m;
+        beforeLast = follows ? last : nullptr;
+        last = ip;
+        return ip->opcode;
     }
 
-    ClassPtr loadClassFromFile(const string& filename) {
-
-        ifstream f(filename, ios::binary);
-        if (!f) throw runtime_error("Cannot open file: " + filename);
-        vector<uint8_t> encrypted((istreambuf_iterator<char>(f)), istreambuf_iterator<char>());
-        uint8_t key[20] = { 0xAA, 0x3F, 0xC2, 0x7D, 0x91, 0x4B, 0x6E, 0xF0, 0x12, 0x8D,
-                            0x55, 0x99, 0x0A, 0xDE, 0x6B, 0x3C, 0x47, 0x81, 0x2F, 0xB4 };
-
+    // Adds another thread's counts.
+    void merge(const InsnProfile& other) {
+        total += other.total;
+        for (auto& p : other.pairs) pairs[p.first] += p.second;
+        for (auto& t : other.triples) triples[t.first] += t.second;
+    }
 
-        MemoryFile mem(encrypted, key, sizeof(key));
+    void print(ostream& out) const {
+        out << "[prof] " << total << " instructions\n";
+        report(out, "pairs", pairs, 2);
+        report(out, "triples", triples, 3);
+    }
 
+    void report(ostream& out, const char* what, const unordered_map<uint32_t, uint64_t>& counts, int length) const {
+        vector<pair<uint64_t, uint32_t>> top;
+        for (auto& c : counts) top.emplace_back(c.second, c.first);
+        sort(top.rbegin(), top.rend());
+        if (top.size() > 20) top.resize(20);
+        out << "[prof] most frequent " << what << ":\n";
+        for (auto& t : top) {
+            uint64_t permille = total ? t.first * 1000 / total : 0;
+            out << "[prof] " << setw(12) << t.first << setw(4) << permille / 10 << "." << permille % 10 << "% ";
+            for (int i = length - 1; i >= 0; --i) out << " " << opName(static_cast<uint8_t>(t.second >> (8 * i)));
+            out << "\n";
+        }
+    }
+};
 
-        uint32_t magic = mem.read_u4();
-        if (magic != 0xCAFEBABE) throw runtime_error("Invalid magic number");
+// -Xprof:sample: guest stacks sampled at a fixed rate, outermost frame
+// first, each frame a method and the bytecode offset it stopped at.
+// Written out as collapsed stacks, one "a;b;c <samples>" line per distinct
+// stack of methods, which flamegraph.pl and similar tools draw; -Xprof:hot
+// also lists the methods and instructions most samples were in.
+struct StackProfile {
+    struct Site {
+        const Method* method;
+        uint32_t pc;
+        bool operator<(const Site& other) const {
+            return method != other.method ? method < other.method : pc < other.pc;
+        }
+    };
+    map<vector<Site>, uint64_t> stacks;
+    uint64_t samples = 0;
 
-        uint16_t minor = mem.read_u2();
-        uint16_t major = mem.read_u2();
+    void record(const vector<Site>& stack) {
+        ++stacks[stack];
+        ++samples;
+    }
 
-        uint16_t cp_count = mem.read_u2();
-        vector<CPEntry> cp_table(cp_count);
+    static string methodName(const Method* m) {
+        return m->owner->name + "." + m->name + m->descriptor;
+    }
 
-        for (int i = 1; i < cp_count; ++i) {
-            uint8_t tag = mem.read_u1();
-            cp_table[i].tag = tag;
-            switch (tag) {
-            case 1: { // UTF8
-                uint16_t len = mem.read_u2();
-                string s(len, '\0');
-                mem.read_bytes(&s[0], len);
-                cp_table[i].utf8_value = s;
-                break;
+    // Frames are named Class.method: descriptors would bring in ';', the
+    // frame separator, so overloads share a frame.
+    void writeCollapsed(ostream& out) const {
+        map<string, uint64_t> collapsed;
+        for (auto& s : stacks) {
+            string line;
+            for (auto& site : s.first) {
+                if (!line.empty()) line += ';';
+                line += site.method->owner->name + "." + site.method->name;
             }
-            case 3: cp_table[i].int_value = mem.read_u4(); break;
-            case 4: mem.read_u4(); break; // float
-            case 5: mem.read_u4(); mem.read_u4(); i++; break; // long
-            case 6: mem.read_u4(); mem.read_u4(); i++; break; // double
-            case 7: cp_table[i].name_index = mem.read_u2(); break;
-            case 8: cp_table[i].string_index = mem.read_u2(); break;
-            case 9: case 10: case 11:
-                cp_table[i].class_index = mem.read_u2();
-                cp_table[i].name_and_type_index = mem.read_u2();
-                break;
-            case 12:
-                cp_table[i].name_index = mem.read_u2();
-                cp_table[i].descriptor_index = mem.read_u2();
-                break;
-            default:
-                throw runtime_error("Unknown constant pool tag: " + to_string(tag));
+            collapsed[line] += s.second;
+        }
+        for (auto& c : collapsed) out << c.first << ' ' << c.second << '\n';
+    }
+
+    // Methods by samples in their own code (self) and with them anywhere
+    // on the stack (total), and instructions by self samples.
+    void printHot(ostream& out) const {
+        map<const Method*, pair<uint64_t, uint64_t>> methods;    // self, total
+        map<Site, uint64_t> sites;
+        for (auto& s : stacks) {
+            const Site& top = s.first.back();
+            methods[top.method].first += s.second;
+            sites[top] += s.second;
+            vector<const Method*> seen;     // recursion counts once
+            for (auto& site : s.first) {
+                if (find(seen.begin(), seen.end(), site.method) != seen.end()) continue;
+                seen.push_back(site.method);
+                methods[site.method].second += s.second;
             }
         }
+        out << "[prof] " << samples << " samples\n";
+        vector<pair<pair<uint64_t, uint64_t>, const Method*>> byMethod;
+        for (auto& m : methods) byMethod.emplace_back(m.second, m.first);
+        sort(byMethod.begin(), byMethod.end(), [](auto& a, auto& b) {
+            return a.first != b.first ? a.first > b.first : methodName(a.second) < methodName(b.second);
+        });
+        if (byMethod.size() > 20) byMethod.resize(20);
+        out << "[prof] hottest methods (self, total):\n";
+        for (auto& m : byMethod)
+            out << "[prof] " << share(m.first.first) << share(m.first.second) << "  " << methodName(m.second) << "\n";
+        vector<pair<uint64_t, Site>> bySite;
+        for (auto& s : sites) bySite.emplace_back(s.second, s.first);
+        sort(bySite.begin(), bySite.end(), [](auto& a, auto& b) {
+            return a.first != b.first ? a.first > b.first : a.second < b.second;
+        });
+        if (bySite.size() > 20) bySite.resize(20);
+        out << "[prof] hottest instructions:\n";
+        for (auto& s : bySite) {
+            const Method* m = s.second.method;
+            out << "[prof] " << share(s.first) << "  " << methodName(m) << " @" << s.second.pc;
+            if (s.second.pc < m->code.size()) out << " " << opName(m->code[s.second.pc]);
+            out << "\n";
+        }
+    }
 
-        uint16_t access_flags = mem.read_u2();
-        uint16_t this_class = mem.read_u2();
-        uint16_t super_class = mem.read_u2();
+    string share(uint64_t count) const {
+        uint64_t permille = samples ? count * 1000 / samples : 0;
+        ostringstream text;
+        text << setw(10) << count << setw(4) << permille / 10 << "." << permille % 10 << "%";
+        return text.str();
+    }
+};
 
-        string className;
-        if (this_class > 0 && this_class < cp_count && cp_table[this_class].tag == 7) {
-            uint16_t name_index = cp_table[this_class].name_index;
-            if (name_index > 0 && name_index < cp_count && cp_table[name_index].tag == 1)
-                className = cp_table[name_index].utf8_value;
+// Guest console I/O on raw stdin/stdout, bypassing iostreams. Output collects
+// in one buffer; input is read ahead in large chunks and lines are cut out of
+// it in place. Threads share it: natives hold outLock while they write and
+// inLock while they read. Batch jobs pass their own files instead.
+struct Console {
+    static constexpr size_t BUFFER_SIZE = 64 * 1024;
+
+    FlushPolicy policy;
+    int inFd, outFd;    // -1: no input, output discarded
+    mutex outLock, inLock;
+    vector<char> out;
+    size_t outLen = 0;
+    vector<char> in;
+    size_t inPos = 0, inEnd = 0;
+    bool inEOF = false;
+
+    explicit Console(FlushPolicy p, int inputFd = 0, int outputFd = 1)
+        : policy(p), inFd(inputFd), outFd(outputFd), out(BUFFER_SIZE), in(BUFFER_SIZE) {}
+    ~Console() { flush(); }
+    Console(const Console&) = delete;
+    Console& operator=(const Console&) = delete;
+
+    void writeFully(const char* data, size_t len) {
+        while (len > 0 && outFd >= 0) {
+            auto n = JVM_WRITE(outFd, data, static_cast<unsigned>(len));
+            if (n <= 0) return;   // nowhere to report a broken stdout; drop the rest
+            data += n;
+            len -= n;
+        }
+    }
+
+    void flush() {
+        writeFully(out.data(), outLen);
+        outLen = 0;
+    }
+
+    void write(const char* data, size_t len) {
+        if (outLen + len > out.size()) {
+            flush();
+            if (len > out.size()) { writeFully(data, len); return; }
+        }
+        memcpy(out.data() + outLen, data, len);
+        outLen += len;
+    }
+    void write(string_view text) { write(text.data(), text.size()); }
+
+    void writeInt(jlong value) {
+        char digits[21];
+        char* end = digits + sizeof digits;
+        char* p = end;
+        uint64_t magnitude = value < 0 ? 0 - static_cast<uint64_t>(value) : static_cast<uint64_t>(value);
+        do { *--p = static_cast<char>('0' + magnitude % 10); magnitude /= 10; } while (magnitude);
+        if (value < 0) *--p = '-';
+        write(p, end - p);
+    }
+
+    void newline() {
+        write("\n", 1);
+        if (policy == FlushPolicy::Line) flush();
+    }
+
+    // Pulls more input, keeping the unread tail. Returns false at EOF.
+    bool refill() {
+        if (inEOF || inFd < 0) return false;
+        if (policy != FlushPolicy::Exit) {
+            lock_guard<mutex> hold(outLock);
+            flush();
+        }
+        if (inPos > 0) {
+            memmove(in.data(), in.data() + inPos, inEnd - inPos);
+            inEnd -= inPos;
+            inPos = 0;
+        }
+        if (inEnd == in.size()) in.resize(in.size() * 2);   // one very long line
+        auto n = JVM_READ(inFd, in.data() + inEnd, static_cast<unsigned>(in.size() - inEnd));
+        if (n <= 0) { inEOF = true; return false; }
+        inEnd += n;
+        return true;
+    }
+
+    // Next line without its '\n'; empty at end of input.
+    string readLine() {
+        size_t scanned = inPos;
+        for (;;) {
+            auto nl = static_cast<const char*>(memchr(in.data() + scanned, '\n', inEnd - scanned));
+            if (nl) {
+                string line(in.data() + inPos, nl - (in.data() + inPos));
+                inPos = nl - in.data() + 1;
+                return line;
+            }
+            scanned = inEnd - inPos;   // offsets shift to 0 when refill compacts
+            if (!refill()) {
+                string rest(in.data() + inPos, inEnd - inPos);
+                inPos = inEnd;
+                return rest;
+            }
+        }
+    }
+
+    // Next whitespace-delimited token, left in place like operator>>; false
+    // if input ends first.
+    bool readToken(string_view& token) {
+        for (;;) {
+            while (inPos < inEnd && isspace(static_cast<unsigned char>(in[inPos]))) ++inPos;
+            if (inPos < inEnd) break;
+            if (!refill()) return false;
+        }
+        size_t end = inPos;
+        for (;;) {
+            while (end < inEnd && !isspace(static_cast<unsigned char>(in[end]))) ++end;
+            if (end < inEnd) break;
+            size_t length = end - inPos;
+            if (!refill()) break;
+            end = length;
+        }
+        token = string_view(in.data() + inPos, end - inPos);
+        inPos = end;
+        return true;
+    }
+};
+
+// Inflated lock. An object's thin lock moves here the first time threads
+// contend for it or one waits on it, and stays until the object dies. The
+// mutex guards only these fields; threads wait for ownership on the
+// condition variables, in a safe region.
+struct Monitor {
+    mutex lock;
+    condition_variable released;    // owner became 0
+    condition_variable notified;    // Object.notify()
+    uintptr_t owner = 0;            // JavaThread::lockId, 0 when free
+    uintptr_t recursions = 0;
+    Object* object;
+
+    explicit Monitor(Object* obj) : object(obj) {}
+};
+
+// A guest thread: the frames and allocation buffer of one OS thread. The
+// main thread's is made with the VM, the others by Thread.start().
+struct JavaThread {
+    enum Status : jint { NEW, STARTED, TERMINATED };   // Thread.threadStatus
+
+    VMStack stack;
+    vector<Frame> callStack;   // reserved up front, never reallocated
+    Tlab tlab;
+    uintptr_t lockId;          // in lock words, above Object::RECURSION_MASK
+    string name;
+    Object* object = nullptr;  // its java.lang.Thread
+    Object* exception = nullptr; // being thrown, kept reachable while frames unwind
+    InsnProfile insnProfile;   // -Xprof:insns, merged into the VM's at exit
+    bool polled = false;       // parked at a safepoint poll, running guest code
+
+    JavaThread(size_t stackSize, uint32_t id, string threadName)
+        : stack(stackSize), lockId(uintptr_t(id) << 16), name(move(threadName)) {
+        callStack.reserve(max<size_t>((stack.end - stack.base) / 4, 256));
+    }
+};
+
+// A class parsed from its class file but not yet registered or linked,
+// with the names of the supertypes it links against.
+struct ParsedClass {
+    ClassPtr clazz;
+    string superName;
+    vector<string> interfaceNames;
+};
+
+// Decrypts and parses the classes of an archive on helper threads, in file
+// order, ahead of their first use. Only parsing moves off the loading
+// thread: loadClass still defines and links each class when it is first
+// referenced, so classes link in the same order as with serial loading.
+struct ClassPrefetcher {
+    using ParseFn = function<ParsedClass(const uint8_t*, size_t, vector<uint8_t>&)>;
+    enum State { WAITING, PARSING, DONE, TAKEN };
+
+    struct Slot {
+        uint32_t offset, length;
+        State state = WAITING;
+        ParsedClass parsed;
+        exception_ptr error;    // rethrown by take()
+    };
+
+    const ClassArchive& archive;
+    ParseFn parse;
+    vector<Slot> slots;         // in file order
+    unordered_map<string, size_t> byName;
+    mutex lock;                 // slot states and results
+    condition_variable parsed;  // a slot became DONE
+    size_t next = 0;            // no slot before it is WAITING
+    bool stopping = false;
+    vector<std::thread> helpers;
+
+    // threads counts the loading thread, which parses what it needs first.
+    ClassPrefetcher(const ClassArchive& arch, unsigned threads, ParseFn fn)
+        : archive(arch), parse(move(fn)) {
+        for (auto& e : archive.entries()) {
+            if (byName.emplace(e.name, slots.size()).second)
+                slots.push_back(Slot{ e.offset, e.length, WAITING, {}, {} });
+        }
+        for (unsigned i = 1; i < threads && i < slots.size(); ++i)
+            helpers.emplace_back([this] { work(); });
+    }
+
+    ~ClassPrefetcher() {
+        {
+            lock_guard<mutex> hold(lock);
+            stopping = true;
+        }
+        for (auto& t : helpers) t.join();
+    }
+
+    void work() {
+        vector<uint8_t> buffer;
+        unique_lock<mutex> hold(lock);
+        for (;;) {
+            while (next < slots.size() && slots[next].state != WAITING) ++next;
+            if (stopping || next == slots.size()) return;
+            Slot& slot = slots[next++];
+            slot.state = PARSING;
+            hold.unlock();
+            parseSlot(slot, buffer);
+            hold.lock();
+            slot.state = DONE;
+            parsed.notify_all();
+        }
+    }
+
+    void parseSlot(Slot& slot, vector<uint8_t>& buffer) {
+        try {
+            slot.parsed = parse(archive.file.data + slot.offset, slot.length, buffer);
+        } catch (...) {
+            slot.error = current_exception();
+        }
+    }
+
+    // Moves the named class out, parsing it here if no helper has started
+    // on it yet. False when the archive has no such class or it was taken
+    // before; the caller then loads it the serial way.
+    bool take(const string& name, ParsedClass& out, vector<uint8_t>& buffer) {
+        unique_lock<mutex> hold(lock);
+        auto it = byName.find(name);
+        if (it == byName.end()) return false;
+        Slot& slot = slots[it->second];
+        if (slot.state == TAKEN) return false;
+        if (slot.state == WAITING) {
+            slot.state = PARSING;
+            hold.unlock();
+            parseSlot(slot, buffer);
+            hold.lock();
+        } else {
+            parsed.wait(hold, [&] { return slot.state == DONE; });
+        }
+        slot.state = TAKEN;
+        if (slot.error) rethrow_exception(slot.error);
+        out = move(slot.parsed);
+        return true;
+    }
+};
+
+// Thrown when a program has used up its -Xbudget. It ends the program
+// rather than being an exception the program could handle.
+struct BudgetExceeded : runtime_error {
+    using runtime_error::runtime_error;
+};
+
+// A guest exception no frame of one interpreter activation caught, on its
+// way to the native that called into guest code or out of the thread. The
+// object is in JavaThread::exception; what() is its toString().
+struct GuestException : runtime_error {
+    using runtime_error::runtime_error;
+};
+
+struct JVMInstance {
+    // The guest thread the calling OS thread runs.
+    static inline thread_local JavaThread* currentThread = nullptr;
+
+    unordered_map<string, ClassPtr> loadedClasses;
+    Object* systemOut = nullptr;
+    Class* primitiveArrays[12] = {};    // by newarray type code
+    Class* stringClass = nullptr;
+    unordered_map<string, NativeFn> natives; // "class.name(descriptor)" -> native
+    unordered_map<string, Object*> internTable;
+    VMOptions options;
+    Safepoint safepoint;
+    Heap heap;
+    Console console;
+    InsnProfile insnProfile;     // every thread's, once they have finished
+    StackProfile stackProfile;   // -Xprof:sample, written by the sampler with the world stopped
+    string profilePath;          // where the collapsed stacks go
+    std::thread sampler;
+    mutex samplerLock;
+    condition_variable samplerWake;
+    bool samplerDone = false;
+    unique_ptr<JavaThread> mainThread;
+    vector<JavaThread*> threads;    // live ones; only running threads change it
+    mutex threadsLock;              // threads and Thread.threadStatus
+    condition_variable threadsChanged;
+    vector<std::thread> osThreads;  // joined before the VM goes away
+    uint32_t lastThreadId = 0;
+    uint32_t threadNumber = 0;      // for "Thread-<n>" names
+    // Class loading and linking, constant pool resolution and interned
+    // strings. Resolved entries are read without it once resolved is set
+    // (acquire; resolution stores it with release).
+    recursive_mutex classLock;
+    mutex jitLock;
+    mutex inlineCacheLock;
+    mutex rewriteLock;              // quickening of instructions, see REWRITE
+    mutex monitorsLock;
+    vector<unique_ptr<Monitor>> monitors;   // inflated locks, freed with their objects
+    Class* threadClass = nullptr;
+    Class* classClass = nullptr;
+    Method* threadRun = nullptr;    // Thread.run(), Runnable.run()
+    Method* runnableRun = nullptr;
+    uint32_t threadTargetSlot = 0, threadStatusOffset = 0;
+    // java.lang.Throwable and the classes of VMErrors by kind;
+    // Throwable.detailMessage is reference slot throwableMessageSlot.
+    Class* throwableClass = nullptr;
+    Class* vmErrorClasses[size_t(VMErrorKind::COUNT)] = {};
+    uint32_t throwableMessageSlot = 0;
+    vector<uint8_t> classBuffer; // decrypted class file, reused across loads
+    unique_ptr<ClassArchive> archive;
+    unique_ptr<ClassPrefetcher> prefetcher;  // parses archive classes ahead, see -Xparse:threads
+    shared_ptr<const SharedImage> shared;  // read-only, so batch jobs running one application share it
+    string classDir;             // where single-file applications find more classes
+    // -Xbudget: steps left in the current slice, shared by the VM's threads
+    // and compiled loops, and what budgetTick() has handed out in slices.
+    atomic<int64_t> budgetTicks{ INT64_MAX };
+    uint64_t budgetIssued = INT64_MAX;
+    chrono::steady_clock::time_point budgetDeadline;
+    mutex budgetLock;
+
+    JVMInstance(const VMOptions& opts = VMOptions(), int inFd = 0, int outFd = 1)
+        : options(opts), heap(opts.maxHeap, opts.logGC, safepoint), console(opts.flush, inFd, outFd) {
+        mainThread = make_unique<JavaThread>(options.stackSize, ++lastThreadId, "main");
+        currentThread = mainThread.get();
+        threads.push_back(currentThread);
+        heap.collect = [this] { collectGarbage("Allocation Failure"); };
+        if (options.switchInterpreter || !JVM_JIT) options.jit = false;   // only the threaded loop enters compiled code
+        if (options.profileInsns) options.jit = options.fuse = false;    // count what the plain stream executes
+        if (hasBudget()) {
+            budgetTicks = 0;
+            budgetIssued = 0;
+            budgetDeadline = chrono::steady_clock::now() + chrono::milliseconds(options.budgetMillis);
+        }
+        bootstrap();
+    }
+
+    ~JVMInstance() {
+        if (options.profileInsns) {
+            insnProfile.merge(mainThread->insnProfile);
+            insnProfile.print(cerr);
+        }
+        if (options.sampleRate && !profilePath.empty()) {
+            ofstream out(profilePath);
+            stackProfile.writeCollapsed(out);
+            if (!out) cerr << "[prof] cannot write " << profilePath << endl;
+            else cerr << "[prof] " << stackProfile.samples << " samples written to " << profilePath << endl;
+            if (options.profileHot) stackProfile.printHot(cerr);
+        }
+    }
+
+    void bootstrap() {
+        auto objClass = make_shared<Class>("java/lang/Object");
+        loadedClasses["java/lang/Object"] = objClass;
+
+        registerNatives();
+
+        auto sysClass = bootClass("java/lang/System");
+
+        Field outField;
+        outField.name = "out";
+        outField.descriptor = "Ljava/io/PrintStream;";
+        outField.isStatic = true;
+
+        auto psObj = heap.allocate(currentThread->tlab, bootClass("java/io/PrintStream").get(), Object::PLAIN, 0, 0);
+        outField.refValue = psObj;
+        sysClass->fields.push_back(outField);
+        sysClass->fieldMap["out"] = 0;
+
+        systemOut = psObj;
+        stringClass = bootClass("java/lang/String").get();
+        classClass = bootClass("java/lang/Class").get();
+
+        // java.lang.Thread keeps the Runnable it was made with and whether
+        // it has started or finished (JavaThread::Status).
+        auto runnable = bootClass("java/lang/Runnable");
+        runnable->isInterface = true;
+        Method run(runnable);
+        run.name = "run";
+        run.descriptor = "()V";
+        runnable->methods.push_back(run);
+        runnable->methodMap["run()V"] = 0;
+        threadClass = bootClass("java/lang/Thread").get();
+        threadClass->interfaces.push_back(runnable);
+        for (auto spec : { make_pair("target", "Ljava/lang/Runnable;"), make_pair("threadStatus", "I") }) {
+            Field field;
+            field.name = spec.first;
+            field.descriptor = spec.second;
+            threadClass->fields.push_back(field);
+            threadClass->fieldMap[field.name] = static_cast<int>(threadClass->fields.size() - 1);
+        }
+
+        // The standard exceptions the VM raises, their superclasses and a few
+        // more that guest code commonly catches, each after its superclass.
+        static const pair<const char*, const char*> throwables[] = {
+            { "Throwable", "Object" }, { "Exception", "Throwable" }, { "Error", "Throwable" },
+            { "RuntimeException", "Exception" }, { "InterruptedException", "Exception" },
+            { "ArithmeticException", "RuntimeException" }, { "NullPointerException", "RuntimeException" },
+            { "ClassCastException", "RuntimeException" }, { "ArrayStoreException", "RuntimeException" },
+            { "NegativeArraySizeException", "RuntimeException" }, { "IllegalStateException", "RuntimeException" },
+            { "IllegalMonitorStateException", "RuntimeException" }, { "UnsupportedOperationException", "RuntimeException" },
+            { "IndexOutOfBoundsException", "RuntimeException" },
+            { "ArrayIndexOutOfBoundsException", "IndexOutOfBoundsException" },
+            { "StringIndexOutOfBoundsException", "IndexOutOfBoundsException" },
+            { "IllegalArgumentException", "RuntimeException" }, { "NumberFormatException", "IllegalArgumentException" },
+            { "IllegalThreadStateException", "IllegalArgumentException" },
+            { "VirtualMachineError", "Error" }, { "OutOfMemoryError", "VirtualMachineError" },
+            { "StackOverflowError", "VirtualMachineError" },
+            { "LinkageError", "Error" }, { "VerifyError", "LinkageError" }, { "NoClassDefFoundError", "LinkageError" },
+            { "IncompatibleClassChangeError", "LinkageError" }, { "NoSuchMethodError", "IncompatibleClassChangeError" },
+            { "AbstractMethodError", "IncompatibleClassChangeError" }, { "InstantiationError", "IncompatibleClassChangeError" },
+            { "NoSuchFieldError", "IncompatibleClassChangeError" },
+        };
+        for (auto& spec : throwables) {
+            auto cls = bootClass(string("java/lang/") + spec.first);
+            cls->superClass = loadedClasses[string("java/lang/") + spec.second];
+        }
+        bootClass("java/util/NoSuchElementException")->superClass = loadedClasses["java/lang/RuntimeException"];
+        throwableClass = loadedClasses["java/lang/Throwable"].get();
+        Field message;
+        message.name = "detailMessage";
+        message.descriptor = "Ljava/lang/String;";
+        throwableClass->fields.push_back(message);
+        throwableClass->fieldMap[message.name] = static_cast<int>(throwableClass->fields.size() - 1);
+        for (size_t k = 0; k < size_t(VMErrorKind::COUNT); ++k) {
+            vmErrorClasses[k] = loadedClasses[vmErrorNames[k]].get();
+            if (!vmErrorClasses[k]) throw runtime_error(string("No boot class for ") + vmErrorNames[k]);
+        }
+
+        for (auto& entry : loadedClasses) linkClass(*entry.second);
+
+        threadTargetSlot = findField(threadClass, "target")->offset;
+        throwableMessageSlot = findField(throwableClass, "detailMessage")->offset;
+        threadStatusOffset = findField(threadClass, "threadStatus")->offset;
+        threadRun = findMethod(threadClass, "run()V");
+        runnableRun = &runnable->methods[0];
+
+        // newarray operand: T_BOOLEAN (4) .. T_LONG (11)
+        for (int type = 4; type <= 11; ++type)
+            primitiveArrays[type] = arrayClass(string("[") + "ZCFDBSIJ"[type - 4]).get();
+    }
+
+    // Array class for a descriptor like "[I" or "[Ljava/lang/String;",
+    // created on first use. Component classes are not loaded for it.
+    ClassPtr arrayClass(const string& name) {
+        auto hold = safepoint.acquire(classLock);
+        auto it = loadedClasses.find(name);
+        if (it != loadedClasses.end()) return it->second;
+
+        char type = name.size() >= 2 ? name[1] : 0;
+        uint8_t size;
+        switch (type) {
+            case 'Z': case 'B': size = 1; break;
+            case 'C': case 'S': size = 2; break;
+            case 'I': case 'F': size = 4; break;
+            case 'J': case 'D': size = 8; break;
+            case 'L':
+                if (name.back() != ';') return nullptr;
+                size = sizeof(Object*);
+                break;
+            case '[': type = 'L'; size = sizeof(Object*); break;
+            default: return nullptr;
+        }
+        if (name.size() != 2 && type != 'L') return nullptr;
+
+        auto clazz = make_shared<Class>(name);
+        clazz->superClass = loadedClasses["java/lang/Object"];
+        clazz->elementType = type;
+        clazz->elementSize = size;
+        loadedClasses[name] = clazz;
+        linkClass(*clazz);
+        return clazz;
+    }
+
+    Class* arrayOf(Class* component) {
+        auto hold = safepoint.acquire(classLock);
+        if (!component->arrayClass) {
+            const string& name = component->name;
+            component->arrayClass = arrayClass(name[0] == '[' ? "[" + name : "[L" + name + ";");
+        }
+        return component->arrayClass.get();
+    }
+
+    Object* newArray(Class* arrayClass, jint length) {
+        if (length < 0) throw VMError(VMErrorKind::NegativeArraySizeException, to_string(length));
+        size_t bytes = Object::ARRAY_HEADER + static_cast<size_t>(length) * arrayClass->elementSize;
+        if (bytes > UINT32_MAX - sizeof(Object) - Heap::ALIGN)
+            throw VMError(VMErrorKind::OutOfMemoryError, "Requested array size exceeds VM limit");
+        Object::Kind kind = arrayClass->elementType == 'L' ? Object::OBJECT_ARRAY : Object::ARRAY;
+        Object* array = heap.allocate(currentThread->tlab, arrayClass, kind, 0, bytes);
+        memcpy(array->data(), &length, sizeof(length));
+        return array;
+    }
+
+    // Built-in class with java/lang/Object as its superclass, created on first use.
+    ClassPtr bootClass(const string& name) {
+        auto& clazz = loadedClasses[name];
+        if (!clazz) {
+            clazz = make_shared<Class>(name);
+            clazz->superClass = loadedClasses["java/lang/Object"];
+        }
+        return clazz;
+    }
+
+    // Binds className.name+descriptor to fn. With a class name, a stub Method
+    // is added to that built-in class so calls resolve to it; an empty class
+    // name binds the method in whatever class declares it.
+    void defineNative(const string& className, const string& name, const string& descriptor,
+                      bool isStatic, NativeFn fn) {
+        natives[className + "." + name + descriptor] = fn;
+        if (className.empty()) return;
+
+        auto clazz = bootClass(className);
+        Method m(clazz);
+        m.name = name;
+        m.descriptor = descriptor;
+        m.isStatic = isStatic;
+        m.native = fn;
+        clazz->methods.push_back(m);
+        clazz->methodMap[name + descriptor] = clazz->methods.size() - 1;
+    }
+
+    NativeFn findNative(const string& className, const string& name, const string& descriptor) const {
+        auto it = natives.find(className + "." + name + descriptor);
+        if (it == natives.end()) it = natives.find("." + name + descriptor);
+        return it != natives.end() ? it->second : nullptr;
+    }
+
+    // String contents of a slot, or nullptr if it does not hold a String.
+    Object* stringRef(StackSlot slot) const {
+        return slot.isRef() && slot.asRef() && slot.asRef()->clazz == stringClass ? slot.asRef() : nullptr;
+    }
+
+    static jint parseInt(string_view text) {
+        size_t i = 0;
+        bool negative = false;
+        if (!text.empty() && (text[0] == '-' || text[0] == '+')) negative = text[i++] == '-';
+        if (i == text.size()) throw VMError(VMErrorKind::NumberFormatException, "\"" + string(text) + "\"");
+        int64_t value = 0;
+        for (; i < text.size(); ++i) {
+            if (text[i] < '0' || text[i] > '9') throw VMError(VMErrorKind::NumberFormatException, "\"" + string(text) + "\"");
+            value = value * 10 + (text[i] - '0');
+            if (value > int64_t(INT32_MAX) + 1) throw VMError(VMErrorKind::NumberFormatException, "\"" + string(text) + "\"");
+        }
+        if (negative) value = -value;
+        if (value > INT32_MAX) throw VMError(VMErrorKind::NumberFormatException, "\"" + string(text) + "\"");
+        return static_cast<jint>(value);
+    }
+
+    // Double.toString and Float.toString: the fewest digits that read back
+    // as v, plain for magnitudes from 10^-3 up to 10^7 and as d.dddE<n>
+    // otherwise, always with a digit after the point.
+    template<class F> static string floatingString(F v) {
+        if (v != v) return "NaN";
+        if (v == numeric_limits<F>::infinity()) return "Infinity";
+        if (v == -numeric_limits<F>::infinity()) return "-Infinity";
+        if (v == 0) return signbit(v) ? "-0.0" : "0.0";
+        char buf[64];
+        char* end = to_chars(buf, buf + sizeof buf, v, chars_format::scientific).ptr;
+        string_view text(buf, end - buf);     // [-]d[.ddd]e<+|->dd
+        string sign(v < 0 ? "-" : "");
+        if (v < 0) text.remove_prefix(1);
+        size_t e = text.find('e');
+        int exponent = atoi(string(text.substr(e + 1)).c_str());
+        string digits(1, text[0]);
+        if (e > 2) digits += text.substr(2, e - 2);
+        F magnitude = v < 0 ? -v : v;
+        if (magnitude >= F(1e-3) && magnitude < F(1e7)) {
+            if (exponent < 0) return sign + "0." + string(-exponent - 1, '0') + digits;
+            if (digits.size() <= static_cast<size_t>(exponent) + 1) digits.append(exponent + 2 - digits.size(), '0');
+            return sign + digits.substr(0, exponent + 1) + "." + digits.substr(exponent + 1);
+        }
+        return sign + digits.substr(0, 1) + "." + (digits.size() > 1 ? digits.substr(1) : "0") + "E" + to_string(exponent);
+    }
+
+    // Natives pop their arguments (receiver first pushed, so popped last) and
+    // push their result. The caller has already checked the stack depth.
+    void registerNatives() {
+        defineNative("java/lang/Object", "<init>", "()V", false,
+            [](JVMInstance&, OperandStack& st) { st.pop(); });
+
+        // console input(): prompt, then read one line
+        defineNative("", "input", "(Ljava/lang/String;)Ljava/lang/String;", true,
+            [](JVMInstance& vm, OperandStack& st) {
+                Object* prompt = vm.stringRef(st.top()); st.pop();
+                if (prompt) {
+                    lock_guard<mutex> hold(vm.console.outLock);
+                    vm.console.write(prompt->stringValue());
+                }
+                st.push(StackSlot(vm.createString(vm.readLine())));
+            });
+
+        // Each print holds the output lock, so lines from different threads
+        // do not mix.
+        defineNative("java/io/PrintStream", "println", "(Ljava/lang/String;)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                Object* str = vm.stringRef(st.top()); st.pop(); st.pop();
+                if (str) { vm.console.write(str->stringValue()); vm.console.newline(); }
+            });
+        defineNative("java/io/PrintStream", "println", "(I)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                StackSlot arg = st.top(); st.pop(); st.pop();
+                if (arg.isInt()) { vm.console.writeInt(arg.asInt()); vm.console.newline(); }
+            });
+        // long, double and float arguments: two int slots, or one holding the bits
+        defineNative("java/io/PrintStream", "println", "(J)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                jlong v = longAt(st.sp - 2); st.sp -= 3;
+                vm.console.writeInt(v); vm.console.newline();
+            });
+        defineNative("java/io/PrintStream", "println", "(D)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                jdouble v = doubleAt(st.sp - 2); st.sp -= 3;
+                vm.console.write(floatingString(v)); vm.console.newline();
+            });
+        defineNative("java/io/PrintStream", "println", "(F)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                jfloat v = floatAt(st.top()); st.pop(); st.pop();
+                vm.console.write(floatingString(v)); vm.console.newline();
+            });
+        defineNative("java/io/PrintStream", "println", "()V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                st.pop();
+                vm.console.newline();
+            });
+        defineNative("java/io/PrintStream", "print", "(Ljava/lang/String;)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                Object* str = vm.stringRef(st.top()); st.pop(); st.pop();
+                if (str) vm.console.write(str->stringValue());
+            });
+        defineNative("java/io/PrintStream", "print", "(I)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                StackSlot arg = st.top(); st.pop(); st.pop();
+                if (arg.isInt()) vm.console.writeInt(arg.asInt());
+            });
+        defineNative("java/io/PrintStream", "print", "(J)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                jlong v = longAt(st.sp - 2); st.sp -= 3;
+                vm.console.writeInt(v);
+            });
+        defineNative("java/io/PrintStream", "print", "(D)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                jdouble v = doubleAt(st.sp - 2); st.sp -= 3;
+                vm.console.write(floatingString(v));
+            });
+        defineNative("java/io/PrintStream", "print", "(F)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                lock_guard<mutex> hold(vm.console.outLock);
+                jfloat v = floatAt(st.top()); st.pop(); st.pop();
+                vm.console.write(floatingString(v));
+            });
+
+        defineNative("java/lang/String", "equals", "(Ljava/lang/Object;)Z", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                Object* other = vm.stringRef(st.top()); st.pop();
+                Object* self = vm.stringRef(st.top()); st.pop();
+                st.push(StackSlot(self && other && self->stringValue() == other->stringValue() ? 1 : 0));
+            });
+        defineNative("java/lang/String", "length", "()I", false,
+            [](JVMInstance&, OperandStack& st) {
+                Object* self = st.top().asRef(); st.pop();
+                st.push(StackSlot(static_cast<jint>(self->stringValue().size())));
+            });
+        defineNative("java/lang/String", "isEmpty", "()Z", false,
+            [](JVMInstance&, OperandStack& st) {
+                Object* self = st.top().asRef(); st.pop();
+                st.push(StackSlot(self->stringValue().empty() ? 1 : 0));
+            });
+        // Strings hold UTF-8, so indices count bytes; exact for ASCII text.
+        defineNative("java/lang/String", "charAt", "(I)C", false,
+            [](JVMInstance&, OperandStack& st) {
+                jint index = st.top().asInt(); st.pop();
+                Object* self = st.top().asRef(); st.pop();
+                string_view value = self->stringValue();
+                if (index < 0 || static_cast<size_t>(index) >= value.size())
+                    throw VMError(VMErrorKind::StringIndexOutOfBoundsException, "index " + to_string(index));
+                st.push(StackSlot(static_cast<jint>(static_cast<uint8_t>(value[index]))));
+            });
+        defineNative("java/lang/String", "intern", "()Ljava/lang/String;", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                Object* self = st.top().asRef();
+                st.top() = StackSlot(vm.intern(self->stringValue(), self));
+            });
+        defineNative("java/lang/String", "hashCode", "()I", false,
+            [](JVMInstance&, OperandStack& st) {
+                Object* self = st.top().asRef(); st.pop();
+                uint32_t h = 0;
+                for (char c : self->stringValue()) h = 31 * h + static_cast<uint8_t>(c);
+                st.push(StackSlot(static_cast<jint>(h)));
+            });
+
+        defineNative("java/lang/Integer", "parseInt", "(Ljava/lang/String;)I", true,
+            [](JVMInstance& vm, OperandStack& st) {
+                Object* str = vm.stringRef(st.top()); st.pop();
+                if (!str) throw VMError(VMErrorKind::NumberFormatException, "null");
+                st.push(StackSlot(parseInt(str->stringValue())));
+            });
+
+        defineNative("java/lang/Math", "max", "(II)I", true,
+            [](JVMInstance&, OperandStack& st) {
+                jint b = st.top().asInt(); st.pop();
+                jint a = st.top().asInt(); st.pop();
+                st.push(StackSlot(a > b ? a : b));
+            });
+        defineNative("java/lang/Math", "min", "(II)I", true,
+            [](JVMInstance&, OperandStack& st) {
+                jint b = st.top().asInt(); st.pop();
+                jint a = st.top().asInt(); st.pop();
+                st.push(StackSlot(a < b ? a : b));
+            });
+        defineNative("java/lang/Math", "abs", "(I)I", true,
+            [](JVMInstance&, OperandStack& st) {
+                jint a = st.top().asInt(); st.pop();
+                st.push(StackSlot(a < 0 ? static_cast<jint>(0u - static_cast<uint32_t>(a)) : a));
+            });
+        defineNative("java/lang/Math", "abs", "(J)J", true,
+            [](JVMInstance&, OperandStack& st) {
+                jlong a = longAt(st.sp - 2);
+                if (a < 0) setLong(st.sp - 2, static_cast<jlong>(0 - static_cast<uint64_t>(a)));
+            });
+        defineNative("java/lang/Math", "abs", "(D)D", true,
+            [](JVMInstance&, OperandStack& st) { setDouble(st.sp - 2, fabs(doubleAt(st.sp - 2))); });
+        defineNative("java/lang/Math", "sqrt", "(D)D", true,
+            [](JVMInstance&, OperandStack& st) { setDouble(st.sp - 2, sqrt(doubleAt(st.sp - 2))); });
+
+        defineNative("java/lang/System", "currentTimeMillis", "()J", true,
+            [](JVMInstance&, OperandStack& st) {
+                auto now = chrono::system_clock::now().time_since_epoch();
+                jlong ms = chrono::duration_cast<chrono::milliseconds>(now).count();
+                st.push(StackSlot(jint(0))); st.push(StackSlot(jint(0)));
+                setLong(st.sp - 2, ms);
+            });
+        defineNative("java/lang/System", "nanoTime", "()J", true,
+            [](JVMInstance&, OperandStack& st) {
+                auto now = chrono::steady_clock::now().time_since_epoch();
+                jlong ns = chrono::duration_cast<chrono::nanoseconds>(now).count();
+                st.push(StackSlot(jint(0))); st.push(StackSlot(jint(0)));
+                setLong(st.sp - 2, ns);
+            });
+
+        defineNative("java/util/Scanner", "nextLine", "()Ljava/lang/String;", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                st.pop();
+                st.push(StackSlot(vm.createString(vm.readLine())));
+            });
+        defineNative("java/util/Scanner", "nextInt", "()I", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                st.pop();
+                st.push(StackSlot(parseInt(vm.readToken())));
+            });
+
+        // Threads. start() runs the Thread's run() on a new OS thread; the
+        // inherited run() calls the Runnable the Thread was made with.
+        defineNative("java/lang/Thread", "<init>", "()V", false,
+            [](JVMInstance&, OperandStack& st) { st.pop(); });
+        defineNative("java/lang/Thread", "<init>", "(Ljava/lang/Runnable;)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                Object* target = st.top().isRef() ? st.top().asRef() : nullptr; st.pop();
+                st.top().asRef()->refs()[vm.threadTargetSlot] = target; st.pop();
+            });
+        defineNative("java/lang/Thread", "start", "()V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                vm.startThread(st.top().asRef());
+                st.pop();
+            });
+        defineNative("java/lang/Thread", "run", "()V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                Object* target = st.top().asRef()->refs()[vm.threadTargetSlot]; st.pop();
+                if (!target) return;
+                st.push(StackSlot(target));
+                vm.callMethod(dispatch(target->clazz, vm.runnableRun), st, 1);
+            });
+        defineNative("java/lang/Thread", "join", "()V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                vm.joinThread(st.top().asRef());
+                st.pop();
+            });
+        defineNative("java/lang/Thread", "currentThread", "()Ljava/lang/Thread;", true,
+            [](JVMInstance&, OperandStack& st) { st.push(StackSlot(currentThread->object)); });
+        defineNative("java/lang/Thread", "yield", "()V", true,
+            [](JVMInstance&, OperandStack&) { this_thread::yield(); });
+
+        // The receiver stays on the stack while wait() blocks.
+        defineNative("java/lang/Object", "wait", "()V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                vm.monitorWait(st.top().asRef());
+                st.pop();
+            });
+        defineNative("java/lang/Object", "notify", "()V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                vm.monitorNotify(st.top().asRef(), false);
+                st.pop();
+            });
+        defineNative("java/lang/Object", "notifyAll", "()V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                vm.monitorNotify(st.top().asRef(), true);
+                st.pop();
+            });
+
+        // Throwable keeps only its message: the VM records no stack trace,
+        // so printStackTrace() prints toString().
+        defineNative("java/lang/Throwable", "<init>", "()V", false,
+            [](JVMInstance&, OperandStack& st) { st.pop(); });
+        defineNative("java/lang/Throwable", "<init>", "(Ljava/lang/String;)V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                Object* message = vm.stringRef(st.top()); st.pop();
+                st.top().asRef()->refs()[vm.throwableMessageSlot] = message; st.pop();
+            });
+        defineNative("java/lang/Throwable", "getMessage", "()Ljava/lang/String;", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                st.top() = StackSlot(st.top().asRef()->refs()[vm.throwableMessageSlot]);
+            });
+        defineNative("java/lang/Throwable", "toString", "()Ljava/lang/String;", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                string text = vm.throwableString(st.top().asRef());
+                st.top() = StackSlot(vm.createString(text));
+            });
+        defineNative("java/lang/Throwable", "printStackTrace", "()V", false,
+            [](JVMInstance& vm, OperandStack& st) {
+                cerr << vm.throwableString(st.top().asRef()) << endl;
+                st.pop();
+            });
+
+        defineNative("java/lang/System", "arraycopy", "(Ljava/lang/Object;ILjava/lang/Object;II)V", true,
+            [](JVMInstance&, OperandStack& st) {
+                jint length = st.top().asInt(); st.pop();
+                jint dstPos = st.top().asInt(); st.pop();
+                Object* dst = arrayRef(st.top()); st.pop();
+                jint srcPos = st.top().asInt(); st.pop();
+                Object* src = arrayRef(st.top()); st.pop();
+                if (src->kind != dst->kind || src->clazz->elementType != dst->clazz->elementType)
+                    throw VMError(VMErrorKind::ArrayStoreException, "arraycopy: type mismatch: " +
+                        src->clazz->name + " into " + dst->clazz->name);
+                if (srcPos < 0 || dstPos < 0 || length < 0 ||
+                    int64_t(srcPos) + length > src->arrayLength() || int64_t(dstPos) + length > dst->arrayLength())
+                    throw VMError(VMErrorKind::ArrayIndexOutOfBoundsException, "arraycopy: range out of bounds");
+                size_t size = src->clazz->elementSize;
+                memmove(dst->elements() + dstPos * size, src->elements() + srcPos * size, length * size);
+            });
+        defineNative("java/util/Arrays", "fill", "([II)V", true, arraysFill<jint, 'I'>);
+        defineNative("java/util/Arrays", "fill", "([BB)V", true, arraysFill<jbyte, 'B'>);
+        defineNative("java/util/Arrays", "fill", "([ZZ)V", true, arraysFill<jbyte, 'Z'>);
+        defineNative("java/util/Arrays", "fill", "([CC)V", true, arraysFill<jchar, 'C'>);
+        defineNative("java/util/Arrays", "fill", "([SS)V", true, arraysFill<jshort, 'S'>);
+        defineNative("java/util/Arrays", "fill", "([Ljava/lang/Object;Ljava/lang/Object;)V", true, arraysFill<Object*, 'L'>);
+        defineNative("java/util/Arrays", "equals", "([I[I)Z", true, arraysEquals<'I'>);
+        defineNative("java/util/Arrays", "equals", "([B[B)Z", true, arraysEquals<'B'>);
+        defineNative("java/util/Arrays", "equals", "([Z[Z)Z", true, arraysEquals<'Z'>);
+        defineNative("java/util/Arrays", "equals", "([C[C)Z", true, arraysEquals<'C'>);
+        defineNative("java/util/Arrays", "equals", "([S[S)Z", true, arraysEquals<'S'>);
+        defineNative("java/util/Arrays", "hashCode", "([I)I", true, arraysHashCode<jint, 'I'>);
+        defineNative("java/util/Arrays", "hashCode", "([B)I", true, arraysHashCode<jbyte, 'B'>);
+        defineNative("java/util/Arrays", "hashCode", "([C)I", true, arraysHashCode<jchar, 'C'>);
+        defineNative("java/util/Arrays", "hashCode", "([S)I", true, arraysHashCode<jshort, 'S'>);
+    }
+
+    // Array argument of a java.util.Arrays native declared with element
+    // type type; null if nullable and the argument is null.
+    static Object* typedArray(StackSlot slot, char type, bool nullable) {
+        if (nullable && slot.isRef() && !slot.asRef()) return nullptr;
+        Object* array = arrayRef(slot);
+        if (array->clazz->elementType != type)
+            throw VMError(VMErrorKind::IllegalArgumentException, "argument type mismatch: " + array->clazz->name);
+        return array;
+    }
+
+    template <typename T, char TYPE>
+    static void arraysFill(JVMInstance&, OperandStack& st) {
+        StackSlot value = st.top(); st.pop();
+        Object* array = typedArray(st.top(), TYPE, false); st.pop();
+        T v;
+        if constexpr (TYPE == 'L') v = value.isRef() ? value.asRef() : nullptr;
+        else v = static_cast<T>(value.asInt());
+        fillElements(array->elements(), array->arrayLength(), &v, sizeof(v));
+    }
+
+    template <char TYPE>
+    static void arraysEquals(JVMInstance&, OperandStack& st) {
+        Object* b = typedArray(st.top(), TYPE, true); st.pop();
+        Object* a = typedArray(st.top(), TYPE, true); st.pop();
+        bool equal = a == b || (a && b && a->arrayLength() == b->arrayLength() &&
+            elementsEqual(a->elements(), b->elements(), size_t(a->arrayLength()) * a->clazz->elementSize));
+        st.push(StackSlot(static_cast<jint>(equal)));
+    }
+
+    template <typename T, char TYPE>
+    static void arraysHashCode(JVMInstance&, OperandStack& st) {
+        Object* array = typedArray(st.top(), TYPE, true); st.pop();
+        st.push(StackSlot(array ? hashElements(reinterpret_cast<const T*>(array->elements()), array->arrayLength()) : 0));
+    }
+
+    // The one String object for each distinct value, shared by every class's
+    // string constants and by String.intern().
+    Object* intern(string_view value, Object* candidate = nullptr) {
+        auto hold = safepoint.acquire(classLock);
+        auto it = internTable.find(string(value));
+        if (it != internTable.end()) return it->second;
+        Object* str = candidate ? candidate : createString(string(value));
+        internTable.emplace(string(value), str);
+        return str;
+    }
+
+    // String object for a CONSTANT_String entry, interned on first use and
+    // then kept in the entry.
+    Object* ldcString(vector<CPEntry>& cp, uint16_t index) {
+        auto hold = safepoint.acquire(classLock);
+        CPEntry& entry = cp[index];
+        Object* str = entry.stringObject.load(memory_order_relaxed);
+        if (!str) {
+            str = intern(cp[entry.string_index].utf8_value);
+            entry.stringObject.store(str, memory_order_release);
+        }
+        return str;
+    }
+
+    // ldc and ldc_w for the switch interpreter. decodeMethod() has already
+    // refused constants of any other tag.
+    void ldc(Frame& frame, uint16_t index) {
+        auto& cp = frame.method->owner->constantPool;
+        switch (cp[index].tag) {
+            case 3: case 4: frame.operands.push(StackSlot(static_cast<jint>(cp[index].int_value))); break;
+            case 7: frame.operands.push(StackSlot(classMonitor(*resolveClass(cp, index)))); break;
+            case 8: frame.operands.push(StackSlot(ldcString(cp, index))); break;
+            default: unsupportedLdc(*frame.method, index);
+        }
+    }
+
+    [[noreturn]] static void unsupportedLdc(const Method& m, uint16_t index) {
+        throw runtime_error("Unsupported ldc constant (tag " + to_string(m.owner->constantPool[index].tag) + ") in " +
+                            m.owner->name + "." + m.name + m.descriptor);
+    }
+
+    // Console input blocks, so it is read in a safe region into a string
+    // the caller turns into a guest object afterwards.
+    string readLine() {
+        Safepoint::Region blocked(safepoint);
+        lock_guard<mutex> hold(console.inLock);
+        return console.readLine();
+    }
+    string readToken() {
+        Safepoint::Region blocked(safepoint);
+        lock_guard<mutex> hold(console.inLock);
+        string_view token;
+        if (!console.readToken(token)) throw VMError(VMErrorKind::NoSuchElementException);
+        return string(token);
+    }
+
+    // Throwable.toString(): the class name, then the message if there is one.
+    string throwableString(Object* throwable) const {
+        string text = throwable->clazz->name;
+        replace(text.begin(), text.end(), '/', '.');
+        if (Object* message = throwable->refs()[throwableMessageSlot]) text += ": " + string(message->stringValue());
+        return text;
+    }
+
+    Object* createString(const string& value) {
+        jint len = static_cast<jint>(value.size());
+        auto strObj = heap.allocate(currentThread->tlab, stringClass, Object::STRING, 0, sizeof(len) + value.size());
+        memcpy(strObj->data(), &len, sizeof(len));
+        memcpy(strObj->data() + sizeof(len), value.data(), value.size());
+        return strObj;
+    }
+
+    // Full stop-the-world collection, run with the heap lock held. Roots are
+    // every thread's Thread object, the exception it is throwing and its
+    // frames (locals, live operands and the objects synchronized methods
+    // locked), static reference fields, class monitors, interned strings,
+    // and objects the VM itself holds.
+    void collectGarbage(const char* cause) {
+        auto start = chrono::steady_clock::now();
+        safepoint.stopTheWorld();
+        for (JavaThread* t : threads) heap.retire(t->tlab);
+        size_t before = heap.used();
+
+        for (JavaThread* t : threads) {
+            heap.mark(t->object);
+            heap.mark(t->exception);
+            for (auto& frame : t->callStack) {
+                heap.mark(frame.monitor);
+                for (StackSlot* s = frame.locals; s < frame.operands.sp; ++s) {
+                    if (s->isRef()) heap.mark(s->asRef());
+                }
+            }
+        }
+        for (auto& entry : loadedClasses) {
+            heap.mark(entry.second->monitorObject);
+            for (auto& field : entry.second->fields) {
+                if (field.isStatic) heap.mark(field.refValue);
+            }
+        }
+        for (auto& entry : internTable) heap.mark(entry.second);
+        heap.mark(systemOut);
+        heap.trace();
+        // A monitor goes with its object; no thread can be using it then.
+        monitors.erase(remove_if(monitors.begin(), monitors.end(),
+            [](const unique_ptr<Monitor>& m) { return !m->object->marked; }), monitors.end());
+        heap.sweep();
+        safepoint.resume();
+
+        if (heap.logGC) {
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            cerr << "[gc] GC(" << heap.gcCount << ") Pause Full (" << cause << ") "
+                 << before / 1024 << "K->" << heap.used() / 1024 << "K("
+                 << heap.committed / 1024 << "K) " << fixed << setprecision(3) << ms << "ms" << endl;
+            cerr.unsetf(ios::floatfield);
+        }
+        heap.gcCount++;
+    }
+
+
+    struct MemberRef {
+        string className;
+        string name;
+        string descriptor;
+    };
+
+    // Names behind a Fieldref, Methodref or InterfaceMethodref entry.
+    static MemberRef memberRefNames(const vector<CPEntry>& cp, uint16_t index) {
+        if (index >= cp.size() || cp[index].tag < 9 || cp[index].tag > 11) {
+            return {"", "", ""};
+        }
+        
+        uint16_t classIndex = cp[index].class_index;
+        uint16_t nameAndTypeIndex = cp[index].name_and_type_index;
+        
+        MemberRef ref;
+        if (classIndex < cp.size() && cp[classIndex].tag == 7) {
+            uint16_t nameIndex = cp[classIndex].name_index;
+            if (nameIndex < cp.size() && cp[nameIndex].tag == 1) {
+                ref.className = cp[nameIndex].utf8_value;
+            }
+        }
+        
+        if (nameAndTypeIndex < cp.size() && cp[nameAndTypeIndex].tag == 12) {
+            uint16_t nameIdx = cp[nameAndTypeIndex].name_index;
+            uint16_t descIdx = cp[nameAndTypeIndex].descriptor_index;
+            
+            if (nameIdx < cp.size() && cp[nameIdx].tag == 1) {
+                ref.name = cp[nameIdx].utf8_value;
+            }
+            if (descIdx < cp.size() && cp[descIdx].tag == 1) {
+                ref.descriptor = cp[descIdx].utf8_value;
+            }
+        }
+        
+        return ref;
+    }
+
+    static Method* findMethod(Class* cls, const string& key) {
+        for (Class* c = cls; c; c = c->superClass.get()) {
+            auto it = c->methodMap.find(key);
+            if (it != c->methodMap.end()) return &c->methods[it->second];
+        }
+        // Interface methods, including ones inherited by abstract classes
+        for (Class* c = cls; c; c = c->superClass.get()) {
+            for (auto& iface : c->interfaces)
+                if (Method* m = findMethod(iface.get(), key)) return m;
+        }
+        return nullptr;
+    }
+
+    static Field* findField(Class* cls, const string& name) {
+        for (; cls; cls = cls->superClass.get()) {
+            auto it = cls->fieldMap.find(name);
+            if (it != cls->fieldMap.end()) return &cls->fields[it->second];
+        }
+        return nullptr;
+    }
+
+    // Operand stack slots taken by the parameters of a method descriptor.
+    static uint16_t argSlotCount(const string& descriptor) {
+        uint16_t slots = 0;
+        for (size_t i = 1; i < descriptor.size() && descriptor[i] != ')'; ++i) {
+            char c = descriptor[i];
+            slots += (c == 'J' || c == 'D') ? 2 : 1;
+            while (descriptor[i] == '[') ++i;
+            if (descriptor[i] == 'L') {
+                i = descriptor.find(';', i);
+                if (i == string::npos) break;
+            }
+        }
+        return slots;
+    }
+
+    // Verifier type of a field or parameter descriptor: I for int-sized
+    // primitives (and float, kept as its bits), R for references, J for
+    // long and double, which are two I slots.
+    static bool slotType(const string& descriptor, size_t at, char& type) {
+        if (at >= descriptor.size()) return false;
+        char c = descriptor[at];
+        if (c == 'L' || c == '[') type = 'R';
+        else if (c == 'J' || c == 'D') type = 'J';
+        else if (c == 'V') return false;
+        else type = 'I';
+        return true;
+    }
+
+    // Argument slot types (I or R) and result type (I, J, R or V) of a
+    // method descriptor.
+    static bool signatureTypes(const string& descriptor, string& args, char& result) {
+        args.clear();
+        size_t i = 1;
+        while (i < descriptor.size() && descriptor[i] != ')') {
+            char type;
+            if (!slotType(descriptor, i, type)) return false;
+            args += type == 'J' ? "II" : string(1, type);
+            while (i < descriptor.size() && descriptor[i] == '[') ++i;
+            if (i < descriptor.size() && descriptor[i] == 'L') i = descriptor.find(';', i);
+            if (i == string::npos) return false;
+            ++i;
+        }
+        if (i + 1 >= descriptor.size()) return false;
+        if (descriptor[i + 1] == 'V') result = 'V';
+        else if (!slotType(descriptor, i + 1, result)) return false;
+        return true;
+    }
+
+    // iload, fload and aload all decode to OP_LOAD, the stores to
+    // OP_STORE; the original bytecode tells which type they move.
+    static char localType(const Method& m, const Insn& in) {
+        uint8_t op = m.code[in.pc];
+        if (op == OP_WIDE) op = m.code[in.pc + 1];
+        bool isRef = op == OP_ALOAD || op == OP_ASTORE || (op >= 0x2A && op <= 0x2D) || (op >= 0x4B && op <= 0x4E);
+        return isRef ? 'R' : 'I';
+    }
+
+    // Operand slots popped and pushed by op if it is one of the long, float
+    // and double arithmetic, conversion or compare instructions, which
+    // take and leave only int slots.
+    static bool primitiveEffect(uint8_t op, int& pops, int& pushes) {
+        switch (op) {
+            case OP_LADD: case OP_LSUB: case OP_LMUL: case OP_LDIV: case OP_LREM:
+            case OP_LAND: case OP_LOR: case OP_LXOR:
+            case OP_DADD: case OP_DSUB: case OP_DMUL: case OP_DDIV: case OP_DREM:
+                pops = 4; pushes = 2; return true;
+            case OP_FADD: case OP_FSUB: case OP_FMUL: case OP_FDIV: case OP_FREM:
+            case OP_L2I: case OP_L2F: case OP_D2I: case OP_D2F: case OP_FCMPL: case OP_FCMPG:
+                pops = 2; pushes = 1; return true;
+            case OP_LNEG: case OP_DNEG: case OP_L2D: case OP_D2L: pops = 2; pushes = 2; return true;
+            case OP_FNEG: case OP_I2F: case OP_F2I: pops = 1; pushes = 1; return true;
+            case OP_LSHL: case OP_LSHR: case OP_LUSHR: pops = 3; pushes = 2; return true;
+            case OP_I2L: case OP_I2D: case OP_F2L: case OP_F2D: pops = 1; pushes = 2; return true;
+            case OP_LCMP: case OP_DCMPL: case OP_DCMPG: pops = 4; pushes = 1; return true;
+            default: return false;
+        }
+    }
+
+    // Proves, once before the method first runs, what the checked
+    // interpreter tests on every instruction: the operand stack never under-
+    // or overflows and has one depth on all paths, and ints and references are where each
+    // instruction and each local read expects them. Local indices and branch
+    // targets were checked by decodeMethod(). Throws VerifyError for code
+    // that is wrong; returns false, leaving m on the checked handlers, for
+    // code that uses instructions or types this VM does not implement.
+    //
+    // Reference slots also carry their class where it is known: this, and
+    // what new creates. A field access whose receiver is not proven an
+    // instance of the field's class is marked untypedReceiver, and its fast
+    // handler tests the class before using the field's offset.
+    bool verifyMethod(Method& m) {
+        const auto& insns = m.insns;
+        string args;
+        if (!signatureTypes(m.descriptor, args, m.resultType)) return false;
+        if (!m.isStatic) args.insert(args.begin(), 'R');
+        auto fail = [&](size_t k, const string& why) {
+            throw VMError(VMErrorKind::VerifyError, m.owner->name + "." + m.name + m.descriptor +
+                                " at pc " + to_string(insns[k].pc) + ": " + why);
+        };
+
+        // Types in each local and stack slot before each instruction; T
+        // where paths disagree, which nothing may then read. The class of a
+        // reference slot is empty where unknown.
+        struct State {
+            bool seen = false;
+            string locals, stack;
+            vector<string> localClasses, stackClasses;
+        };
+        vector<State> states(insns.size());
+        states[0].seen = true;
+        states[0].locals.assign(max<size_t>(m.max_locals, args.size()), 'T');
+        states[0].locals.replace(0, args.size(), args);
+        states[0].localClasses.resize(states[0].locals.size());
+        if (!m.isStatic) states[0].localClasses[0] = m.owner->name;   // checked by invoke, see checkReceiver
+        vector<size_t> work{ 0 };
+        auto flow = [&](size_t from, size_t k, const State& s) {
+            State& into = states[k];
+            if (!into.seen) {
+                into = s;
+                work.push_back(k);
+                return;
+            }
+            if (into.stack.size() != s.stack.size()) fail(from, "stack depth differs between paths");
+            bool changed = false;
+            auto join = [&](string& to, const string& other) {
+                for (size_t i = 0; i < to.size(); ++i)
+                    if (to[i] != other[i] && to[i] != 'T') { to[i] = 'T'; changed = true; }
+            };
+            auto joinClasses = [&](vector<string>& to, const vector<string>& other) {
+                for (size_t i = 0; i < to.size(); ++i)
+                    if (to[i] != other[i] && !to[i].empty()) { to[i].clear(); changed = true; }
+            };
+            join(into.locals, s.locals);
+            join(into.stack, s.stack);
+            joinClasses(into.localClasses, s.localClasses);
+            joinClasses(into.stackClasses, s.stackClasses);
+            if (changed) work.push_back(k);
+        };
+
+        while (!work.empty()) {
+            size_t k = work.back();
+            work.pop_back();
+            const Insn& in = insns[k];
+            State s = states[k];
+            // Anything in a try range may throw: its handlers start with the
+            // locals as they are here and the exception alone on the stack.
+            for (auto& h : m.handlers) {
+                if (k < h.start || k >= h.end) continue;
+                if (m.max_stack < 1) fail(k, "operand stack overflow");
+                flow(k, h.target, State{ true, s.locals, "R", s.localClasses, { string() } });
+            }
+            string popped;  // class of the slot last popped
+            auto pop = [&](char want) {
+                if (s.stack.empty()) fail(k, "operand stack underflow");
+                char type = s.stack.back();
+                s.stack.pop_back();
+                popped = move(s.stackClasses.back());
+                s.stackClasses.pop_back();
+                if (want != 'T' && type != want) fail(k, want == 'I' ? "expecting an int" : "expecting a reference");
+                return type;
+            };
+            auto push = [&](char type, const string& of = string()) {
+                if (s.stack.size() >= static_cast<size_t>(m.max_stack)) fail(k, "operand stack overflow");
+                s.stack += type;
+                s.stackClasses.push_back(of);
+            };
+            auto popReceiver = [&]() {
+                pop('R');
+                if (!isInstanceOf(popped, memberRefNames(m.owner->constantPool, static_cast<uint16_t>(in.a)).className))
+                    m.insns[k].untypedReceiver = true;
+            };
+            auto member = [&](char& type) {
+                string descriptor = memberRefNames(m.owner->constantPool, static_cast<uint16_t>(in.a)).descriptor;
+                return slotType(descriptor, 0, type);
+            };
+            auto pushValue = [&](char type) {
+                if (type == 'J') push('I');
+                push(type == 'J' ? 'I' : type);
+            };
+            auto popValue = [&](char type) {
+                if (type == 'J') pop('I');
+                pop(type == 'J' ? 'I' : type);
+            };
+            auto returns = [&](char type) {
+                if (m.resultType != type) fail(k, "wrong return instruction");
+                if (type != 'V') popValue(type);
+            };
+
+            bool next = true;
+            char type = 0;
+            int pops, pushes;
+            uint8_t op = unfusedOpcode(in.opcode);
+            if (primitiveEffect(op, pops, pushes)) {
+                while (pops--) pop('I');
+                while (pushes--) push('I');
+                flow(k, k + 1, s);
+                continue;
+            }
+            switch (op) {
+                case OP_NOP: break;
+                case OP_ACONST_NULL: case OP_LDC_STRING: push('R'); break;
+                case OP_LDC_CLASS: push('R', "java/lang/Class"); break;
+                case OP_NEW: push('R', classNameAt(m.owner->constantPool, static_cast<uint16_t>(in.a))); break;
+                case OP_ICONST: push('I'); break;
+                case OP_LCONST: pushValue('J'); break;
+                case OP_LOAD2:
+                    if (s.locals[in.a] != 'I' || s.locals[in.a + 1] != 'I') fail(k, "local is not a long or double");
+                    pushValue('J');
+                    break;
+                case OP_STORE2:
+                    popValue('J');
+                    s.locals[in.a] = s.locals[in.a + 1] = 'I';
+                    s.localClasses[in.a].clear(); s.localClasses[in.a + 1].clear();
+                    break;
+                case OP_LOAD:
+                    type = localType(m, in);
+                    if (s.locals[in.a] != type) fail(k, type == 'I' ? "local is not an int" : "local is not a reference");
+                    push(type, s.localClasses[in.a]);
+                    break;
+                case OP_STORE: s.locals[in.a] = pop(localType(m, in)); s.localClasses[in.a] = popped; break;
+                case OP_IINC: if (s.locals[in.a] != 'I') fail(k, "local is not an int"); break;
+                case OP_POP: pop('T'); break;
+                case OP_DUP: type = pop('T'); push(type, popped); push(type, popped); break;
+                case OP_POP2: pop('T'); pop('T'); break;
+                case OP_DUP2: {
+                    char second = pop('T');
+                    string secondClass = popped;
+                    char first = pop('T');
+                    push(first, popped); push(second, secondClass); push(first, popped); push(second, secondClass);
+                    break;
+                }
+                case OP_IADD: case OP_ISUB: case OP_IMUL: case OP_IDIV: pop('I'); pop('I'); push('I'); break;
+                case OP_IFEQ: case OP_IFNE: case OP_IFLT: case OP_IFGE: case OP_IFGT: case OP_IFLE: pop('I'); break;
+                case OP_IF_ICMPEQ: case OP_IF_ICMPNE: case OP_IF_ICMPLT:
+                case OP_IF_ICMPGE: case OP_IF_ICMPGT: case OP_IF_ICMPLE: pop('I'); pop('I'); break;
+                case OP_IF_ACMPEQ: case OP_IF_ACMPNE: pop('R'); pop('R'); break;
+                case OP_GOTO: next = false; break;
+                case OP_IRETURN: returns('I'); next = false; break;
+                case OP_LRETURN: returns('J'); next = false; break;
+                case OP_ARETURN: returns('R'); next = false; break;
+                case OP_RETURN: returns('V'); next = false; break;
+                case OP_ATHROW: pop('R'); next = false; break;
+                case OP_END: fail(k, "falling off the end of the code"); break;
+                case OP_GETSTATIC:
+                    if (!member(type)) return false;
+                    pushValue(type);
+                    break;
+                case OP_GETFIELD:
+                    if (!member(type)) return false;
+                    popReceiver(); pushValue(type);
+                    break;
+                case OP_PUTFIELD:
+                    if (!member(type)) return false;
+                    popValue(type); popReceiver();
+                    break;
+                case OP_GETFIELD_REF: popReceiver(); push('R'); break;
+                case OP_GETFIELD_INT: case OP_GETFIELD_BYTE: case OP_GETFIELD_CHAR: case OP_GETFIELD_SHORT:
+                    popReceiver(); push('I'); break;
+                case OP_PUTFIELD_REF: pop('R'); popReceiver(); break;
+                case OP_PUTFIELD_INT: case OP_PUTFIELD_BYTE: case OP_PUTFIELD_SHORT: pop('I'); popReceiver(); break;
+                case OP_GETFIELD_LONG: popReceiver(); pushValue('J'); break;
+                case OP_PUTFIELD_LONG: popValue('J'); popReceiver(); break;
+                case OP_NEWARRAY: case OP_ANEWARRAY: pop('I'); push('R'); break;
+                case OP_ARRAYLENGTH: pop('R'); push('I'); break;
+                case OP_MONITORENTER: case OP_MONITOREXIT: pop('R'); break;
+                case OP_IALOAD: case OP_FALOAD: case OP_BALOAD: case OP_CALOAD: case OP_SALOAD:
+                    pop('I'); pop('R'); push('I'); break;
+                case OP_AALOAD: pop('I'); pop('R'); push('R'); break;
+                case OP_LALOAD: pop('I'); pop('R'); pushValue('J'); break;
+                case OP_LASTORE: popValue('J'); pop('I'); pop('R'); break;
+                case OP_IASTORE: case OP_FASTORE: case OP_BASTORE: case OP_CASTORE: case OP_SASTORE:
+                    pop('I'); pop('I'); pop('R'); break;
+                case OP_AASTORE: pop('R'); pop('I'); pop('R'); break;
+                case OP_INVOKESTATIC: case OP_INVOKESPECIAL: case OP_INVOKEVIRTUAL: case OP_INVOKEINTERFACE: {
+                    string descriptor = memberRefNames(m.owner->constantPool, static_cast<uint16_t>(in.a)).descriptor;
+                    string params;
+                    char result;
+                    if (!signatureTypes(descriptor, params, result)) return false;
+                    for (size_t i = params.size(); i-- > 0;) pop(params[i]);
+                    if (op != OP_INVOKESTATIC) pop('R');
+                    if (result != 'V') pushValue(result);
+                    break;
+                }
+                default:
+                    return false;
+            }
+            if (op >= OP_IFEQ && op <= OP_GOTO) flow(k, in.a, s);
+            if (next) flow(k, k + 1, s);
+        }
+        m.argTypes = args;
+        return true;
+    }
+
+    // Whether an instance of the class named have, if known, is one of the
+    // class named want: the same class, or one of its loaded superclasses.
+    // Loads nothing; the verifier runs under classLock.
+    bool isInstanceOf(const string& have, const string& want) {
+        if (have.empty()) return false;
+        if (have == want) return true;
+        auto it = loadedClasses.find(have);
+        for (const Class* c = it == loadedClasses.end() ? nullptr : it->second.get(); c; c = c->superClass.get())
+            if (c->name == want) return true;
+        return false;
+    }
+
+    // Resolves a member reference on first use; later calls only test the
+    // flag, which is set last, after everything it publishes.
+    CPEntry& resolveRef(vector<CPEntry>& cp, uint16_t index) {
+        CPEntry& entry = cp[index];
+        if (entry.resolved.load(memory_order_acquire)) return entry;
+        auto hold = safepoint.acquire(classLock);
+        if (entry.resolved.load(memory_order_relaxed)) return entry;
+
+        MemberRef ref = memberRefNames(cp, index);
+        entry.refClass = loadClass(ref.className).get();
+        if (entry.tag == 9) {
+            entry.field = entry.refClass ? findField(entry.refClass, ref.name) : nullptr;
+            if (!entry.field) throw VMError(VMErrorKind::NoSuchFieldError, ref.className + "." + ref.name);
+        } else {
+            entry.memberKey = ref.name + ref.descriptor;
+            entry.argSlots = argSlotCount(ref.descriptor);
+            entry.method = entry.refClass ? findMethod(entry.refClass, entry.memberKey) : nullptr;
+            entry.native = entry.method ? entry.method->native : findNative(ref.className, ref.name, ref.descriptor);
+        }
+        entry.resolved.store(true, memory_order_release);
+        return entry;
+    }
+
+    // Length in bytes of the instruction at code[pc], operands included.
+    static size_t insnLength(const vector<uint8_t>& code, size_t pc) {
+        static const uint8_t lengths[256] = {
+            1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 2,3,2,3,3,2,2,2,2,2,1,1,1,1,1,1, // 0x00
+            1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,2,2,2,2,2,1,1,1,1,1, // 0x20
+            1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x40
+            1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0x60
+            1,1,1,1,3,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,3,3,3,3,3,3,3, // 0x80
+            3,3,3,3,3,3,3,3,3,2,0,0,1,1,1,1, 1,1,3,3,3,3,3,3,3,5,5,3,2,3,1,1, // 0xA0
+            3,3,1,1,0,4,3,3,5,5,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0xC0
+            1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, // 0xE0
+        };
+        uint8_t op = code[pc];
+        if (lengths[op]) return lengths[op];
+
+        auto u4At = [&](size_t p) -> int32_t {
+            if (p + 4 > code.size()) throw runtime_error("Truncated bytecode");
+            return static_cast<int32_t>((static_cast<uint32_t>(code[p]) << 24) |
+                (static_cast<uint32_t>(code[p + 1]) << 16) |
+                (static_cast<uint32_t>(code[p + 2]) << 8) | code[p + 3]);
+        };
+        size_t base = (pc + 4) & ~size_t(3); // operands are 4-byte aligned
+        switch (op) {
+            case 0xAA: { // tableswitch
+                int32_t low = u4At(base + 4), high = u4At(base + 8);
+                return base - pc + 12 + size_t(int64_t(high) - low + 1) * 4;
+            }
+            case 0xAB: // lookupswitch
+                return base - pc + 8 + size_t(u4At(base + 4)) * 8;
+            case OP_WIDE:
+                if (pc + 1 >= code.size()) throw runtime_error("Truncated bytecode");
+                return code[pc + 1] == OP_IINC ? 6 : 4;
+        }
+        return 1;
+    }
+
+    // Translate a method's bytecode into the stream run by the threaded
+    // interpreter: one Insn per instruction, operands widened and constants
+    // resolved, branch offsets turned into absolute instruction indices.
+    static void decodeMethod(Method& m) {
+        const auto& code = m.code;
+        const auto& cp = m.owner->constantPool;
+        vector<int> indexOf(code.size() + 1, -1);
+        m.insns.clear();
+        m.threaded.store(false, memory_order_relaxed);
+
+        size_t pc = 0;
+        while (pc < code.size()) {
+            size_t len = insnLength(code, pc);
+            if (pc + len > code.size()) throw runtime_error("Truncated bytecode in " + m.name);
+
+            auto u1 = [&](size_t off) { return code[pc + off]; };
+            auto s2 = [&](size_t off) {
+                return static_cast<jshort>((static_cast<uint16_t>(code[pc + off]) << 8) | code[pc + off + 1]);
+            };
+            auto u2 = [&](size_t off) { return static_cast<uint16_t>(s2(off)); };
+            auto local = [&](uint32_t idx) {
+                if (idx >= static_cast<uint32_t>(m.max_locals))
+                    throw runtime_error("Local variable index out of range in " + m.name);
+                return static_cast<jint>(idx);
+            };
+            auto local2 = [&](uint32_t idx) { return local(idx + 1) - 1; };   // long and double: idx, idx + 1
+            auto wideConst = [](Insn& in, uint64_t bits) {
+                in.opcode = OP_LCONST;
+                in.a = static_cast<jint>(static_cast<uint32_t>(bits));
+                in.b = static_cast<jint>(static_cast<uint32_t>(bits >> 32));
+            };
+
+            Insn in;
+            in.pc = static_cast<uint32_t>(pc);
+            uint8_t op = code[pc];
+            in.opcode = op;
+
+            switch (op) {
+                case 0x02: case 0x03: case 0x04: case 0x05: case 0x06: case 0x07: case 0x08: // iconst_<n>
+                    in.opcode = OP_ICONST; in.a = op - 0x03; break;
+                case 0x09: case 0x0A: wideConst(in, op - 0x09); break; // lconst_<n>
+                case 0x0B: case 0x0C: case 0x0D: in.opcode = OP_ICONST; in.a = floatBits(op - 0x0B); break; // fconst_<n>
+                case 0x0E: case 0x0F: wideConst(in, doubleBits(op - 0x0E)); break; // dconst_<n>
+                case OP_BIPUSH: in.opcode = OP_ICONST; in.a = static_cast<jbyte>(u1(1)); break;
+                case OP_SIPUSH: in.opcode = OP_ICONST; in.a = s2(1); break;
+
+                // MethodHandle, MethodType and dynamic constants stay ldc,
+                // which the verifier leaves alone and which throws when run.
+                case OP_LDC: case OP_LDC_W: {
+                    uint16_t index = op == OP_LDC ? u1(1) : u2(1);
+                    uint8_t tag = index < cp.size() ? cp[index].tag : 0;
+                    in.opcode = OP_LDC; in.a = index;
+                    if (tag == 8 && cp[index].string_index < cp.size() && cp[cp[index].string_index].tag == 1) {
+                        in.opcode = OP_LDC_STRING;
+                    } else if (tag == 3 || tag == 4) {
+                        in.opcode = OP_ICONST; in.a = static_cast<jint>(cp[index].int_value);
+                    } else if (tag == 7) {
+                        in.opcode = OP_LDC_CLASS;
+                    } else if (tag != 15 && tag != 16 && tag != 17) {
+                        throw runtime_error("Invalid ldc constant in " + m.name);
+                    }
+                    break;
+                }
+                case OP_LDC2_W: {
+                    uint16_t index = u2(1);
+                    if (index >= cp.size() || (cp[index].tag != 5 && cp[index].tag != 6))
+                        throw runtime_error("Invalid ldc2_w constant in " + m.name);
+                    wideConst(in, cp[index].long_value);
+                    break;
+                }
+
+                case OP_ILOAD: case OP_FLOAD: case OP_ALOAD: in.opcode = OP_LOAD; in.a = local(u1(1)); break;
+                case 0x1A: case 0x1B: case 0x1C: case 0x1D: in.opcode = OP_LOAD; in.a = local(op - 0x1A); break;
+                case 0x22: case 0x23: case 0x24: case 0x25: in.opcode = OP_LOAD; in.a = local(op - 0x22); break;
+                case 0x2A: case 0x2B: case 0x2C: case 0x2D: in.opcode = OP_LOAD; in.a = local(op - 0x2A); break;
+                case OP_LLOAD: case OP_DLOAD: in.opcode = OP_LOAD2; in.a = local2(u1(1)); break;
+                case 0x1E: case 0x1F: case 0x20: case 0x21: in.opcode = OP_LOAD2; in.a = local2(op - 0x1E); break;
+                case 0x26: case 0x27: case 0x28: case 0x29: in.opcode = OP_LOAD2; in.a = local2(op - 0x26); break;
+                case OP_ISTORE: case OP_FSTORE: case OP_ASTORE: in.opcode = OP_STORE; in.a = local(u1(1)); break;
+                case 0x3B: case 0x3C: case 0x3D: case 0x3E: in.opcode = OP_STORE; in.a = local(op - 0x3B); break;
+                case 0x43: case 0x44: case 0x45: case 0x46: in.opcode = OP_STORE; in.a = local(op - 0x43); break;
+                case 0x4B: case 0x4C: case 0x4D: case 0x4E: in.opcode = OP_STORE; in.a = local(op - 0x4B); break;
+                case OP_LSTORE: case OP_DSTORE: in.opcode = OP_STORE2; in.a = local2(u1(1)); break;
+                case 0x3F: case 0x40: case 0x41: case 0x42: in.opcode = OP_STORE2; in.a = local2(op - 0x3F); break;
+                case 0x47: case 0x48: case 0x49: case 0x4A: in.opcode = OP_STORE2; in.a = local2(op - 0x47); break;
+
+                case 0x31: in.opcode = OP_LALOAD; break;    // daload
+                case 0x52: in.opcode = OP_LASTORE; break;   // dastore
+                case 0xAE: in.opcode = OP_IRETURN; break;   // freturn
+                case 0xAF: in.opcode = OP_LRETURN; break;   // dreturn
+
+                case OP_IINC: in.a = local(u1(1)); in.b = static_cast<jbyte>(u1(2)); break;
+
+                case OP_NEWARRAY:
+                    in.a = u1(1);
+                    if (in.a < 4 || in.a > 11) throw runtime_error("Invalid newarray type in " + m.name);
+                    break;
+
+                case OP_WIDE: {
+                    uint8_t wop = u1(1);
+                    if (wop == OP_IINC) {
+                        in.opcode = OP_IINC; in.a = local(u2(2)); in.b = s2(4);
+                    } else if (wop == OP_ILOAD || wop == OP_FLOAD || wop == OP_ALOAD) {
+                        in.opcode = OP_LOAD; in.a = local(u2(2));
+                    } else if (wop == OP_ISTORE || wop == OP_FSTORE || wop == OP_ASTORE) {
+                        in.opcode = OP_STORE; in.a = local(u2(2));
+                    } else if (wop == OP_LLOAD || wop == OP_DLOAD) {
+                        in.opcode = OP_LOAD2; in.a = local2(u2(2));
+                    } else if (wop == OP_LSTORE || wop == OP_DSTORE) {
+                        in.opcode = OP_STORE2; in.a = local2(u2(2));
+                    } else {
+                        in.opcode = wop;
+                    }
+                    break;
+                }
+
+                case OP_IFEQ: case OP_IFNE: case OP_IFLT: case OP_IFGE: case OP_IFGT: case OP_IFLE:
+                case OP_IF_ICMPEQ: case OP_IF_ICMPNE: case OP_IF_ICMPLT:
+                case OP_IF_ICMPGE: case OP_IF_ICMPGT: case OP_IF_ICMPLE:
+                case OP_IF_ACMPEQ: case OP_IF_ACMPNE: case OP_GOTO:
+                    in.a = static_cast<jint>(pc) + s2(1); // resolved to an index below
+                    break;
+
+                case OP_GETSTATIC: case OP_GETFIELD: case OP_PUTFIELD:
+                case OP_INVOKEVIRTUAL: case OP_INVOKESPECIAL: case OP_INVOKESTATIC:
+                case OP_INVOKEINTERFACE: case OP_NEW: case OP_ANEWARRAY: {
+                    in.a = u2(1);
+                    uint8_t tag = in.a < static_cast<jint>(cp.size()) ? cp[in.a].tag : 0;
+                    bool valid = (op == OP_NEW || op == OP_ANEWARRAY) ? tag == 7 :
+                                 (op == OP_GETSTATIC || op == OP_GETFIELD || op == OP_PUTFIELD) ? tag == 9 :
+                                 op == OP_INVOKEINTERFACE ? tag == 11 : (tag == 10 || tag == 11);
+                    if (!valid) throw runtime_error("Invalid member reference in " + m.name);
+                    break;
+                }
+            }
+
+            indexOf[pc] = static_cast<int>(m.insns.size());
+            m.insns.push_back(in);
+            pc += len;
         }
 
+        Insn end;
+        end.opcode = OP_END;
+        end.pc = static_cast<uint32_t>(code.size());
+        indexOf[code.size()] = static_cast<int>(m.insns.size());
+        m.insns.push_back(end);
+        m.backedges.assign(m.insns.size(), 0);
+
+        for (auto& in : m.insns) {
+            if ((in.opcode >= OP_IFEQ && in.opcode <= OP_GOTO)) {
+                if (in.a < 0 || in.a > static_cast<jint>(code.size()) || indexOf[in.a] < 0)
+                    throw runtime_error("Invalid branch target in " + m.name);
+                in.a = indexOf[in.a];
+            }
+        }
+        auto insnAt = [&](uint32_t pc) { return pc <= code.size() ? indexOf[pc] : -1; };
+        for (auto& h : m.handlers) {
+            int start = insnAt(h.start), end = insnAt(h.end), target = insnAt(h.target);
+            if (start < 0 || end <= start || target < 0 || static_cast<size_t>(target) + 1 == m.insns.size() ||
+                (h.catchType && (h.catchType >= cp.size() || cp[h.catchType].tag != 7)))
+                throw runtime_error("Invalid exception table in " + m.name);
+            h = { static_cast<uint32_t>(start), static_cast<uint32_t>(end), static_cast<uint32_t>(target), h.catchType };
+        }
+    }
+
+    // Rewrites the head of common instruction sequences into a
+    // superinstruction; -Xprof:insns shows which sequences run most. The
+    // rest of each sequence is left alone, so branches into its middle and
+    // the JIT still find the original instructions there. aload; getfield
+    // is fused later, when the getfield is quickened.
+    static void fuseInsns(Method& m) {
+        auto& insns = m.insns;
+        auto op = [&](size_t k) { return k < insns.size() ? insns[k].opcode.load(memory_order_relaxed) : uint8_t(OP_END); };
+        for (size_t k = 0; k < insns.size(); ++k) {
+            uint8_t next = op(k + 1), third = op(k + 2);
+            switch (insns[k].opcode) {
+                case OP_LOAD:
+                    if (next == OP_LOAD) {
+                        if (third == OP_IADD && op(k + 3) == OP_STORE) insns[k].opcode = OP_LOAD_LOAD_IADD_STORE;
+                        else if (third >= OP_IF_ICMPEQ && third <= OP_IF_ICMPLE) insns[k].opcode = OP_LOAD_LOAD_IF_ICMP;
+                        else insns[k].opcode = OP_LOAD_LOAD;
+                    } else if (next == OP_ICONST) {
+                        if (third >= OP_IF_ICMPEQ && third <= OP_IF_ICMPLE) insns[k].opcode = OP_LOAD_ICONST_IF_ICMP;
+                        else insns[k].opcode = OP_LOAD_ICONST;
+                    }
+                    break;
+                case OP_IINC:
+                    if (next == OP_GOTO) insns[k].opcode = OP_IINC_GOTO;
+                    break;
+                case OP_GETSTATIC: {
+                    char type = 0;
+                    slotType(memberRefNames(m.owner->constantPool, static_cast<uint16_t>(insns[k].a)).descriptor, 0, type);
+                    if (next == OP_LDC_STRING && type != 'J') insns[k].opcode = OP_GETSTATIC_LDC_STRING;
+                    break;
+                }
+            }
+        }
+    }
+
+    // Reads the constant pool that follows the class file header.
+    static vector<CPEntry> readConstantPool(MemoryFile& mem, uint16_t cp_count) {
+        vector<CPEntry> cp_table(cp_count);
+
+        for (int i = 1; i < cp_count; ++i) {
+            uint8_t tag = mem.read_u1();
+            cp_table[i].tag = tag;
+            const uint8_t* p;
+            switch (tag) {
+            case 1: { // UTF8
+                uint16_t len = mem.read_u2();
+                const uint8_t* bytes = mem.take(len);
+                cp_table[i].utf8_value.assign(reinterpret_cast<const char*>(bytes), len);
+                break;
+            }
+            case 3: case 4: cp_table[i].int_value = mem.read_u4(); break; // int, float bits
+            case 5: case 6: // long, double bits; the next entry is unusable
+                p = mem.take(8);
+                cp_table[i].long_value = uint64_t(MemoryFile::be32(p)) << 32 | MemoryFile::be32(p + 4);
+                i++;
+                break;
+            case 7: cp_table[i].name_index = mem.read_u2(); break;
+            case 8: cp_table[i].string_index = mem.read_u2(); break;
+            case 9: case 10: case 11:
+                p = mem.take(4);
+                cp_table[i].class_index = MemoryFile::be16(p);
+                cp_table[i].name_and_type_index = MemoryFile::be16(p + 2);
+                break;
+            case 12:
+                p = mem.take(4);
+                cp_table[i].name_index = MemoryFile::be16(p);
+                cp_table[i].descriptor_index = MemoryFile::be16(p + 2);
+                break;
+            default:
+                throw runtime_error("Unknown constant pool tag: " + to_string(tag));
+            }
+        }
+        return cp_table;
+    }
+
+    // Binary name behind a CONSTANT_Class entry, or "" if malformed.
+    static string classNameAt(const vector<CPEntry>& cp_table, uint16_t class_index) {
+        uint16_t cp_count = static_cast<uint16_t>(cp_table.size());
+        if (class_index > 0 && class_index < cp_count && cp_table[class_index].tag == 7) {
+            uint16_t name_index = cp_table[class_index].name_index;
+            if (name_index > 0 && name_index < cp_count && cp_table[name_index].tag == 1)
+                return cp_table[name_index].utf8_value;
+        }
+        return "";
+    }
+
+    ClassPtr loadClassFromFile(const string& filename) {
+        return defineParsed(parseClassFile(filename));
+    }
+
+    ParsedClass parseClassFile(const string& filename) {
+        auto file = make_shared<const MappedFile>(filename);
+        ParsedClass parsed = parseClass(file->data, file->size, classBuffer);
+        parsed.clazz->imageFile = move(file);
+        return parsed;
+    }
+
+    // Loads the application named on the command line, an archive or a
+    // single class file, and returns its main class. Other classes load on
+    // first reference: from the shared image when there is a usable one, then
+    // from the archive or from the class file's directory.
+    ClassPtr loadApplication(const string& path) {
+        MappedFile file(path);
+        string mainClass;
+        if (file.size >= 4 && ClassArchive::isArchive(file.data)) {
+            archive = make_unique<ClassArchive>(path);
+            mainClass = archive->mainClass();
+        }
+        if (!shared && (options.share == ShareMode::Auto || options.share == ShareMode::On)) {
+            try {
+                shared = make_shared<const SharedImage>(SharedImage::pathFor(path), path);
+            } catch (const exception&) {
+                if (options.share == ShareMode::On) throw;
+            }
+        }
+        unsigned parseThreads = options.parseThreads ? options.parseThreads : std::thread::hardware_concurrency();
+        if (archive && !shared && parseThreads > 1) {
+            prefetcher = make_unique<ClassPrefetcher>(*archive, parseThreads,
+                [this](const uint8_t* image, size_t size, vector<uint8_t>& buffer) {
+                    return parseClass(image, size, buffer);
+                });
+        }
+
+        // Supertypes load with the main class, so classDir has to be known
+        // before it is defined.
+        ClassPtr clazz;
+        if (!archive) {
+            if (shared) {
+                mainClass = shared->str(shared->header->mainClass);
+                classDir = classRoot(path, mainClass);
+                clazz = loadClass(mainClass);
+            } else {
+                ParsedClass parsed = parseClassFile(path);
+                classDir = classRoot(path, parsed.clazz->name);
+                clazz = defineParsed(move(parsed));
+            }
+        } else {
+            clazz = loadClass(mainClass);
+        }
+        if (!clazz) throw VMError(VMErrorKind::NoClassDefFoundError, mainClass);
+        return clazz;
+    }
+
+    // Root of the class tree around a single class file: its path minus
+    // "pkg/Name.class" when it matches the package layout, otherwise the
+    // file's own directory.
+    static string classRoot(const string& path, const string& className) {
+        string relative = className + ".class";
+        string normalized = path;
+        replace(normalized.begin(), normalized.end(), '\\', '/');
+        size_t slash = normalized.find_last_of('/');
+        if (normalized.size() >= relative.size() &&
+            normalized.compare(normalized.size() - relative.size(), string::npos, relative) == 0 &&
+            (normalized.size() == relative.size() || normalized[normalized.size() - relative.size() - 1] == '/'))
+            return path.substr(0, path.size() - relative.size());
+        return slash == string::npos ? "" : path.substr(0, slash + 1);
+    }
+
+    // The named class, loaded on first reference; null if no loader has it.
+    ClassPtr loadClass(const string& name) {
+        auto hold = safepoint.acquire(classLock);
+        auto it = loadedClasses.find(name);
+        if (it != loadedClasses.end()) return it->second;
+        if (name.empty()) return nullptr;
+        if (name[0] == '[') return arrayClass(name);
+
+        ClassPtr clazz;
+        const SharedClass* rec = shared ? shared->find(name) : nullptr;
+        if (rec && rec->sourceSize) {
+            // Classes beside a single-file main class may change on their own.
+            uint64_t size;
+            int64_t time;
+            SharedImage::sourceStamp(classDir + name + ".class", size, time);
+            if (size != rec->sourceSize || time != rec->sourceTime) rec = nullptr;
+        }
+        if (rec) {
+            clazz = defineSharedClass(*rec);
+        } else if (archive) {
+            ParsedClass parsed;
+            uint32_t offset, length;
+            if (prefetcher && prefetcher->take(name, parsed, classBuffer)) {
+                clazz = defineParsed(move(parsed));
+            } else {
+                if (!archive->find(name, offset, length)) return nullptr;
+                clazz = defineClass(archive->file.data + offset, length);
+            }
+        } else {
+            string path = classDir + name + ".class";
+            if (!ifstream(path, ios::binary)) return nullptr;
+            clazz = loadClassFromFile(path);
+        }
+        if (clazz->name != name)
+            throw VMError(VMErrorKind::NoClassDefFoundError, name + " (wrong name: " + clazz->name + ")");
+        if (options.logClassLoad)
+            cerr << "[class,load] " << name << " source: "
+                 << (rec ? "shared image" : archive ? "archive" : classDir + name + ".class") << endl;
+        return clazz;
+    }
+
+    // Parses one encrypted class file image, kept mapped by the caller, and
+    // registers the class.
+    ClassPtr defineClass(const uint8_t* image, size_t size) {
+        return defineParsed(parseClass(image, size, classBuffer));
+    }
+
+    // Decrypts (into buffer) and parses a class file image. It only reads
+    // the natives table, so class prefetch threads run it too. Method
+    // bodies are left encrypted in image, which has to outlive the class,
+    // until they are first called.
+    ParsedClass parseClass(const uint8_t* image, size_t size, vector<uint8_t>& buffer) const {
+        if (buffer.size() < size) buffer.resize(size);
+        MemoryFile mem(image, buffer.data(), size);
+
+        const uint8_t* header = mem.take(10);
+        uint32_t magic = MemoryFile::be32(header);
+        if (magic != 0xCAFEBABE) throw runtime_error("Invalid magic number");
+
+        uint16_t cp_count = MemoryFile::be16(header + 8);
+        vector<CPEntry> cp_table = readConstantPool(mem, cp_count);
+
+        const uint8_t* classInfo = mem.take(6);
+        uint16_t access_flags = MemoryFile::be16(classInfo);
+        uint16_t this_class = MemoryFile::be16(classInfo + 2);
+        uint16_t super_class = MemoryFile::be16(classInfo + 4);
+
+        string className = classNameAt(cp_table, this_class);
         if (className.empty()) throw runtime_error("Cannot determine class name");
 
-        if (loadedClasses.count(className)) return loadedClasses[className];
+        ParsedClass parsed;
+        auto clazz = parsed.clazz = make_shared<Class>(className);
+        clazz->image = image;
+        clazz->constantPool = move(cp_table);
+        auto& cp = clazz->constantPool;
+
+        clazz->isInterface = (access_flags & 0x0200) != 0;
+        clazz->isAbstract = (access_flags & 0x0400) != 0;
+
+        // Supertypes, loaded when the class is defined
+        if (super_class) parsed.superName = classNameAt(cp, super_class);
+        uint16_t interfaces_count = mem.read_u2();
+        const uint8_t* interfaceIndices = mem.take(interfaces_count * 2);
+        for (int i = 0; i < interfaces_count; ++i)
+            parsed.interfaceNames.push_back(classNameAt(cp, MemoryFile::be16(interfaceIndices + 2 * i)));
+
+        // Fields
+        uint16_t fields_count = mem.read_u2();
+        for (int i = 0; i < fields_count; ++i) {
+            Field f;
+            const uint8_t* info = mem.take(8);
+            uint16_t f_access = MemoryFile::be16(info);
+            uint16_t f_name = MemoryFile::be16(info + 2);
+            uint16_t f_desc = MemoryFile::be16(info + 4);
+            f.isStatic = (f_access & 0x0008) != 0;
+
+            if (f_name > 0 && f_name < cp_count && cp[f_name].tag == 1)
+                f.name = cp[f_name].utf8_value;
+            if (f_desc > 0 && f_desc < cp_count && cp[f_desc].tag == 1)
+                f.descriptor = cp[f_desc].utf8_value;
+
+            uint16_t attr_count = MemoryFile::be16(info + 6);
+            for (int j = 0; j < attr_count; ++j) {
+                const uint8_t* attr = mem.take(6);
+                mem.skip(MemoryFile::be32(attr + 2));
+            }
+
+            clazz->fields.push_back(f);
+            clazz->fieldMap[f.name] = clazz->fields.size() - 1;
+        }
+
+        // Methods
+        uint16_t methods_count = mem.read_u2();
+        for (int i = 0; i < methods_count; ++i) {
+            Method m(clazz);
+            const uint8_t* info = mem.take(8);
+            uint16_t m_access = MemoryFile::be16(info);
+            uint16_t m_name = MemoryFile::be16(info + 2);
+            uint16_t m_desc = MemoryFile::be16(info + 4);
+            m.isStatic = (m_access & 0x0008) != 0;
+            m.isPrivate = (m_access & 0x0002) != 0;
+            m.isSynchronized = (m_access & 0x0020) != 0;
+
+            if (m_name > 0 && m_name < cp_count && cp[m_name].tag == 1)
+                m.name = cp[m_name].utf8_value;
+            if (m_desc > 0 && m_desc < cp_count && cp[m_desc].tag == 1)
+                m.descriptor = cp[m_desc].utf8_value;
+
+            uint16_t attr_count = MemoryFile::be16(info + 6);
+            for (int j = 0; j < attr_count; ++j) {
+                const uint8_t* attr = mem.take(6);
+                uint16_t attr_name = MemoryFile::be16(attr);
+                uint32_t attr_len = MemoryFile::be32(attr + 2);
+                string attrName;
+                if (attr_name > 0 && attr_name < cp_count && cp[attr_name].tag == 1)
+                    attrName = cp[attr_name].utf8_value;
+
+                if (attrName == "Code") {
+                    const uint8_t* codeInfo = mem.take(8);
+                    m.max_stack = MemoryFile::be16(codeInfo);
+                    m.max_locals = MemoryFile::be16(codeInfo + 2);
+                    m.codeLength = MemoryFile::be32(codeInfo + 4);
+                    m.codeOffset = static_cast<uint32_t>(mem.tell());
+                    mem.skip(m.codeLength);
+
+                    uint16_t ex_table_len = mem.read_u2();
+                    const uint8_t* table = mem.take(ex_table_len * 8);
+                    for (int k = 0; k < ex_table_len; ++k, table += 8) {
+                        m.handlers.push_back({ MemoryFile::be16(table), MemoryFile::be16(table + 2),
+                                               MemoryFile::be16(table + 4), MemoryFile::be16(table + 6) });
+                    }
+
+                    uint16_t code_attr_count = mem.read_u2();
+                    for (int k = 0; k < code_attr_count; ++k) {
+                        const uint8_t* codeAttr = mem.take(6);
+                        mem.skip(MemoryFile::be32(codeAttr + 2));
+                    }
+                }
+                else {
+                    mem.skip(attr_len);
+                }
+            }
+
+            m.native = findNative(className, m.name, m.descriptor);
+            clazz->methods.push_back(m);
+            clazz->methodMap[m.name + m.descriptor] = clazz->methods.size() - 1;
+        }
+
+        return parsed;
+    }
+
+    // Registers a parsed class, unless one of that name came first, and
+    // links it. Supertypes load with their subclass; linking needs them.
+    ClassPtr defineParsed(ParsedClass parsed) {
+        ClassPtr& slot = loadedClasses[parsed.clazz->name];
+        if (slot) return slot;
+        ClassPtr clazz = slot = parsed.clazz;
+        linkSupertypes(clazz, parsed.superName, parsed.interfaceNames);
+        return clazz;
+    }
+
+    // Loads the supertypes a newly registered class names, then links it.
+    // If one cannot be loaded the class is dropped again, so it is never
+    // used unlinked or as a root of the hierarchy.
+    void linkSupertypes(const ClassPtr& clazz, const string& superName, const vector<string>& interfaceNames) {
+        try {
+            if (!superName.empty()) {
+                clazz->superClass = loadClass(superName);
+                if (!clazz->superClass) throw VMError(VMErrorKind::NoClassDefFoundError, superName);
+            }
+            loadInterfaces(*clazz, interfaceNames);
+            linkClass(*clazz);
+        } catch (...) {
+            loadedClasses.erase(clazz->name);
+            throw;
+        }
+    }
+
+    void loadInterfaces(Class& clazz, const vector<string>& names) {
+        for (auto& name : names) {
+            ClassPtr iface = loadClass(name);
+            if (!iface) throw VMError(VMErrorKind::NoClassDefFoundError, name);
+            clazz.interfaces.push_back(iface);
+        }
+    }
+
+    // Every interface cls implements, directly or through its superclasses
+    // and superinterfaces, each once.
+    static void allInterfaces(Class* cls, vector<Class*>& out) {
+        for (; cls; cls = cls->superClass.get()) {
+            for (auto& iface : cls->interfaces) {
+                if (find(out.begin(), out.end(), iface.get()) != out.end()) continue;
+                out.push_back(iface.get());
+                allInterfaces(iface.get(), out);
+            }
+        }
+    }
+
+    // Bytes an instance field of this descriptor takes; 0 for references.
+    static uint32_t fieldSize(const string& descriptor) {
+        switch (descriptor.empty() ? 'I' : descriptor[0]) {
+            case 'L': case '[': return 0;
+            case 'J': case 'D': return 8;
+            case 'B': case 'Z': return 1;
+            case 'C': case 'S': return 2;
+            default: return 4;
+        }
+    }
+
+    // Instance layout: an object's reference fields sit together right
+    // after the header, where the collector scans them, and its primitive
+    // fields follow in Object::data(), largest first so they pack without
+    // padding. Inherited fields come first in both, so a field keeps its
+    // offset in every subclass.
+    static void layoutFields(Class& c) {
+        uint32_t refs = c.superClass ? c.superClass->instanceRefs : 0;
+        uint32_t bytes = c.superClass ? c.superClass->instanceBytes : 0;
+        for (auto& f : c.fields) {
+            if (!f.isStatic && fieldSize(f.descriptor) == 0) f.offset = refs++;
+        }
+        for (uint32_t size : { 8u, 4u, 2u, 1u }) {
+            for (auto& f : c.fields) {
+                if (f.isStatic || fieldSize(f.descriptor) != size) continue;
+                bytes = (bytes + size - 1) & ~(size - 1);
+                f.offset = bytes;
+                bytes += size;
+            }
+        }
+        if (refs > UINT16_MAX) throw runtime_error("Too many reference fields in " + c.name);
+        c.instanceRefs = static_cast<uint16_t>(refs);
+        c.instanceBytes = bytes;
+    }
+
+    // Linking. The vtable starts as a copy of the superclass's; overriding
+    // methods take over their slot and new virtual methods are appended.
+    // Interface methods get itable slots instead, and every class gets one
+    // itable per interface it implements, mapping those slots to the
+    // implementation: the class's own or inherited method, else a default
+    // method. Calls then dispatch with an index, not a name lookup.
+    void linkClass(Class& c) {
+        if (c.linked) return;
+        c.linked = true;
+        if (c.superClass) {
+            linkClass(*c.superClass);
+            c.vtable = c.superClass->vtable;
+        }
+        for (auto& iface : c.interfaces) linkClass(*iface);
+        layoutFields(c);
+
+        int itableSize = 0;
+        for (auto& m : c.methods) {
+            if (m.isStatic || m.name[0] == '<') continue;   // <init>, <clinit>
+            if (c.isInterface) {
+                m.itableIndex = itableSize++;
+            } else if (!m.isPrivate) {
+                Method* overridden = c.superClass ? findMethod(c.superClass.get(), m.name + m.descriptor) : nullptr;
+                if (overridden && overridden->vtableIndex >= 0) {
+                    m.vtableIndex = overridden->vtableIndex;
+                    c.vtable[m.vtableIndex] = &m;
+                } else {
+                    m.vtableIndex = static_cast<int>(c.vtable.size());
+                    c.vtable.push_back(&m);
+                }
+            }
+        }
+        if (c.isInterface) return;
+
+        vector<Class*> interfaces;
+        allInterfaces(&c, interfaces);
+        for (Class* iface : interfaces) {
+            vector<Method*> itable;
+            for (auto& im : iface->methods) {
+                if (im.itableIndex < 0) continue;
+                string key = im.name + im.descriptor;
+                Method* impl = nullptr;
+                for (Class* k = &c; k && !impl; k = k->superClass.get()) {
+                    auto it = k->methodMap.find(key);
+                    if (it != k->methodMap.end() && !k->methods[it->second].isStatic) impl = &k->methods[it->second];
+                }
+                for (size_t i = 0; i < interfaces.size() && !impl; ++i) {
+                    auto it = interfaces[i]->methodMap.find(key);
+                    if (it != interfaces[i]->methodMap.end() && interfaces[i]->methods[it->second].codeLength)
+                        impl = &interfaces[i]->methods[it->second];
+                }
+                itable.resize(im.itableIndex + 1);
+                itable[im.itableIndex] = impl ? impl : &im;   // abstract: AbstractMethodError when called
+            }
+            c.itables.emplace_back(iface, move(itable));
+        }
+    }
 
+    // Builds a class from its shared image records.
+    ClassPtr defineSharedClass(const SharedClass& rec) {
+        string className(shared->str(rec.name));
+        if (!rec.superName.length && className != "java/lang/Object")
+            throw VMError(VMErrorKind::NoClassDefFoundError, className + " has no superclass in the shared image");
         auto clazz = make_shared<Class>(className);
         loadedClasses[className] = clazz;
-        clazz->constantPool = cp_table;
 
-        // Interfaces
-        uint16_t interfaces_count = mem.read_u2();
-        for (int i = 0; i < interfaces_count; ++i) mem.read_u2();
+        const SharedCPEntry* cpRecs = shared->at<SharedCPEntry>(rec.cpOffset, rec.cpCount);
+        clazz->constantPool.resize(rec.cpCount);
+        for (uint32_t i = 0; i < rec.cpCount; ++i) {
+            CPEntry& e = clazz->constantPool[i];
+            const SharedCPEntry& r = cpRecs[i];
+            e.tag = r.tag;
+            e.class_index = r.class_index;
+            e.name_and_type_index = r.name_and_type_index;
+            e.string_index = r.string_index;
+            e.name_index = r.name_index;
+            e.descriptor_index = r.descriptor_index;
+            e.int_value = r.int_value;
+            e.long_value = r.long_value;
+            if (r.utf8.length) e.utf8_value = shared->str(r.utf8);
+        }
 
-        // Fields
-        uint16_t fields_count = mem.read_u2();
-        for (int i = 0; i < fields_count; ++i) {
+        const SharedField* fieldRecs = shared->at<SharedField>(rec.fieldOffset, rec.fieldCount);
+        for (uint32_t i = 0; i < rec.fieldCount; ++i) {
             Field f;
-            uint16_t f_access = mem.read_u2();
-            uint16_t f_name = mem.read_u2();
-            uint16_t f_desc = mem.read_u2();
-            f.isStatic = (f_access & 0x0008) != 0;
+            f.name = shared->str(fieldRecs[i].name);
+            f.descriptor = shared->str(fieldRecs[i].descriptor);
+            f.isStatic = fieldRecs[i].isStatic != 0;
+            clazz->fields.push_back(f);
+            clazz->fieldMap[f.name] = clazz->fields.size() - 1;
+        }
+
+        const SharedMethod* methodRecs = shared->at<SharedMethod>(rec.methodOffset, rec.methodCount);
+        for (uint32_t i = 0; i < rec.methodCount; ++i) {
+            const SharedMethod& r = methodRecs[i];
+            Method m(clazz);
+            m.name = shared->str(r.name);
+            m.descriptor = shared->str(r.descriptor);
+            m.max_stack = r.maxStack;
+            m.max_locals = r.maxLocals;
+            m.isStatic = r.isStatic != 0;
+            m.isPrivate = r.isPrivate != 0;
+            m.isSynchronized = r.isSynchronized != 0;
+            const uint8_t* code = shared->at<uint8_t>(r.codeOffset, r.codeLength);
+            m.code.assign(code, code + r.codeLength);   // already decoded; verified and fused on the first call
+            m.codeLength = r.codeLength;
+            const SharedInsn* insns = shared->at<SharedInsn>(r.insnOffset, r.insnCount);
+            m.insns.resize(r.insnCount);
+            for (uint32_t k = 0; k < r.insnCount; ++k) {
+                m.insns[k].opcode = static_cast<uint8_t>(insns[k].opcode);
+                m.insns[k].pc = insns[k].pc;
+                m.insns[k].a = insns[k].a;
+                m.insns[k].b = insns[k].b;
+            }
+            m.backedges.assign(r.insnCount, 0);
+            const SharedHandler* handlers = shared->at<SharedHandler>(r.handlerOffset, r.handlerCount);
+            for (uint32_t k = 0; k < r.handlerCount; ++k) {
+                m.handlers.push_back({ handlers[k].start, handlers[k].end, handlers[k].target,
+                                       static_cast<uint16_t>(handlers[k].catchType) });
+            }
+            m.native = findNative(className, m.name, m.descriptor);
+            clazz->methods.push_back(m);
+            clazz->methodMap[m.name + m.descriptor] = clazz->methods.size() - 1;
+        }
+
+        clazz->isInterface = (rec.accessFlags & 0x0200) != 0;
+        clazz->isAbstract = (rec.accessFlags & 0x0400) != 0;
+        const SharedString* interfaceRecs = shared->at<SharedString>(rec.interfaceOffset, rec.interfaceCount);
+        vector<string> interfaceNames;
+        for (uint32_t i = 0; i < rec.interfaceCount; ++i) interfaceNames.emplace_back(shared->str(interfaceRecs[i]));
+        linkSupertypes(clazz, string(shared->str(rec.superName)), interfaceNames);
+        return clazz;
+    }
+
+    // -Xshare:dump: loads the main class and every class its constant pools
+    // name, transitively, and writes them all to the shared image. Built-in
+    // classes are not included; they come from the native registry at
+    // bootstrap and have no class file behind them.
+    void dumpSharedImage(const string& appPath, const string& imagePath) {
+        ClassPtr mainClass = loadApplication(appPath);
+        vector<Class*> classes;
+        unordered_map<string, bool> seen;
+        vector<string> pending{ mainClass->name };
+        while (!pending.empty()) {
+            string name = pending.back();
+            pending.pop_back();
+            if (seen[name]) continue;
+            seen[name] = true;
+            ClassPtr clazz = loadClass(name);
+            if (!clazz || clazz->constantPool.empty()) continue;   // missing or built-in
+            classes.push_back(clazz.get());
+            for (uint16_t i = 1; i < clazz->constantPool.size(); ++i)
+                if (clazz->constantPool[i].tag == 7) pending.push_back(classNameAt(clazz->constantPool, i));
+        }
+
+        vector<uint8_t> image(sizeof(SharedHeader));
+        unordered_map<string, SharedString> strings;
+        auto align = [&] { image.resize((image.size() + 7) & ~size_t(7)); };
+        auto append = [&](const void* data, size_t len) {
+            align();
+            if (image.size() + len > UINT32_MAX) throw runtime_error("Shared image too large");
+            uint32_t offset = static_cast<uint32_t>(image.size());
+            image.insert(image.end(), static_cast<const uint8_t*>(data), static_cast<const uint8_t*>(data) + len);
+            return offset;
+        };
+        auto addString = [&](const string& text) {
+            auto it = strings.find(text);
+            if (it != strings.end()) return it->second;
+            SharedString ref{ append(text.data(), text.size()), static_cast<uint32_t>(text.size()) };
+            strings.emplace(text, ref);
+            return ref;
+        };
+
+        vector<SharedClass> records(classes.size());
+        for (size_t c = 0; c < classes.size(); ++c) {
+            Class* clazz = classes[c];
+            SharedClass& rec = records[c];
+            // A class without its superclass would be taken as valid by every later run.
+            if (!clazz->superClass && clazz->name != "java/lang/Object")
+                throw runtime_error("Cannot dump " + clazz->name + ": superclass not loaded");
+            rec.name = addString(clazz->name);
+            rec.superName = clazz->superClass ? addString(clazz->superClass->name) : SharedString{ 0, 0 };
+            rec.accessFlags = (clazz->isInterface ? 0x0200u : 0u) | (clazz->isAbstract ? 0x0400u : 0u);
+            vector<SharedString> interfaceNames;
+            for (auto& iface : clazz->interfaces) interfaceNames.push_back(addString(iface->name));
+            rec.interfaceCount = static_cast<uint32_t>(interfaceNames.size());
+            rec.interfaceOffset = append(interfaceNames.data(), interfaceNames.size() * sizeof(SharedString));
+            rec.next = 0;
+            rec.sourceSize = 0;
+            rec.sourceTime = 0;
+            if (!archive && clazz != mainClass.get())
+                SharedImage::sourceStamp(classDir + clazz->name + ".class", rec.sourceSize, rec.sourceTime);
+
+            vector<SharedCPEntry> cp(clazz->constantPool.size());
+            for (size_t i = 0; i < cp.size(); ++i) {
+                const CPEntry& e = clazz->constantPool[i];
+                cp[i] = { e.tag, e.class_index, e.name_and_type_index, e.string_index, e.name_index,
+                          e.descriptor_index, e.int_value, e.long_value, e.tag == 1 ? addString(e.utf8_value) : SharedString{ 0, 0 } };
+            }
+            rec.cpCount = static_cast<uint32_t>(cp.size());
+            rec.cpOffset = append(cp.data(), cp.size() * sizeof(SharedCPEntry));
+
+            vector<SharedField> fields;
+            for (auto& f : clazz->fields)
+                fields.push_back({ addString(f.name), addString(f.descriptor), f.isStatic ? 1u : 0u });
+            rec.fieldCount = static_cast<uint32_t>(fields.size());
+            rec.fieldOffset = append(fields.data(), fields.size() * sizeof(SharedField));
+
+            vector<SharedMethod> methods;
+            for (auto& m : clazz->methods) {
+                if (m.codeLength) materialize(m);
+                vector<SharedInsn> insns;
+                for (auto& in : m.insns) insns.push_back({ in.pc, in.a, in.b, unfusedOpcode(in.opcode) });
+                SharedMethod r{ addString(m.name), addString(m.descriptor),
+                                static_cast<uint32_t>(m.max_stack), static_cast<uint32_t>(m.max_locals),
+                                m.isStatic ? 1u : 0u, m.isPrivate ? 1u : 0u, m.isSynchronized ? 1u : 0u,
+                                0, static_cast<uint32_t>(m.code.size()), 0,
+                                static_cast<uint32_t>(insns.size()), 0,
+                                static_cast<uint32_t>(m.handlers.size()) };
+                vector<SharedHandler> handlers;
+                for (auto& h : m.handlers) handlers.push_back({ h.start, h.end, h.target, h.catchType });
+                r.codeOffset = append(m.code.data(), m.code.size());
+                r.insnOffset = append(insns.data(), insns.size() * sizeof(SharedInsn));
+                r.handlerOffset = append(handlers.data(), handlers.size() * sizeof(SharedHandler));
+                methods.push_back(r);
+            }
+            rec.methodCount = static_cast<uint32_t>(methods.size());
+            rec.methodOffset = append(methods.data(), methods.size() * sizeof(SharedMethod));
+        }
+
+        uint32_t bucketCount = 1;
+        while (bucketCount < records.size()) bucketCount <<= 1;
+        vector<uint32_t> buckets(bucketCount, 0);
+        vector<uint32_t> recordOffsets(records.size());
+        align();
+        uint32_t recordBase = static_cast<uint32_t>(image.size());
+        for (size_t c = 0; c < records.size(); ++c) {
+            recordOffsets[c] = recordBase + static_cast<uint32_t>(c * sizeof(SharedClass));
+            uint32_t& bucket = buckets[ClassArchive::hashName(classes[c]->name) & (bucketCount - 1)];
+            records[c].next = bucket;
+            bucket = recordOffsets[c];
+        }
+        append(records.data(), records.size() * sizeof(SharedClass));
+
+        SharedHeader header{};
+        memcpy(header.magic, SharedImage::MAGIC, sizeof header.magic);
+        strncpy(header.build, SharedImage::buildId(), sizeof header.build);
+        SharedImage::sourceStamp(appPath, header.sourceSize, header.sourceTime);
+        header.classCount = static_cast<uint32_t>(records.size());
+        header.bucketCount = bucketCount;
+        header.bucketOffset = append(buckets.data(), buckets.size() * sizeof(uint32_t));
+        header.mainClass = addString(mainClass->name);
+        memcpy(image.data(), &header, sizeof header);
+
+        ofstream out(imagePath, ios::binary);
+        out.write(reinterpret_cast<const char*>(image.data()), image.size());
+        if (!out) throw runtime_error("Cannot write " + imagePath);
+    }
+
+    static constexpr uint64_t BUDGET_SLICE = 1 << 16;  // steps between clock checks
+
+    bool hasBudget() const { return options.budgetSteps || options.budgetMillis; }
+
+    // Counts a call or taken backward branch; false once the current slice
+    // is used up and budgetTick() has to run. Threads may overwrite each
+    // other's counts, which only stretches a slice a little.
+    bool step() {
+        int64_t left = budgetTicks.load(memory_order_relaxed) - 1;
+        budgetTicks.store(left, memory_order_relaxed);
+        return left >= 0;
+    }
+
+    // Hands out the next slice of the budget, or throws BudgetExceeded once
+    // it is spent. The clock is read once per slice.
+    void budgetTick() {
+        lock_guard<mutex> hold(budgetLock);
+        int64_t left = budgetTicks.load(memory_order_relaxed);
+        if (left >= 0) return;     // another thread refilled it
+        if (options.budgetMillis && chrono::steady_clock::now() >= budgetDeadline)
+            throw BudgetExceeded("time budget of " + to_string(options.budgetMillis) + " ms exceeded");
+        uint64_t slice = options.budgetSteps ? options.budgetSteps - min(budgetIssued, options.budgetSteps) : BUDGET_SLICE;
+        if (slice == 0) throw BudgetExceeded("budget of " + to_string(options.budgetSteps) + " steps exceeded");
+        if (options.budgetMillis) slice = min(slice, BUDGET_SLICE);
+        budgetIssued += slice;
+        budgetTicks.store(left + static_cast<int64_t>(slice), memory_order_relaxed);
+    }
+
+    // Calls and taken backward branches so far, under a budget.
+    uint64_t stepsUsed() const {
+        return static_cast<uint64_t>(static_cast<int64_t>(budgetIssued) - budgetTicks.load(memory_order_relaxed));
+    }
+
+    // Readies m's body on its first call: decrypts its bytecode from the
+    // class image, decodes it, then verifies and fuses it. Methods that never
+    // run cost neither the time nor the memory. Like resolveRef, later calls
+    // only test the flag, which is set last.
+    void materialize(Method& m) {
+        auto hold = safepoint.acquire(classLock);
+        if (m.materialized.load(memory_order_relaxed)) return;
+        if (m.code.empty()) {   // shared image classes come decoded
+            const Class& owner = *m.owner;
+            if (!owner.image) throw runtime_error("No bytecode for " + owner.name + "." + m.name + m.descriptor);
+            m.code.resize(m.codeLength);
+            decryptClassBytes(owner.image + m.codeOffset, m.code.data(), m.codeLength, m.codeOffset);
+            try {
+                decodeMethod(m);
+            } catch (...) {
+                m.code.clear();
+                throw;
+            }
+        }
+        if (options.verify) m.verified = verifyMethod(m);
+        if (options.fuse) fuseInsns(m);
+        m.materialized.store(true, memory_order_release);
+    }
+
+    // Activates m on top of the caller. Its first argSlots locals are already
+    // in place at args, the caller's outgoing arguments, which the caller
+    // gives up; the other locals start as int 0 so the collector never sees
+    // stale references. Calls are safepoint polls and budget steps, and a
+    // synchronized method enters its monitor here.
+    Frame& pushFrame(Method* m, StackSlot* args, uint16_t argSlots) {
+        if (safepoint.requested) parkAtPoll();
+        if (!step()) budgetTick();
+        if (!m->materialized.load(memory_order_acquire)) materialize(*m);
+        auto& callStack = currentThread->callStack;
+        VMStack& stack = currentThread->stack;
+        size_t maxLocals = max<size_t>(m->max_locals, argSlots);
+        if (callStack.size() == callStack.capacity() ||
+            static_cast<size_t>(stack.end - args) < maxLocals + m->max_stack)
+            throw VMError(VMErrorKind::StackOverflowError);
+        if (!callStack.empty()) {
+            callStack.back().operands.sp = args;
+            if (m->verified && !callStack.back().method->verified) checkArguments(*m, args);
+        }
+
+        if (m->invocations.bump() >= options.jitCalls && options.jit && !m->jitTried.load(memory_order_relaxed)) compileMethod(*m);
+
+        callStack.emplace_back();
+        Frame& frame = callStack.back();
+        frame.method = m;
+        frame.locals = args;
+        for (StackSlot* s = args + argSlots; s < args + maxLocals; ++s) *s = StackSlot();
+        frame.operands.base = frame.operands.sp = args + maxLocals;
+        frame.operands.limit = frame.operands.base + m->max_stack;
+        if (m->isSynchronized) {
+            Object* monitor = m->isStatic ? classMonitor(*m->owner) : args[0].asRef();
+            monitorEnter(monitor);
+            frame.monitor = monitor;
+        }
+        return frame;
+    }
+
+    // A verified method trusts its argument types; unverified callers have
+    // to be checked before passing them.
+    static void checkArguments(const Method& m, const StackSlot* args) {
+        for (size_t i = 0; i < m.argTypes.size(); ++i) {
+            if (m.argTypes[i] == 'I' ? args[i].isInt() : args[i].isRef()) continue;
+            throw VMError(VMErrorKind::VerifyError, "bad argument " + to_string(i) + " to " +
+                                m.owner->name + "." + m.name + m.descriptor);
+        }
+    }
+
+    // The result an unverified method hands a verified caller, which was
+    // verified against m's descriptor: a value of the declared type, or
+    // none. Fixes up the slots returned in place; returns their number.
+    static int declaredResult(const Method& m, StackSlot* result, int slots) {
+        switch (m.resultType) {
+            case 'I':
+                if (slots < 1 || !result[0].isInt()) result[0] = StackSlot(jint(0));
+                return 1;
+            case 'J':
+                if (slots < 2 || !result[0].isInt() || !result[1].isInt()) result[0] = result[1] = StackSlot(jint(0));
+                return 2;
+            case 'R':
+                if (slots < 1 || !result[0].isRef()) result[0] = StackSlot(nullptr);
+                return 1;
+            default:
+                return 0;
+        }
+    }
+
+    // Operand stack depth before each instruction of m, -1 where it is
+    // unreachable. False unless every path agrees on the depth and stays
+    // within max_stack, and every instruction's stack effect is known.
+    bool stackDepths(Method& m, vector<int>& depth) {
+        const auto& insns = m.insns;
+        depth.assign(insns.size(), -1);
+        vector<size_t> work{ 0 };
+        depth[0] = 0;
+        auto reach = [&](size_t k, int d) {
+            if (k >= insns.size() || d < 0 || d > m.max_stack) return false;
+            if (depth[k] < 0) { depth[k] = d; work.push_back(k); }
+            return depth[k] == d;
+        };
+        for (auto& h : m.handlers)     // entered with the exception on the stack
+            if (!reach(h.target, 1)) return false;
+        while (!work.empty()) {
+            size_t k = work.back();
+            work.pop_back();
+            const Insn& in = insns[k];
+            int d = depth[k], pops = 0, pushes = 0;
+            bool next = true;
+            uint8_t op = unfusedOpcode(in.opcode);
+            auto memberSlots = [&] {
+                char type = 0;
+                slotType(memberRefNames(m.owner->constantPool, static_cast<uint16_t>(in.a)).descriptor, 0, type);
+                return type == 'J' ? 2 : 1;
+            };
+            if (!primitiveEffect(op, pops, pushes)) switch (op) {
+                case OP_NOP: case OP_IINC: case OP_NEWARRAY: case OP_ANEWARRAY: case OP_ARRAYLENGTH:
+                case OP_GETFIELD_REF: case OP_GETFIELD_INT: case OP_GETFIELD_BYTE: case OP_GETFIELD_CHAR: case OP_GETFIELD_SHORT:
+                    break;
+                case OP_ACONST_NULL: case OP_ICONST: case OP_LDC_STRING: case OP_LDC_CLASS: case OP_LOAD:
+                case OP_NEW:
+                    pushes = 1; break;
+                case OP_LCONST: case OP_LOAD2: pushes = 2; break;
+                case OP_STORE2: case OP_POP2: pops = 2; break;
+                case OP_GETSTATIC: pushes = memberSlots(); break;
+                case OP_GETFIELD: pops = 1; pushes = memberSlots(); break;
+                case OP_PUTFIELD: pops = 1 + memberSlots(); break;
+                case OP_GETFIELD_LONG: pops = 1; pushes = 2; break;
+                case OP_PUTFIELD_LONG: pops = 3; break;
+                case OP_LALOAD: pops = 2; pushes = 2; break;
+                case OP_LASTORE: pops = 4; break;
+                case OP_DUP: pops = 1; pushes = 2; break;
+                case OP_DUP2: pops = 2; pushes = 4; break;
+                case OP_STORE: case OP_POP: case OP_MONITORENTER: case OP_MONITOREXIT: case OP_IFEQ: case OP_IFNE: case OP_IFLT: case OP_IFGE: case OP_IFGT: case OP_IFLE:
+                    pops = 1; break;
+                case OP_IADD: case OP_ISUB: case OP_IMUL: case OP_IDIV:
+                case OP_IALOAD: case OP_FALOAD: case OP_AALOAD: case OP_BALOAD: case OP_CALOAD: case OP_SALOAD:
+                    pops = 2; pushes = 1; break;
+                case OP_IF_ICMPEQ: case OP_IF_ICMPNE: case OP_IF_ICMPLT: case OP_IF_ICMPGE: case OP_IF_ICMPGT: case OP_IF_ICMPLE:
+                case OP_IF_ACMPEQ: case OP_IF_ACMPNE:
+                case OP_PUTFIELD_REF: case OP_PUTFIELD_INT: case OP_PUTFIELD_BYTE: case OP_PUTFIELD_SHORT:
+                    pops = 2; break;
+                case OP_IASTORE: case OP_FASTORE: case OP_AASTORE: case OP_BASTORE: case OP_CASTORE: case OP_SASTORE:
+                    pops = 3; break;
+                case OP_GOTO: next = false; break;
+                case OP_INVOKESTATIC: case OP_INVOKESPECIAL: case OP_INVOKEVIRTUAL: case OP_INVOKEINTERFACE: {
+                    string descriptor = memberRefNames(m.owner->constantPool, static_cast<uint16_t>(in.a)).descriptor;
+                    pops = argSlotCount(descriptor) + (in.opcode == OP_INVOKESTATIC ? 0 : 1);
+                    char result = 'V';
+                    slotType(descriptor, descriptor.find(')') + 1, result);   // leaves V for void
+                    pushes = result == 'V' ? 0 : result == 'J' ? 2 : 1;
+                    break;
+                }
+                case OP_IRETURN: case OP_LRETURN: case OP_ARETURN: case OP_RETURN: case OP_ATHROW: case OP_END:
+                    continue;
+                default:
+                    return false;
+            }
+            if (d < pops) return false;
+            int after = d - pops + pushes;
+            if (after > m.max_stack) return false;
+            if (op >= OP_IFEQ && op <= OP_GOTO && !reach(in.a, after)) return false;
+            if (next && !reach(k + 1, after)) return false;
+        }
+        return true;
+    }
+
+    // Moves m up to the compiled tier once it has been called or has looped
+    // often enough; loop is the hot backward branch, or -1 on a call. The
+    // template JIT only takes methods whose stack use can be laid out
+    // statically; the rest stay interpreted.
+    //
+    // Other threads may be running m meanwhile, so its code is stored only
+    // once complete, with a release store of m.jit. Counters are relaxed; a
+    // lost update only delays compilation.
+    void compileMethod(Method& m, int loop = -1) {
+        lock_guard<mutex> hold(jitLock);
+        if (m.jitTried.load(memory_order_relaxed)) return;
+        m.jitTried.store(true, memory_order_relaxed);
+#if JVM_JIT
+        if (options.jitDump) {
+            cerr << "[jit] " << m.owner->name << "." << m.name << m.descriptor << ": ";
+            if (loop < 0) cerr << m.invocations.load(memory_order_relaxed) << " calls\n";
+            else cerr << m.backedges[loop].load(memory_order_relaxed) << " backedges at pc " << m.insns[loop].pc << " (osr)\n";
+        }
+        vector<int> depth;
+        if (m.native || m.insns.empty() || !stackDepths(m, depth)) return;
+        m.jitCode = TemplateJit(m, depth, safepoint.requested, hasBudget() ? &budgetTicks : nullptr).compile(options.jitDump);
+        m.jit.store(m.jitCode.get(), memory_order_release);
+#endif
+    }
+
+    // Leaves the current frame. A returned value (two slots for long and
+    // double) lands on the caller's operand stack, where the arguments were.
+    void popFrame(const StackSlot* result, int slots = 1) {
+        auto& callStack = currentThread->callStack;
+        if (callStack.back().monitor) monitorExit(callStack.back().monitor);
+        callStack.pop_back();
+        if (!result || callStack.empty()) return;
+        for (int i = 0; i < slots; ++i) callStack.back().operands.push(result[i]);
+    }
+
+    // Runs target, the method constant pool entry index resolved to, with
+    // argSlots argument slots (receiver included) from the top of the
+    // caller's operand stack: natives in place, bytecode in a new frame.
+    // Returns true if a frame was pushed.
+    bool invoke(Frame& frame, uint16_t index, Method* target, NativeFn native, uint16_t argSlots) {
+        if (native) {
+            native(*this, frame.operands);
+            return false;
+        }
+        if (!target) {
+            MemberRef names = memberRefNames(frame.method->owner->constantPool, index);
+            throw VMError(VMErrorKind::NoSuchMethodError, names.className + "." + names.name + names.descriptor);
+        }
+        if (!target->codeLength)
+            throw VMError(VMErrorKind::AbstractMethodError, target->owner->name + "." + target->name + target->descriptor);
+        pushFrame(target, frame.operands.sp - argSlots, argSlots);
+        return true;
+    }
+
+    // A bytecode method finds its receiver in local 0, which its verified
+    // code takes to be an instance of its class (see verifyMethod), so no
+    // call may hand it anything else.
+    static void checkReceiver(const Method* target, const Class* cls) {
+        if (!target || target->native) return;
+        if (target->isStatic)
+            throw VMError(VMErrorKind::IncompatibleClassChangeError, methodName(*target) + " is static");
+        if (!target->owner->isInterface && !isSubclassOf(cls, target->owner.get()))
+            throw VMError(VMErrorKind::IncompatibleClassChangeError, methodName(*target) + " invoked on an instance of " + cls->name);
+    }
+
+    static string methodName(const Method& m) {
+        return m.owner->name + "." + m.name + m.descriptor;
+    }
+
+    // invokestatic: natives run in place; bytecode methods get a new frame.
+    bool invokeStatic(Frame& frame, uint16_t index) {
+        auto& ref = resolveRef(frame.method->owner->constantPool, index);
+        if (ref.method && !ref.method->isStatic)
+            throw VMError(VMErrorKind::IncompatibleClassChangeError, methodName(*ref.method) + " is not static");
+        if (frame.operands.size() < ref.argSlots) return false;
+        return invoke(frame, index, ref.method, ref.native, ref.argSlots);
+    }
+
+    // invokespecial: constructors, private and super calls, bound to the
+    // resolved method with no virtual dispatch.
+    bool invokeSpecial(Frame& frame, uint16_t index) {
+        auto& ref = resolveRef(frame.method->owner->constantPool, index);
+        if (frame.operands.size() <= ref.argSlots) return false;
+        StackSlot receiver = frame.operands.sp[-1 - ref.argSlots];
+        if (!receiver.isRef() || !receiver.asRef()) throw VMError(VMErrorKind::NullPointerException);
+        checkReceiver(ref.method, receiver.asRef()->clazz);
+        return invoke(frame, index, ref.method, ref.native, ref.argSlots + 1);
+    }
+
+    // Implementation of the resolved method m in receiver class cls: a
+    // vtable slot for class methods, an itable slot for interface methods.
+    static Method* dispatch(Class* cls, Method* m) {
+        if (m->vtableIndex >= 0 && static_cast<size_t>(m->vtableIndex) < cls->vtable.size())
+            return cls->vtable[m->vtableIndex];
+        if (m->itableIndex >= 0) {
+            for (auto& itable : cls->itables)
+                if (itable.first == m->owner.get()) return itable.second[m->itableIndex];
+            throw VMError(VMErrorKind::IncompatibleClassChangeError, cls->name +
+                " does not implement " + m->owner->name);
+        }
+        return m;   // private, or not overridable
+    }
+
+    // Receiver's implementation of a virtual call. With a call site, the
+    // site's monomorphic inline cache answers repeat receivers of the same
+    // class without a table lookup. Cache entries live in the receiver
+    // class, one per method reference, and are only made once the receiver
+    // passed the checks: a vtable slot means the resolved method only in
+    // its subclasses.
+    Method* lookupVirtual(Class* cls, CPEntry& ref, Insn* site) {
+        const InlineCache* ic = site ? site->ic.load(memory_order_acquire) : nullptr;
+        if (ic && ic->receiver == cls) return ic->target;
+        if (ref.method && !ref.method->owner->isInterface && !isSubclassOf(cls, ref.method->owner.get()))
+            throw VMError(VMErrorKind::IncompatibleClassChangeError, methodName(*ref.method) + " invoked on an instance of " + cls->name);
+        Method* target = ref.method ? dispatch(cls, ref.method) : findMethod(cls, ref.memberKey);
+        checkReceiver(target, cls);
+        if (site) {
+            lock_guard<mutex> hold(inlineCacheLock);
+            site->ic.store(&cls->inlineCaches.emplace(&ref, InlineCache{ cls, target }).first->second, memory_order_release);
+        }
+        return target;
+    }
+
+    // invokevirtual and invokeinterface: dispatch on the receiver's class.
+    bool invokeVirtual(Frame& frame, uint16_t index, Insn* site = nullptr) {
+        auto& operands = frame.operands;
+        auto& ref = resolveRef(frame.method->owner->constantPool, index);
+        if (operands.size() <= ref.argSlots) return false;
+
+        StackSlot receiver = operands.sp[-1 - ref.argSlots];
+        if (!receiver.isRef() || !receiver.asRef()) throw VMError(VMErrorKind::NullPointerException);
+        Method* target = lookupVirtual(receiver.asRef()->clazz, ref, site);
+        NativeFn native = target ? target->native : ref.native;
+        return invoke(frame, index, target, native, ref.argSlots + 1);
+    }
+
+    // The condition of if_icmp<cond> op.
+    static bool intCompare(uint8_t op, jint a, jint b) {
+        switch (op) {
+            case OP_IF_ICMPEQ: return a == b;
+            case OP_IF_ICMPNE: return a != b;
+            case OP_IF_ICMPLT: return a < b;
+            case OP_IF_ICMPGE: return a >= b;
+            case OP_IF_ICMPGT: return a > b;
+            default: return a <= b;
+        }
+    }
+
+    // Java int arithmetic wraps; done unsigned, where C++ wraps too.
+    static jint intAdd(jint a, jint b) { return static_cast<jint>(static_cast<uint32_t>(a) + static_cast<uint32_t>(b)); }
+    static jint intSub(jint a, jint b) { return static_cast<jint>(static_cast<uint32_t>(a) - static_cast<uint32_t>(b)); }
+    static jint intMul(jint a, jint b) { return static_cast<jint>(static_cast<uint32_t>(a) * static_cast<uint32_t>(b)); }
+
+    // Java division: MIN_VALUE / -1 wraps instead of trapping.
+    static jint intDiv(jint a, jint b) {
+        return b == -1 ? static_cast<jint>(0u - static_cast<uint32_t>(a)) : a / b;
+    }
+    static jlong longDiv(jlong a, jlong b) {
+        return b == -1 ? static_cast<jlong>(0 - static_cast<uint64_t>(a)) : a / b;
+    }
+    static jlong longRem(jlong a, jlong b) { return b == -1 ? 0 : a % b; }
+
+    // A long or double takes two int slots, low word first, so each slot
+    // keeps its tag and the collector never takes the bits for a
+    // reference. A float is one int slot holding its bits.
+    static uint64_t wideAt(const StackSlot* s) {
+        return static_cast<uint32_t>(s[0].bits) | uint64_t(static_cast<uint32_t>(s[1].bits)) << 32;
+    }
+    static void setWide(StackSlot* s, uint64_t v) {
+        s[0].bits = StackSlot::INT_TAG | static_cast<uint32_t>(v);
+        s[1].bits = StackSlot::INT_TAG | v >> 32;
+    }
+    static jlong longAt(const StackSlot* s) { return static_cast<jlong>(wideAt(s)); }
+    static void setLong(StackSlot* s, jlong v) { setWide(s, static_cast<uint64_t>(v)); }
+    static uint64_t doubleBits(jdouble v) { uint64_t bits; memcpy(&bits, &v, 8); return bits; }
+    static jdouble doubleAt(const StackSlot* s) { uint64_t bits = wideAt(s); jdouble v; memcpy(&v, &bits, 8); return v; }
+    static void setDouble(StackSlot* s, jdouble v) { setWide(s, doubleBits(v)); }
+    static jint floatBits(jfloat v) { jint bits; memcpy(&bits, &v, 4); return bits; }
+    static jfloat floatAt(StackSlot s) { jint bits = s.asInt(); jfloat v; memcpy(&v, &bits, 4); return v; }
+    static StackSlot floatSlot(jfloat v) { return StackSlot(floatBits(v)); }
+
+    // f2i, d2l and the like: NaN is 0, out of range values saturate.
+    template<class I, class F> static I floatToInt(F v) {
+        if (v != v) return 0;
+        if (v <= static_cast<F>(numeric_limits<I>::min())) return numeric_limits<I>::min();
+        if (v >= static_cast<F>(numeric_limits<I>::max())) return numeric_limits<I>::max();
+        return static_cast<I>(v);
+    }
+    // fcmpl and fcmpg (dcmp too) differ only in what NaN compares as.
+    template<class F> static jint floatCompare(F a, F b, jint unordered) {
+        return a > b ? 1 : a < b ? -1 : a == b ? 0 : unordered;
+    }
+
+    // Long, float and double instruction OP on the operand stack ending at
+    // sp, whose slots primitiveEffect() describes and the caller has
+    // checked; returns the new end. Instantiated per opcode, so each
+    // handler compiles to just its own case.
+    template<uint8_t OP> static StackSlot* primitive(StackSlot* sp) {
+        switch (OP) {
+            case OP_LADD: setWide(sp - 4, wideAt(sp - 4) + wideAt(sp - 2)); return sp - 2;
+            case OP_LSUB: setWide(sp - 4, wideAt(sp - 4) - wideAt(sp - 2)); return sp - 2;
+            case OP_LMUL: setWide(sp - 4, wideAt(sp - 4) * wideAt(sp - 2)); return sp - 2;
+            case OP_LDIV: case OP_LREM: {
+                jlong a = longAt(sp - 4), b = longAt(sp - 2);
+                if (b == 0) throw VMError(VMErrorKind::ArithmeticException, "/ by zero");
+                setLong(sp - 4, OP == OP_LDIV ? longDiv(a, b) : longRem(a, b));
+                return sp - 2;
+            }
+            case OP_LAND: setWide(sp - 4, wideAt(sp - 4) & wideAt(sp - 2)); return sp - 2;
+            case OP_LOR: setWide(sp - 4, wideAt(sp - 4) | wideAt(sp - 2)); return sp - 2;
+            case OP_LXOR: setWide(sp - 4, wideAt(sp - 4) ^ wideAt(sp - 2)); return sp - 2;
+            case OP_LNEG: setWide(sp - 2, 0 - wideAt(sp - 2)); return sp;
+            case OP_LSHL: setWide(sp - 3, wideAt(sp - 3) << (sp[-1].asInt() & 63)); return sp - 1;
+            case OP_LSHR: setLong(sp - 3, longAt(sp - 3) >> (sp[-1].asInt() & 63)); return sp - 1;
+            case OP_LUSHR: setWide(sp - 3, wideAt(sp - 3) >> (sp[-1].asInt() & 63)); return sp - 1;
+            case OP_LCMP: {
+                jlong a = longAt(sp - 4), b = longAt(sp - 2);
+                sp[-4] = StackSlot(static_cast<jint>(a > b) - static_cast<jint>(a < b));
+                return sp - 3;
+            }
+
+            case OP_FADD: sp[-2] = floatSlot(floatAt(sp[-2]) + floatAt(sp[-1])); return sp - 1;
+            case OP_FSUB: sp[-2] = floatSlot(floatAt(sp[-2]) - floatAt(sp[-1])); return sp - 1;
+            case OP_FMUL: sp[-2] = floatSlot(floatAt(sp[-2]) * floatAt(sp[-1])); return sp - 1;
+            case OP_FDIV: sp[-2] = floatSlot(floatAt(sp[-2]) / floatAt(sp[-1])); return sp - 1;
+            case OP_FREM: sp[-2] = floatSlot(fmod(floatAt(sp[-2]), floatAt(sp[-1]))); return sp - 1;
+            case OP_FNEG: sp[-1] = floatSlot(-floatAt(sp[-1])); return sp;
+            case OP_FCMPL: case OP_FCMPG:
+                sp[-2] = StackSlot(floatCompare(floatAt(sp[-2]), floatAt(sp[-1]), OP == OP_FCMPL ? -1 : 1));
+                return sp - 1;
+
+            case OP_DADD: setDouble(sp - 4, doubleAt(sp - 4) + doubleAt(sp - 2)); return sp - 2;
+            case OP_DSUB: setDouble(sp - 4, doubleAt(sp - 4) - doubleAt(sp - 2)); return sp - 2;
+            case OP_DMUL: setDouble(sp - 4, doubleAt(sp - 4) * doubleAt(sp - 2)); return sp - 2;
+            case OP_DDIV: setDouble(sp - 4, doubleAt(sp - 4) / doubleAt(sp - 2)); return sp - 2;
+            case OP_DREM: setDouble(sp - 4, fmod(doubleAt(sp - 4), doubleAt(sp - 2))); return sp - 2;
+            case OP_DNEG: setDouble(sp - 2, -doubleAt(sp - 2)); return sp;
+            case OP_DCMPL: case OP_DCMPG:
+                sp[-4] = StackSlot(floatCompare(doubleAt(sp - 4), doubleAt(sp - 2), OP == OP_DCMPL ? -1 : 1));
+                return sp - 3;
+
+            case OP_I2L: setLong(sp - 1, sp[-1].asInt()); return sp + 1;
+            case OP_I2F: sp[-1] = floatSlot(static_cast<jfloat>(sp[-1].asInt())); return sp;
+            case OP_I2D: setDouble(sp - 1, sp[-1].asInt()); return sp + 1;
+            case OP_L2I: return sp - 1;     // the low word is already an int slot
+            case OP_L2F: sp[-2] = floatSlot(static_cast<jfloat>(longAt(sp - 2))); return sp - 1;
+            case OP_L2D: setDouble(sp - 2, static_cast<jdouble>(longAt(sp - 2))); return sp;
+            case OP_F2I: sp[-1] = StackSlot(floatToInt<jint>(floatAt(sp[-1]))); return sp;
+            case OP_F2L: setLong(sp - 1, floatToInt<jlong>(floatAt(sp[-1]))); return sp + 1;
+            case OP_F2D: setDouble(sp - 1, floatAt(sp[-1])); return sp + 1;
+            case OP_D2I: sp[-2] = StackSlot(floatToInt<jint>(doubleAt(sp - 2))); return sp - 1;
+            case OP_D2L: setLong(sp - 2, floatToInt<jlong>(doubleAt(sp - 2))); return sp;
+            case OP_D2F: sp[-2] = floatSlot(static_cast<jfloat>(doubleAt(sp - 2))); return sp - 1;
+            default: return sp;
+        }
+    }
+
+    // primitive() for an opcode known only at run time.
+    template<size_t... I>
+    static StackSlot* primitiveOp(uint8_t op, StackSlot* sp, index_sequence<I...>) {
+        static StackSlot* (*const table[])(StackSlot*) = { &primitive<static_cast<uint8_t>(OP_LADD + I)>... };
+        return table[op - OP_LADD](sp);
+    }
+    static StackSlot* primitiveOp(uint8_t op, StackSlot* sp) {
+        return primitiveOp(op, sp, make_index_sequence<OP_DCMPG - OP_LADD + 1>());
+    }
+
+    static StackSlot fieldValue(const Field& field) {
+        char type = field.descriptor.empty() ? 'I' : field.descriptor[0];
+        return (type == 'L' || type == '[') ? StackSlot(field.refValue) : StackSlot(field.intValue);
+    }
+    // Static fields are never written, so a long or double one is the
+    // low word above and a zero high word.
+    static bool isWide(const Field& field) {
+        return !field.descriptor.empty() && (field.descriptor[0] == 'J' || field.descriptor[0] == 'D');
+    }
+
+    void getStatic(Frame& frame, uint16_t index) {
+        auto& ref = resolveRef(frame.method->owner->constantPool, index);
+        frame.operands.push(fieldValue(*ref.field));
+        if (isWide(*ref.field)) frame.operands.push(StackSlot(jint(0)));
+    }
+
+    // Class named by a CONSTANT_Class entry, loaded on first use.
+    Class* resolveClass(vector<CPEntry>& cp, uint16_t index) {
+        CPEntry& entry = cp[index];
+        if (!entry.resolved.load(memory_order_acquire)) {
+            auto hold = safepoint.acquire(classLock);
+            string name = classNameAt(cp, index);
+            entry.refClass = loadClass(name).get();
+            if (!entry.refClass) throw VMError(VMErrorKind::NoClassDefFoundError, name);
+            entry.resolved.store(true, memory_order_release);
+        }
+        return entry.refClass;
+    }
+
+    Object* newInstance(Class* cls) {
+        if (cls->isInterface || cls->isAbstract) throw VMError(VMErrorKind::InstantiationError, cls->name);
+        return heap.allocate(currentThread->tlab, cls, Object::PLAIN, cls->instanceRefs, cls->instanceBytes);
+    }
+
+    // Instance field of a getfield/putfield, resolved once per entry.
+    Field& instanceField(vector<CPEntry>& cp, uint16_t index) {
+        Field* field = resolveRef(cp, index).field;
+        if (field->isStatic) throw VMError(VMErrorKind::IncompatibleClassChangeError, field->name + " is static");
+        return *field;
+    }
+
+    // The internal opcode that accesses this field with a single load or
+    // store at its offset.
+    static uint8_t quickFieldOp(const Field& field, bool put) {
+        switch (field.descriptor[0]) {
+            case 'L': case '[': return put ? OP_PUTFIELD_REF : OP_GETFIELD_REF;
+            case 'I': case 'F': return put ? OP_PUTFIELD_INT : OP_GETFIELD_INT;
+            case 'B': case 'Z': return put ? OP_PUTFIELD_BYTE : OP_GETFIELD_BYTE;
+            case 'C': return put ? OP_PUTFIELD_SHORT : OP_GETFIELD_CHAR;
+            case 'S': return put ? OP_PUTFIELD_SHORT : OP_GETFIELD_SHORT;
+            case 'J': case 'D': return put ? OP_PUTFIELD_LONG : OP_GETFIELD_LONG;
+            default: throw runtime_error("Unsupported field type: " + field.name + " " + field.descriptor);
+        }
+    }
+
+    static Object* nonNullRef(StackSlot slot) {
+        if (!slot.isRef() || !slot.asRef()) throw VMError(VMErrorKind::NullPointerException);
+        return slot.asRef();
+    }
+
+    // The object a getfield or putfield reaches into: not null, and an
+    // instance of the class the field reference names, so field.offset lies
+    // inside it.
+    static Object* fieldReceiver(StackSlot slot, const CPEntry& ref) {
+        Object* obj = nonNullRef(slot);
+        if (!isSubclassOf(obj->clazz, ref.refClass))
+            throw VMError(VMErrorKind::IncompatibleClassChangeError, fieldMismatch(obj, ref));
+        return obj;
+    }
+
+    static string fieldMismatch(const Object* obj, const CPEntry& ref) {
+        return ref.refClass->name + "." + ref.field->name + " accessed on an instance of " + obj->clazz->name;
+    }
+
+    static StackSlot loadField(Object* obj, const Field& field) {
+        const char* p = obj->data() + field.offset;
+        switch (quickFieldOp(field, false)) {
+            case OP_GETFIELD_REF: return StackSlot(obj->refs()[field.offset]);
+            case OP_GETFIELD_BYTE: return StackSlot(static_cast<jint>(static_cast<int8_t>(*p)));
+            case OP_GETFIELD_CHAR: { uint16_t v; memcpy(&v, p, 2); return StackSlot(static_cast<jint>(v)); }
+            case OP_GETFIELD_SHORT: { int16_t v; memcpy(&v, p, 2); return StackSlot(static_cast<jint>(v)); }
+            default: { jint v; memcpy(&v, p, 4); return StackSlot(v); }
+        }
+    }
+
+    static void storeField(Object* obj, const Field& field, StackSlot value) {
+        char* p = obj->data() + field.offset;
+        jint v = value.asInt();
+        switch (quickFieldOp(field, true)) {
+            case OP_PUTFIELD_REF: obj->refs()[field.offset] = value.isRef() ? value.asRef() : nullptr; break;
+            case OP_PUTFIELD_BYTE: *p = static_cast<char>(v); break;
+            case OP_PUTFIELD_SHORT: { uint16_t w = static_cast<uint16_t>(v); memcpy(p, &w, 2); break; }
+            default: memcpy(p, &v, 4); break;
+        }
+    }
+
+    // getfield and putfield for the switch interpreter; long and double
+    // fields move two slots.
+    void getField(Frame& frame, uint16_t index) {
+        auto& cp = frame.method->owner->constantPool;
+        Field& field = instanceField(cp, index);
+        auto& operands = frame.operands;
+        if (operands.empty()) return;
+        Object* obj = fieldReceiver(operands.top(), cp[index]);
+        if (quickFieldOp(field, false) == OP_GETFIELD_LONG) {
+            uint64_t v; memcpy(&v, obj->data() + field.offset, 8);
+            operands.pop();
+            operands.push(StackSlot(static_cast<jint>(static_cast<uint32_t>(v))));
+            operands.push(StackSlot(static_cast<jint>(v >> 32)));
+            return;
+        }
+        operands.top() = loadField(obj, field);
+    }
+
+    void putField(Frame& frame, uint16_t index) {
+        auto& cp = frame.method->owner->constantPool;
+        Field& field = instanceField(cp, index);
+        auto& operands = frame.operands;
+        if (quickFieldOp(field, true) == OP_PUTFIELD_LONG) {
+            if (operands.size() < 3) return;
+            uint64_t v = wideAt(operands.sp - 2);
+            Object* obj = fieldReceiver(operands.sp[-3], cp[index]);
+            memcpy(obj->data() + field.offset, &v, 8);
+            operands.sp -= 3;
+            return;
+        }
+        if (operands.size() < 2) return;
+        StackSlot value = operands.top(); operands.pop();
+        Object* obj = fieldReceiver(operands.top(), cp[index]); operands.pop();
+        storeField(obj, field, value);
+    }
+
+    void newObject(Frame& frame, uint16_t index) {
+        Class* cls = resolveClass(frame.method->owner->constantPool, index);
+        frame.operands.push(StackSlot(newInstance(cls)));
+    }
+
+    static string outOfBounds(jint index, jint length) {
+        return "Index " + to_string(index) + " out of bounds for length " + to_string(length);
+    }
+    [[noreturn]] static void indexOutOfBounds(jint index, jint length) {
+        throw VMError(VMErrorKind::ArrayIndexOutOfBoundsException, outOfBounds(index, length));
+    }
+
+    static Object* arrayRef(StackSlot slot) {
+        Object* array = nonNullRef(slot);
+        if (array->kind != Object::ARRAY && array->kind != Object::OBJECT_ARRAY)
+            throw VMError(VMErrorKind::VerifyError, "Expected an array");
+        return array;
+    }
+
+    // Element index of an array of kind with size-byte elements; the
+    // interpreters inline the same checks and come here to throw.
+    static char* arrayElement(StackSlot slot, jint index, Object::Kind kind, size_t size) {
+        Object* array = arrayRef(slot);
+        if (array->kind != kind || array->clazz->elementSize != size)
+            throw VMError(VMErrorKind::VerifyError, "Bad type in array access to " + array->clazz->name);
+        if (static_cast<uint32_t>(index) >= static_cast<uint32_t>(array->arrayLength()))
+            indexOutOfBounds(index, array->arrayLength());
+        return array->elements() + static_cast<size_t>(index) * size;
+    }
+
+    // What an array access the threaded interpreter's inline checks turned
+    // down throws in place: NullPointerException or
+    // ArrayIndexOutOfBoundsException. Anything else fails as in arrayElement.
+    Object* arrayFault(StackSlot slot, jint index, Object::Kind kind, size_t size) {
+        Object* array = slot.isRef() ? slot.asRef() : nullptr;
+        if (slot.isRef() && !array) return newThrowable(errorClass(VMErrorKind::NullPointerException));
+        if (!array || array->kind != kind || array->clazz->elementSize != size) arrayElement(slot, index, kind, size);
+        return newThrowable(errorClass(VMErrorKind::ArrayIndexOutOfBoundsException), outOfBounds(index, array->arrayLength()));
+    }
+
+    // xaload for the switch interpreter; type is the element descriptor
+    // ('I' also covers float, 'J' double, 'L' any reference).
+    static void arrayLoad(Frame& frame, char type) {
+        auto& operands = frame.operands;
+        if (operands.size() < 2) return;
+        jint index = operands.top().asInt(); operands.pop();
+        StackSlot& slot = operands.top();
+        switch (type) {
+            case 'L': { Object* v; memcpy(&v, arrayElement(slot, index, Object::OBJECT_ARRAY, sizeof(v)), sizeof(v)); slot = StackSlot(v); break; }
+            case 'B': { jbyte v; memcpy(&v, arrayElement(slot, index, Object::ARRAY, sizeof(v)), sizeof(v)); slot = StackSlot(static_cast<jint>(v)); break; }
+            case 'C': { jchar v; memcpy(&v, arrayElement(slot, index, Object::ARRAY, sizeof(v)), sizeof(v)); slot = StackSlot(static_cast<jint>(v)); break; }
+            case 'S': { jshort v; memcpy(&v, arrayElement(slot, index, Object::ARRAY, sizeof(v)), sizeof(v)); slot = StackSlot(static_cast<jint>(v)); break; }
+            case 'J': {
+                uint64_t v; memcpy(&v, arrayElement(slot, index, Object::ARRAY, sizeof(v)), sizeof(v));
+                operands.pop();
+                operands.push(StackSlot(static_cast<jint>(static_cast<uint32_t>(v))));
+                operands.push(StackSlot(static_cast<jint>(v >> 32)));
+                break;
+            }
+            default: { jint v; memcpy(&v, arrayElement(slot, index, Object::ARRAY, sizeof(v)), sizeof(v)); slot = StackSlot(v); break; }
+        }
+    }
+
+    static void arrayStore(Frame& frame, char type) {
+        auto& operands = frame.operands;
+        if (operands.size() < (type == 'J' ? 4u : 3u)) return;
+        uint64_t wide = 0;
+        if (type == 'J') { wide = wideAt(operands.sp - 2); operands.pop(); }
+        StackSlot value = operands.top(); operands.pop();
+        jint index = operands.top().asInt(); operands.pop();
+        StackSlot slot = operands.top(); operands.pop();
+        jint v = value.asInt();
+        switch (type) {
+            case 'L': {
+                Object* ref = value.isRef() ? value.asRef() : nullptr;
+                memcpy(arrayElement(slot, index, Object::OBJECT_ARRAY, sizeof(ref)), &ref, sizeof(ref));
+                break;
+            }
+            case 'B': {
+                char* p = arrayElement(slot, index, Object::ARRAY, 1);
+                *p = static_cast<char>(slot.asRef()->clazz->elementType == 'Z' ? v & 1 : v);
+                break;
+            }
+            case 'C': case 'S': { jchar w = static_cast<jchar>(v); memcpy(arrayElement(slot, index, Object::ARRAY, 2), &w, 2); break; }
+            case 'J': memcpy(arrayElement(slot, index, Object::ARRAY, 8), &wide, 8); break;
+            default: memcpy(arrayElement(slot, index, Object::ARRAY, 4), &v, 4); break;
+        }
+    }
+
+    void newPrimitiveArray(Frame& frame, uint8_t type) {
+        if (type < 4 || type > 11) throw runtime_error("Invalid newarray type");
+        if (frame.operands.empty()) return;
+        frame.operands.top() = StackSlot(newArray(primitiveArrays[type], frame.operands.top().asInt()));
+    }
+
+    void newObjectArray(Frame& frame, uint16_t index) {
+        Class* component = resolveClass(frame.method->owner->constantPool, index);
+        if (frame.operands.empty()) return;
+        frame.operands.top() = StackSlot(newArray(arrayOf(component), frame.operands.top().asInt()));
+    }
+
+    // Runs an application the way the launcher always has: a banner, then
+    // main(args).
+    void run(const string& path, const vector<string>& args) {
+        if (options.sampleRate) profilePath = path + ".collapsed";
+        console.write("Starting JVM...\n");
+        ClassPtr clazz = loadApplication(path);
+        runMain(clazz->name, args);
+        console.write("JVM has been executed");
+    }
+
+    void runMain(const string& className, const vector<string>& args) {
+        auto it = loadedClasses.find(className);
+        if (it == loadedClasses.end()) {
+            throw runtime_error("Class not loaded: " + className);
+        }
+
+        auto clazz = it->second;
+        string mainKey = "main([Ljava/lang/String;)V";
+
+        auto mit = clazz->methodMap.find(mainKey);
+        if (mit == clazz->methodMap.end()) {
+            throw runtime_error("Main method not found in class " + className);
+        }
+
+        auto& method = clazz->methods[mit->second];
+        JavaThread& self = *currentThread;
+        self.object = newInstance(threadClass);
+        setThreadStatus(self.object, JavaThread::STARTED);
+        self.stack.base[0] = StackSlot(nullptr); // String[] args
+        pushFrame(&method, self.stack.base, 1);
+        // The frame keeps the array reachable while its strings are allocated.
+        Object* argArray = newArray(arrayOf(stringClass), static_cast<jint>(args.size()));
+        self.callStack.back().locals[0] = StackSlot(argArray);
+        for (size_t i = 0; i < args.size(); ++i) {
+            Object* arg = createString(args[i]);
+            memcpy(argArray->elements() + i * sizeof(Object*), &arg, sizeof(arg));
+        }
+
+        if (options.sampleRate) startSampler();
+        exception_ptr failure;
+        try {
+            execute();
+        } catch (const exception&) {
+            failure = current_exception();
+            unwindFrames();
+        }
+        // The VM lives until every thread it started has finished; an error
+        // in main is reported after that.
+        {
+            Safepoint::Region blocked(safepoint);
+            unique_lock<mutex> hold(threadsLock);
+            setThreadStatus(self.object, JavaThread::TERMINATED);
+            threadsChanged.notify_all();
+            threadsChanged.wait(hold, [this] { return threads.size() == 1; });
+            hold.unlock();
+            stopSampler();
+        }
+        for (auto& t : osThreads) t.join();
+        osThreads.clear();
+        if (failure) rethrow_exception(failure);
+    }
+
+    // Safepoint poll of a thread running guest code. Its frames are synced
+    // (each ip just past the call or backward branch it is at), so while it
+    // is parked here the sampler may record its stack.
+    void parkAtPoll() {
+        JavaThread& self = *currentThread;
+        self.polled = true;
+        safepoint.park();
+        self.polled = false;
+    }
+
+    // -Xprof:sample: sampleRate times a second, stops the world and records
+    // the stack of each thread parked at a poll, that is, running guest
+    // code rather than blocked or collecting garbage. Polls are at calls and
+    // backward branches (every instruction in the switch interpreter), so
+    // that is where samples land; compiled loops leave to the interpreter
+    // at their next iteration. Costs nothing when off.
+    void startSampler() {
+        sampler = std::thread([this] {
+            auto period = chrono::nanoseconds(1000000000 / options.sampleRate);
+            auto next = chrono::steady_clock::now();
+            unique_lock<mutex> hold(samplerLock);
+            for (;;) {
+                next = max(next + period, chrono::steady_clock::now());
+                if (samplerWake.wait_until(hold, next, [this] { return samplerDone; })) return;
+                safepoint.stopTheWorld(0);
+                for (JavaThread* t : threads) {
+                    if (!t->polled || t->callStack.empty()) continue;
+                    vector<StackProfile::Site> stack;
+                    for (auto& frame : t->callStack) stack.push_back({ frame.method, stoppedAt(frame) });
+                    stackProfile.record(stack);
+                }
+                safepoint.resume();
+            }
+        });
+    }
+
+    // Called in a safe region, so a sample being taken can finish.
+    void stopSampler() {
+        if (!sampler.joinable()) return;
+        {
+            lock_guard<mutex> hold(samplerLock);
+            samplerDone = true;
+        }
+        samplerWake.notify_all();
+        sampler.join();
+    }
+
+    // Bytecode offset of the instruction a frame parked at a poll is at.
+    uint32_t stoppedAt(const Frame& frame) const {
+        const Method& m = *frame.method;
+        if (options.switchInterpreter) return frame.pc > 0 ? m.insns[insnAtPc(m, frame.pc - 1)].pc : 0;
+        return frame.ip ? m.insns[frame.ip - m.insns.data() - 1].pc : 0;
+    }
+
+    // Runs the top frame, and everything it calls, until it returns.
+    void execute() {
+        if (!options.switchInterpreter) {
+            executeThreaded();
+            return;
+        }
+        auto& callStack = currentThread->callStack;
+        const size_t stopDepth = callStack.size() - 1;
+        size_t depth = 0;   // frames, and pc of the running instruction
+        int at = 0;
+        while (callStack.size() > stopDepth) {
+            try {
+                while (callStack.size() > stopDepth) {
+                    if (safepoint.requested) parkAtPoll();
+                    auto& frame = callStack.back();
+                    auto& code = frame.method->code;
+
+                    if (frame.pc >= (int)code.size()) {
+                        popFrame(nullptr);
+                        continue;
+                    }
+
+                    depth = callStack.size();
+                    at = frame.pc;
+                    uint8_t opcode = code[frame.pc++];
+                    executeOpcode(frame, code, opcode);
+                }
+            } catch (const runtime_error& e) {
+                // As in runThreaded(): guest exceptions go on from the instruction.
+                if (callStack.size() < depth) throw;
+                while (callStack.size() > depth) dropFrame();
+                Object* exception = guestException(e);
+                if (!exception) throw;
+                callStack.back().pc = at + 1;
+                throwException(exception, stopDepth);
+            }
+        }
+    }
+
+    // Threaded interpreter over Method::insns. With computed goto every
+    // handler ends in its own indirect jump to the next handler; otherwise
+    // the same handlers sit in one switch.
+    void executeThreaded() {
+        if (!currentThread->callStack.empty()) runThreaded();
+    }
+
+    // Runs m for a native calling back into guest code, or at the bottom of
+    // a new thread, with its argSlots arguments on top of st: natives in
+    // place, bytecode in a new frame run until it returns.
+    void callMethod(Method* m, OperandStack& st, uint16_t argSlots) {
+        if (m->native) {
+            m->native(*this, st);
+            return;
+        }
+        if (!m->codeLength)
+            throw VMError(VMErrorKind::AbstractMethodError, m->owner->name + "." + m->name + m->descriptor);
+        pushFrame(m, st.sp - argSlots, argSlots);
+        execute();
+    }
+
+    // Drops the frames an uncaught exception left behind, releasing the
+    // monitors of synchronized methods among them.
+    void unwindFrames() {
+        auto& callStack = currentThread->callStack;
+        while (!callStack.empty()) dropFrame();
+        currentThread->exception = nullptr;
+    }
+
+    // Leaves the top frame without returning, releasing the monitor of a
+    // synchronized method.
+    void dropFrame() {
+        auto& callStack = currentThread->callStack;
+        Object* monitor = callStack.back().monitor;
+        callStack.pop_back();
+        if (monitor) {
+            try { monitorExit(monitor); } catch (const exception&) {}
+        }
+    }
+
+    static bool isSubclassOf(const Class* cls, const Class* of) {
+        for (; cls; cls = cls->superClass.get())
+            if (cls == of) return true;
+        return false;
+    }
+
+    // An exception the VM raises, with message as its detail message unless
+    // empty. It is the pending exception from the start, so the collector
+    // keeps it while the message is allocated.
+    Object* newThrowable(Class* cls, const string& message = string()) {
+        Object* throwable = newInstance(cls);
+        currentThread->exception = throwable;
+        if (!message.empty()) throwable->refs()[throwableMessageSlot] = createString(message);
+        return throwable;
+    }
+
+    // The handler in m for an exception of class cls thrown by insns[at]:
+    // the index it starts at, or -1. Catch types are resolved on first use;
+    // one that cannot be loaded catches nothing.
+    int findHandler(Method& m, uint32_t at, Class* cls) {
+        for (auto& h : m.handlers) {
+            if (at < h.start || at >= h.end) continue;
+            if (!h.catchType) return static_cast<int>(h.target);
+            Class* type = nullptr;
+            try {
+                type = resolveClass(m.owner->constantPool, h.catchType);
+            } catch (const runtime_error&) {
+                continue;
+            }
+            if (isSubclassOf(cls, type)) return static_cast<int>(h.target);
+        }
+        return -1;
+    }
+
+    // Throws exception from the top frame, whose ip (pc in the switch
+    // interpreter) is just past the throwing instruction, as callers' are
+    // past their calls. The first frame with a handler for it continues
+    // there with only the exception on its operand stack; the frames above
+    // are dropped. Nothing above stopDepth catching it, it goes on to the
+    // caller of this interpreter activation as a GuestException.
+    void throwException(Object* exception, size_t stopDepth) {
+        JavaThread& self = *currentThread;
+        auto& callStack = self.callStack;
+        self.exception = exception;
+        for (;;) {
+            Frame& frame = callStack.back();
+            Method& m = *frame.method;
+            uint32_t at = options.switchInterpreter ? insnAtPc(m, frame.pc - 1)
+                                                    : static_cast<uint32_t>(frame.ip - m.insns.data() - 1);
+            int target = findHandler(m, at, exception->clazz);
+            if (target >= 0) {
+                frame.ip = m.insns.data() + target;
+                frame.pc = static_cast<int>(m.insns[target].pc);
+                frame.operands.sp = frame.operands.base;
+                frame.operands.push(StackSlot(exception));
+                self.exception = nullptr;
+                return;
+            }
+            dropFrame();
+            if (callStack.size() == stopDepth) throw GuestException(throwableString(exception));
+        }
+    }
+
+    // Index of the instruction that covers bytecode offset pc.
+    static uint32_t insnAtPc(const Method& m, int pc) {
+        auto next = upper_bound(m.insns.begin(), m.insns.end(), static_cast<uint32_t>(pc),
+                                [](uint32_t p, const Insn& in) { return p < in.pc; });
+        return static_cast<uint32_t>(next - m.insns.begin()) - 1;
+    }
+
+    Class* errorClass(VMErrorKind kind) const { return vmErrorClasses[size_t(kind)]; }
+
+    // The guest exception behind an error raised below the interpreter
+    // loop: the pending one of a GuestException, or a new one for a
+    // VMError. nullptr for internal errors, and for BudgetExceeded, which
+    // guest code must never catch.
+    Object* guestException(const runtime_error& error) {
+        if (dynamic_cast<const GuestException*>(&error)) return currentThread->exception;
+        if (auto vmError = dynamic_cast<const VMError*>(&error)) return newThrowable(errorClass(vmError->kind), vmError->message);
+        return nullptr;
+    }
+
+    jint threadStatus(Object* thread) const {
+        jint status;
+        memcpy(&status, thread->data() + threadStatusOffset, sizeof(status));
+        return status;
+    }
+    void setThreadStatus(Object* thread, jint status) {
+        memcpy(thread->data() + threadStatusOffset, &status, sizeof(status));
+    }
+
+    // Thread.start(): a new OS thread with its own VM stack runs the
+    // Thread's run(). Until then the JavaThread keeps the Thread reachable.
+    void startThread(Object* thread) {
+        lock_guard<mutex> hold(threadsLock);
+        if (threadStatus(thread) != JavaThread::NEW) throw VMError(VMErrorKind::IllegalThreadStateException);
+        auto t = make_unique<JavaThread>(options.stackSize, ++lastThreadId, "Thread-" + to_string(threadNumber++));
+        t->object = thread;
+        threads.push_back(t.get());
+        try {
+            osThreads.emplace_back([this, t = t.get()] { runThread(t); });
+        } catch (const system_error&) {
+            threads.pop_back();
+            throw VMError(VMErrorKind::OutOfMemoryError, "unable to create native thread");
+        }
+        t.release();
+        setThreadStatus(thread, JavaThread::STARTED);
+    }
+
+    // Body of a started thread. An uncaught exception ends only this thread.
+    void runThread(JavaThread* t) {
+        unique_ptr<JavaThread> owned(t);
+        currentThread = t;
+        safepoint.leaveSafe();
+        try {
+            OperandStack st;
+            st.base = t->stack.base;
+            st.limit = st.base + 2;
+            st.sp = st.base;
+            st.push(StackSlot(t->object));
+            callMethod(dispatch(t->object->clazz, threadRun), st, 1);
+        } catch (const exception& e) {
+            unwindFrames();
+            cerr << "Exception in thread \"" << t->name << "\" " << e.what() << endl;
+        }
+        {
+            auto hold = safepoint.acquire(heap.lock);
+            heap.retire(t->tlab);
+        }
+        lock_guard<mutex> hold(threadsLock);
+        if (options.profileInsns) insnProfile.merge(t->insnProfile);
+        setThreadStatus(t->object, JavaThread::TERMINATED);
+        threads.erase(find(threads.begin(), threads.end(), t));
+        threadsChanged.notify_all();
+        safepoint.enterSafe();
+    }
+
+    // Thread.join(): waits until thread has finished, if it was started.
+    void joinThread(Object* thread) {
+        Safepoint::Region blocked(safepoint);
+        unique_lock<mutex> hold(threadsLock);
+        threadsChanged.wait(hold, [&] { return threadStatus(thread) != JavaThread::STARTED; });
+    }
 
-            if (f_name > 0 && f_name < cp_count && cp_table[f_name].tag == 1)
-                f.name = cp_table[f_name].utf8_value;
-            if (f_desc > 0 && f_desc < cp_count && cp_table[f_desc].tag == 1)
-                f.descriptor = cp_table[f_desc].utf8_value;
+    // The Class object of cls, made on first use: what ldc of a class
+    // constant pushes and static synchronized methods of cls lock.
+    Object* classMonitor(Class& cls) {
+        auto hold = safepoint.acquire(classLock);
+        if (!cls.monitorObject) cls.monitorObject = newInstance(classClass);
+        return cls.monitorObject;
+    }
 
-            uint16_t attr_count = mem.read_u2();
-            for (int j = 0; j < attr_count; ++j) {
-                uint16_t attr_name = mem.read_u2();
-                uint32_t attr_len = mem.read_u4();
-                mem.seek(mem.tell() + attr_len);
+    [[noreturn]] static void illegalMonitorState() {
+        throw VMError(VMErrorKind::IllegalMonitorStateException, "current thread is not owner");
+    }
+    static Monitor* inflated(uintptr_t word) { return reinterpret_cast<Monitor*>(word & ~Object::INFLATED); }
+    static uintptr_t thinOwner(uintptr_t word) { return word & ~Object::RECURSION_MASK; }
+
+    // monitorenter. An unlocked object takes one CAS that stores the
+    // thread's lock id in its header; see monitorEnterSlow() for the rest.
+    void monitorEnter(Object* obj) {
+        uintptr_t word = 0;
+        if (!obj->lock.compare_exchange_strong(word, currentThread->lockId, memory_order_acquire))
+            monitorEnterSlow(obj, word);
+    }
+
+    // Reentry bumps a thin lock's count in place. Contention, a full count
+    // or wait() inflate the lock to a Monitor; a contender spins a little
+    // first, since most critical sections are short.
+    //
+    // Every load of a lock word that may be INFLATED, CAS failures
+    // included, is an acquire: it pairs with inflate()'s release of the
+    // Monitor it points to.
+    void monitorEnterSlow(Object* obj, uintptr_t word) {
+        const uintptr_t self = currentThread->lockId;
+        for (int spins = 0;;) {
+            if (word == 0) {
+                if (obj->lock.compare_exchange_weak(word, self, memory_order_acquire)) return;
+            } else if (word & Object::INFLATED) {
+                enterMonitor(inflated(word));
+                return;
+            } else if (thinOwner(word) == self && (word & Object::RECURSION_MASK) != Object::RECURSION_MASK) {
+                if (obj->lock.compare_exchange_weak(word, word + Object::RECURSION_ONE, memory_order_acquire)) return;
+            } else if (thinOwner(word) != self && ++spins < 16) {
+                this_thread::yield();
+                word = obj->lock.load(memory_order_acquire);
+            } else if (Monitor* m = inflate(obj, word)) {
+                enterMonitor(m);
+                return;
+            } else {
+                word = obj->lock.load(memory_order_acquire);
             }
+        }
+    }
 
-            clazz->fields.push_back(f);
-            clazz->fieldMap[f.name] = clazz->fields.size() - 1;
+    // Moves obj's thin lock, currently word, into a new Monitor with the
+    // same owner and count; null if the word changed meanwhile.
+    Monitor* inflate(Object* obj, uintptr_t word) {
+        auto m = make_unique<Monitor>(obj);
+        m->owner = thinOwner(word);
+        m->recursions = (word & Object::RECURSION_MASK) / Object::RECURSION_ONE;
+        if (!obj->lock.compare_exchange_strong(word, reinterpret_cast<uintptr_t>(m.get()) | Object::INFLATED,
+                                               memory_order_acq_rel))
+            return nullptr;
+        lock_guard<mutex> hold(monitorsLock);
+        monitors.push_back(move(m));
+        return monitors.back().get();
+    }
+
+    void enterMonitor(Monitor* m) {
+        const uintptr_t self = currentThread->lockId;
+        {
+            lock_guard<mutex> hold(m->lock);
+            if (m->owner == self) { ++m->recursions; return; }
+            if (m->owner == 0) { m->owner = self; return; }
         }
+        Safepoint::Region blocked(safepoint);
+        unique_lock<mutex> hold(m->lock);
+        m->released.wait(hold, [m] { return m->owner == 0; });
+        m->owner = self;
+    }
 
-        // Methods
-        uint16_t methods_count = mem.read_u2();
-        for (int i = 0; i < methods_count; ++i) {
-            Method m(clazz);
-            uint16_t m_access = mem.read_u2();
-            uint16_t m_name = mem.read_u2();
-            uint16_t m_desc = mem.read_u2();
-            m.isStatic = (m_access & 0x0008) != 0;
+    void monitorExit(Object* obj) {
+        const uintptr_t self = currentThread->lockId;
+        uintptr_t word = obj->lock.load(memory_order_acquire);
+        while (!(word & Object::INFLATED)) {
+            if (thinOwner(word) != self) illegalMonitorState();
+            uintptr_t next = word & Object::RECURSION_MASK ? word - Object::RECURSION_ONE : 0;
+            if (obj->lock.compare_exchange_weak(word, next, memory_order_release, memory_order_acquire)) return;
+        }
+        Monitor* m = inflated(word);
+        lock_guard<mutex> hold(m->lock);
+        if (m->owner != self) illegalMonitorState();
+        if (m->recursions) {
+            --m->recursions;
+            return;
+        }
+        m->owner = 0;
+        m->released.notify_one();
+    }
 
-            if (m_name > 0 && m_name < cp_count && cp_table[m_name].tag == 1)
-                m.name = cp_table[m_name].utf8_value;
-            if (m_desc > 0 && m_desc < cp_count && cp_table[m_desc].tag == 1)
-                m.descriptor = cp_table[m_desc].utf8_value;
+    // obj's Monitor, inflating the thin lock if the current thread holds
+    // it; throws if some other thread does.
+    Monitor* ownedMonitor(Object* obj) {
+        uintptr_t word = obj->lock.load(memory_order_acquire);
+        for (;;) {
+            if (word & Object::INFLATED) return inflated(word);
+            if (thinOwner(word) != currentThread->lockId) illegalMonitorState();
+            if (Monitor* m = inflate(obj, word)) return m;
+            word = obj->lock.load(memory_order_acquire);
+        }
+    }
 
-            uint16_t attr_count = mem.read_u2();
-            for (int j = 0; j < attr_count; ++j) {
-                uint16_t attr_name = mem.read_u2();
-                uint32_t attr_len = mem.read_u4();
-                string attrName;
-                if (attr_name > 0 && attr_name < cp_count && cp_table[attr_name].tag == 1)
-                    attrName = cp_table[attr_name].utf8_value;
+    // Object.wait(): gives obj's monitor up entirely until notified, then
+    // takes it back with the same count.
+    void monitorWait(Object* obj) {
+        const uintptr_t self = currentThread->lockId;
+        Monitor* m = ownedMonitor(obj);
+        Safepoint::Region blocked(safepoint);
+        unique_lock<mutex> hold(m->lock);
+        if (m->owner != self) illegalMonitorState();
+        uintptr_t recursions = m->recursions;
+        m->owner = 0;
+        m->recursions = 0;
+        m->released.notify_one();
+        m->notified.wait(hold);
+        m->released.wait(hold, [m] { return m->owner == 0; });
+        m->owner = self;
+        m->recursions = recursions;
+    }
 
-                if (attrName == "Code") {
-                    m.max_stack = mem.read_u2();
-                    m.max_locals = mem.read_u2();
-                    uint32_t code_length = mem.read_u4();
-                    m.code.resize(code_length);
-                    mem.read_bytes(reinterpret_cast<char*>(m.code.data()), code_length);
+    // Object.notify() and notifyAll(). Nobody can be waiting on a thin lock.
+    void monitorNotify(Object* obj, bool all) {
+        uintptr_t word = obj->lock.load(memory_order_acquire);
+        if (!(word & Object::INFLATED)) {
+            if (thinOwner(word) != currentThread->lockId) illegalMonitorState();
+            return;
+        }
+        Monitor* m = inflated(word);
+        lock_guard<mutex> hold(m->lock);
+        if (m->owner != currentThread->lockId) illegalMonitorState();
+        if (all) m->notified.notify_all();
+        else m->notified.notify_one();
+    }
 
-                    uint16_t ex_table_len = mem.read_u2();
-                    mem.seek(mem.tell() + ex_table_len * 8);
+// Handlers come in two sets. TARGET handlers serve every method; CHECKED
+// ones test the stack depth and slot types they work on, and have FAST
+// twins without those tests for verified methods (see verifyMethod).
+#if JVM_COMPUTED_GOTO
+#define TARGET(op) L_##op:
+#define CHECKED(op) L_##op:
+#define FAST(op) L_FAST_##op:
+#define DISPATCH() goto *ip->handler.load(memory_order_acquire)
+#else
+#define TARGET(op) case OP_##op: case FAST_SET | OP_##op:
+#define CHECKED(op) case OP_##op:
+#define FAST(op) case FAST_SET | OP_##op:
+#define DISPATCH() continue
+#endif
+
+    // Runs the top frame, and everything it calls, until it returns. Calls
+    // and returns switch frames inside the loop.
+    void runThreaded() {
+        JavaThread& self = *currentThread;
+        auto& callStack = self.callStack;
+        const size_t stopDepth = callStack.size() - 1;
+
+#if JVM_COMPUTED_GOTO
+        static const void* labels[256];
+        static const void* fastLabels[256];
+        // Filled in by the first call; batch jobs can make it on several
+        // threads at once.
+        static atomic<bool> labelsReady{ false };
+        static mutex labelsLock;
+        if (!labelsReady.load(memory_order_acquire)) {
+            lock_guard<mutex> hold(labelsLock);
+            if (!labelsReady.load(memory_order_relaxed)) {
+                for (auto& l : labels) l = &&L_UNIMPLEMENTED;
+                labels[OP_NOP] = &&L_NOP;
+                labels[OP_ACONST_NULL] = &&L_ACONST_NULL;
+                labels[OP_ICONST] = &&L_ICONST;
+                labels[OP_LCONST] = &&L_LCONST;
+                labels[OP_LDC_STRING] = &&L_LDC_STRING;
+                labels[OP_LDC_CLASS] = &&L_LDC_CLASS;
+                labels[OP_LDC] = &&L_LDC;
+                labels[OP_LOAD] = &&L_LOAD;
+                labels[OP_STORE] = &&L_STORE;
+                labels[OP_LOAD2] = &&L_LOAD2;
+                labels[OP_STORE2] = &&L_STORE2;
+                labels[OP_POP] = &&L_POP;
+                labels[OP_POP2] = &&L_POP2;
+                labels[OP_DUP] = &&L_DUP;
+                labels[OP_DUP2] = &&L_DUP2;
+                labels[OP_IADD] = &&L_IADD;
+                labels[OP_ISUB] = &&L_ISUB;
+                labels[OP_IMUL] = &&L_IMUL;
+                labels[OP_IDIV] = &&L_IDIV;
+                labels[OP_LADD] = &&L_LADD;
+                labels[OP_LSUB] = &&L_LSUB;
+                labels[OP_LMUL] = &&L_LMUL;
+                labels[OP_LDIV] = &&L_LDIV;
+                labels[OP_LREM] = &&L_LREM;
+                labels[OP_LAND] = &&L_LAND;
+                labels[OP_LOR] = &&L_LOR;
+                labels[OP_LXOR] = &&L_LXOR;
+                labels[OP_LNEG] = &&L_LNEG;
+                labels[OP_LSHL] = &&L_LSHL;
+                labels[OP_LSHR] = &&L_LSHR;
+                labels[OP_LUSHR] = &&L_LUSHR;
+                labels[OP_LCMP] = &&L_LCMP;
+                labels[OP_FADD] = &&L_FADD;
+                labels[OP_FSUB] = &&L_FSUB;
+                labels[OP_FMUL] = &&L_FMUL;
+                labels[OP_FDIV] = &&L_FDIV;
+                labels[OP_FREM] = &&L_FREM;
+                labels[OP_FNEG] = &&L_FNEG;
+                labels[OP_FCMPL] = &&L_FCMPL;
+                labels[OP_FCMPG] = &&L_FCMPG;
+                labels[OP_DADD] = &&L_DADD;
+                labels[OP_DSUB] = &&L_DSUB;
+                labels[OP_DMUL] = &&L_DMUL;
+                labels[OP_DDIV] = &&L_DDIV;
+                labels[OP_DREM] = &&L_DREM;
+                labels[OP_DNEG] = &&L_DNEG;
+                labels[OP_DCMPL] = &&L_DCMPL;
+                labels[OP_DCMPG] = &&L_DCMPG;
+                labels[OP_I2L] = &&L_I2L;
+                labels[OP_I2F] = &&L_I2F;
+                labels[OP_I2D] = &&L_I2D;
+                labels[OP_L2I] = &&L_L2I;
+                labels[OP_L2F] = &&L_L2F;
+                labels[OP_L2D] = &&L_L2D;
+                labels[OP_F2I] = &&L_F2I;
+                labels[OP_F2L] = &&L_F2L;
+                labels[OP_F2D] = &&L_F2D;
+                labels[OP_D2I] = &&L_D2I;
+                labels[OP_D2L] = &&L_D2L;
+                labels[OP_D2F] = &&L_D2F;
+                labels[OP_IINC] = &&L_IINC;
+                labels[OP_IFEQ] = &&L_IFEQ;
+                labels[OP_IFNE] = &&L_IFNE;
+                labels[OP_IFLT] = &&L_IFLT;
+                labels[OP_IFGE] = &&L_IFGE;
+                labels[OP_IFGT] = &&L_IFGT;
+                labels[OP_IFLE] = &&L_IFLE;
+                labels[OP_IF_ICMPEQ] = &&L_IF_ICMPEQ;
+                labels[OP_IF_ICMPNE] = &&L_IF_ICMPNE;
+                labels[OP_IF_ICMPLT] = &&L_IF_ICMPLT;
+                labels[OP_IF_ICMPGE] = &&L_IF_ICMPGE;
+                labels[OP_IF_ICMPGT] = &&L_IF_ICMPGT;
+                labels[OP_IF_ICMPLE] = &&L_IF_ICMPLE;
+                labels[OP_IF_ACMPEQ] = &&L_IF_ACMPEQ;
+                labels[OP_IF_ACMPNE] = &&L_IF_ACMPNE;
+                labels[OP_GOTO] = &&L_GOTO;
+                labels[OP_GETSTATIC] = &&L_GETSTATIC;
+                labels[OP_GETFIELD] = &&L_GETFIELD;
+                labels[OP_PUTFIELD] = &&L_PUTFIELD;
+                labels[OP_GETFIELD_REF] = &&L_GETFIELD_REF;
+                labels[OP_GETFIELD_INT] = &&L_GETFIELD_INT;
+                labels[OP_GETFIELD_BYTE] = &&L_GETFIELD_BYTE;
+                labels[OP_GETFIELD_CHAR] = &&L_GETFIELD_CHAR;
+                labels[OP_GETFIELD_SHORT] = &&L_GETFIELD_SHORT;
+                labels[OP_PUTFIELD_REF] = &&L_PUTFIELD_REF;
+                labels[OP_PUTFIELD_INT] = &&L_PUTFIELD_INT;
+                labels[OP_PUTFIELD_BYTE] = &&L_PUTFIELD_BYTE;
+                labels[OP_PUTFIELD_SHORT] = &&L_PUTFIELD_SHORT;
+                labels[OP_GETFIELD_LONG] = &&L_GETFIELD_LONG;
+                labels[OP_PUTFIELD_LONG] = &&L_PUTFIELD_LONG;
+                labels[OP_NEW] = &&L_NEW;
+                labels[OP_NEWARRAY] = &&L_NEWARRAY;
+                labels[OP_ANEWARRAY] = &&L_ANEWARRAY;
+                labels[OP_ARRAYLENGTH] = &&L_ARRAYLENGTH;
+                labels[OP_ATHROW] = &&L_ATHROW;
+                labels[OP_MONITORENTER] = &&L_MONITORENTER;
+                labels[OP_MONITOREXIT] = &&L_MONITOREXIT;
+                labels[OP_IALOAD] = &&L_IALOAD;
+                labels[OP_LALOAD] = &&L_LALOAD;
+                labels[OP_FALOAD] = &&L_FALOAD;
+                labels[OP_AALOAD] = &&L_AALOAD;
+                labels[OP_BALOAD] = &&L_BALOAD;
+                labels[OP_CALOAD] = &&L_CALOAD;
+                labels[OP_SALOAD] = &&L_SALOAD;
+                labels[OP_IASTORE] = &&L_IASTORE;
+                labels[OP_LASTORE] = &&L_LASTORE;
+                labels[OP_FASTORE] = &&L_FASTORE;
+                labels[OP_AASTORE] = &&L_AASTORE;
+                labels[OP_BASTORE] = &&L_BASTORE;
+                labels[OP_CASTORE] = &&L_CASTORE;
+                labels[OP_SASTORE] = &&L_SASTORE;
+                labels[OP_INVOKESTATIC] = &&L_INVOKESTATIC;
+                labels[OP_INVOKEVIRTUAL] = &&L_INVOKEVIRTUAL;
+                labels[OP_INVOKESPECIAL] = &&L_INVOKESPECIAL;
+                labels[OP_INVOKEINTERFACE] = &&L_INVOKEINTERFACE;
+                labels[OP_IRETURN] = &&L_IRETURN;
+                labels[OP_LRETURN] = &&L_LRETURN;
+                labels[OP_ARETURN] = &&L_ARETURN;
+                labels[OP_RETURN] = &&L_RETURN;
+                labels[OP_END] = &&L_END;
+                labels[OP_LOAD_LOAD] = &&L_LOAD_LOAD;
+                labels[OP_LOAD_LOAD_IADD_STORE] = &&L_LOAD_LOAD_IADD_STORE;
+                labels[OP_LOAD_LOAD_IF_ICMP] = &&L_LOAD_LOAD_IF_ICMP;
+                labels[OP_IINC_GOTO] = &&L_IINC_GOTO;
+                labels[OP_GETSTATIC_LDC_STRING] = &&L_GETSTATIC_LDC_STRING;
+                labels[OP_LOAD_GETFIELD_REF] = &&L_LOAD_GETFIELD_REF;
+                labels[OP_LOAD_GETFIELD_INT] = &&L_LOAD_GETFIELD_INT;
+                labels[OP_LOAD_ICONST] = &&L_LOAD_ICONST;
+                labels[OP_LOAD_ICONST_IF_ICMP] = &&L_LOAD_ICONST_IF_ICMP;
+                copy(begin(labels), end(labels), fastLabels);
+                fastLabels[OP_ACONST_NULL] = &&L_FAST_ACONST_NULL;
+                fastLabels[OP_ICONST] = &&L_FAST_ICONST;
+                fastLabels[OP_LCONST] = &&L_FAST_LCONST;
+                fastLabels[OP_LOAD] = &&L_FAST_LOAD;
+                fastLabels[OP_STORE] = &&L_FAST_STORE;
+                fastLabels[OP_LOAD2] = &&L_FAST_LOAD2;
+                fastLabels[OP_STORE2] = &&L_FAST_STORE2;
+                fastLabels[OP_POP] = &&L_FAST_POP;
+                fastLabels[OP_POP2] = &&L_FAST_POP2;
+                fastLabels[OP_DUP] = &&L_FAST_DUP;
+                fastLabels[OP_DUP2] = &&L_FAST_DUP2;
+                fastLabels[OP_IADD] = &&L_FAST_IADD;
+                fastLabels[OP_ISUB] = &&L_FAST_ISUB;
+                fastLabels[OP_IMUL] = &&L_FAST_IMUL;
+                fastLabels[OP_IDIV] = &&L_FAST_IDIV;
+                fastLabels[OP_LADD] = &&L_FAST_LADD;
+                fastLabels[OP_LSUB] = &&L_FAST_LSUB;
+                fastLabels[OP_LMUL] = &&L_FAST_LMUL;
+                fastLabels[OP_LDIV] = &&L_FAST_LDIV;
+                fastLabels[OP_LREM] = &&L_FAST_LREM;
+                fastLabels[OP_LAND] = &&L_FAST_LAND;
+                fastLabels[OP_LOR] = &&L_FAST_LOR;
+                fastLabels[OP_LXOR] = &&L_FAST_LXOR;
+                fastLabels[OP_LNEG] = &&L_FAST_LNEG;
+                fastLabels[OP_LSHL] = &&L_FAST_LSHL;
+                fastLabels[OP_LSHR] = &&L_FAST_LSHR;
+                fastLabels[OP_LUSHR] = &&L_FAST_LUSHR;
+                fastLabels[OP_LCMP] = &&L_FAST_LCMP;
+                fastLabels[OP_FADD] = &&L_FAST_FADD;
+                fastLabels[OP_FSUB] = &&L_FAST_FSUB;
+                fastLabels[OP_FMUL] = &&L_FAST_FMUL;
+                fastLabels[OP_FDIV] = &&L_FAST_FDIV;
+                fastLabels[OP_FREM] = &&L_FAST_FREM;
+                fastLabels[OP_FNEG] = &&L_FAST_FNEG;
+                fastLabels[OP_FCMPL] = &&L_FAST_FCMPL;
+                fastLabels[OP_FCMPG] = &&L_FAST_FCMPG;
+                fastLabels[OP_DADD] = &&L_FAST_DADD;
+                fastLabels[OP_DSUB] = &&L_FAST_DSUB;
+                fastLabels[OP_DMUL] = &&L_FAST_DMUL;
+                fastLabels[OP_DDIV] = &&L_FAST_DDIV;
+                fastLabels[OP_DREM] = &&L_FAST_DREM;
+                fastLabels[OP_DNEG] = &&L_FAST_DNEG;
+                fastLabels[OP_DCMPL] = &&L_FAST_DCMPL;
+                fastLabels[OP_DCMPG] = &&L_FAST_DCMPG;
+                fastLabels[OP_I2L] = &&L_FAST_I2L;
+                fastLabels[OP_I2F] = &&L_FAST_I2F;
+                fastLabels[OP_I2D] = &&L_FAST_I2D;
+                fastLabels[OP_L2I] = &&L_FAST_L2I;
+                fastLabels[OP_L2F] = &&L_FAST_L2F;
+                fastLabels[OP_L2D] = &&L_FAST_L2D;
+                fastLabels[OP_F2I] = &&L_FAST_F2I;
+                fastLabels[OP_F2L] = &&L_FAST_F2L;
+                fastLabels[OP_F2D] = &&L_FAST_F2D;
+                fastLabels[OP_D2I] = &&L_FAST_D2I;
+                fastLabels[OP_D2L] = &&L_FAST_D2L;
+                fastLabels[OP_D2F] = &&L_FAST_D2F;
+                fastLabels[OP_IINC] = &&L_FAST_IINC;
+                fastLabels[OP_IFEQ] = &&L_FAST_IFEQ;
+                fastLabels[OP_IFNE] = &&L_FAST_IFNE;
+                fastLabels[OP_IFLT] = &&L_FAST_IFLT;
+                fastLabels[OP_IFGE] = &&L_FAST_IFGE;
+                fastLabels[OP_IFGT] = &&L_FAST_IFGT;
+                fastLabels[OP_IFLE] = &&L_FAST_IFLE;
+                fastLabels[OP_IF_ICMPEQ] = &&L_FAST_IF_ICMPEQ;
+                fastLabels[OP_IF_ICMPNE] = &&L_FAST_IF_ICMPNE;
+                fastLabels[OP_IF_ICMPLT] = &&L_FAST_IF_ICMPLT;
+                fastLabels[OP_IF_ICMPGE] = &&L_FAST_IF_ICMPGE;
+                fastLabels[OP_IF_ICMPGT] = &&L_FAST_IF_ICMPGT;
+                fastLabels[OP_IF_ICMPLE] = &&L_FAST_IF_ICMPLE;
+                fastLabels[OP_IF_ACMPEQ] = &&L_FAST_IF_ACMPEQ;
+                fastLabels[OP_IF_ACMPNE] = &&L_FAST_IF_ACMPNE;
+                fastLabels[OP_GETFIELD_REF] = &&L_FAST_GETFIELD_REF;
+                fastLabels[OP_GETFIELD_INT] = &&L_FAST_GETFIELD_INT;
+                fastLabels[OP_GETFIELD_BYTE] = &&L_FAST_GETFIELD_BYTE;
+                fastLabels[OP_GETFIELD_CHAR] = &&L_FAST_GETFIELD_CHAR;
+                fastLabels[OP_GETFIELD_SHORT] = &&L_FAST_GETFIELD_SHORT;
+                fastLabels[OP_PUTFIELD_REF] = &&L_FAST_PUTFIELD_REF;
+                fastLabels[OP_PUTFIELD_INT] = &&L_FAST_PUTFIELD_INT;
+                fastLabels[OP_PUTFIELD_BYTE] = &&L_FAST_PUTFIELD_BYTE;
+                fastLabels[OP_PUTFIELD_SHORT] = &&L_FAST_PUTFIELD_SHORT;
+                fastLabels[OP_GETFIELD_LONG] = &&L_FAST_GETFIELD_LONG;
+                fastLabels[OP_PUTFIELD_LONG] = &&L_FAST_PUTFIELD_LONG;
+                fastLabels[OP_IRETURN] = &&L_FAST_IRETURN;
+                fastLabels[OP_LRETURN] = &&L_FAST_LRETURN;
+                fastLabels[OP_ARETURN] = &&L_FAST_ARETURN;
+                fastLabels[OP_RETURN] = &&L_FAST_RETURN;
+                fastLabels[OP_LOAD_LOAD] = &&L_FAST_LOAD_LOAD;
+                fastLabels[OP_LOAD_LOAD_IADD_STORE] = &&L_FAST_LOAD_LOAD_IADD_STORE;
+                fastLabels[OP_LOAD_LOAD_IF_ICMP] = &&L_FAST_LOAD_LOAD_IF_ICMP;
+                fastLabels[OP_LOAD_ICONST] = &&L_FAST_LOAD_ICONST;
+                fastLabels[OP_LOAD_ICONST_IF_ICMP] = &&L_FAST_LOAD_ICONST_IF_ICMP;
+                fastLabels[OP_LOAD_GETFIELD_REF] = &&L_FAST_LOAD_GETFIELD_REF;
+                fastLabels[OP_LOAD_GETFIELD_INT] = &&L_FAST_LOAD_GETFIELD_INT;
+                fastLabels[OP_IINC_GOTO] = &&L_FAST_IINC_GOTO;
+                labelsReady.store(true, memory_order_release);
+            }
+        }
+#define HANDLERS(m) ((m)->verified ? fastLabels : labels)
+// -Xprof:insns sends every instruction through L_PROFILE first.
+#define HANDLER(m, op) (options.profileInsns ? &&L_PROFILE : HANDLERS(m)[op])
+// Threads may bind the same method at once; they store the same handlers,
+// published by the release store of threaded. Rewrites happen under
+// rewriteLock, once per instruction: operands first, then release stores
+// of the opcode and the handler, which dispatch loads with acquire.
+#define BIND_HANDLERS(m) \
+        if (!(m)->threaded.load(memory_order_acquire)) { \
+            for (auto& in : (m)->insns) in.handler.store(HANDLER(m, in.opcode), memory_order_relaxed); \
+            (m)->threaded.store(true, memory_order_release); \
+        }
+#define REWRITE(in, op) (in).opcode.store((op), memory_order_release); \
+        (in).handler.store(HANDLER(method, (op)), memory_order_release)
+#else
+        // The switch picks the FAST handlers for verified methods by
+        // offsetting their case labels.
+        enum { FAST_SET = 0x100 };
+        int handlerSet = 0;
+#define BIND_HANDLERS(m) handlerSet = (m)->verified ? FAST_SET : 0
+#define REWRITE(in, op) (in).opcode.store((op), memory_order_release)
+#endif
+
+        Frame* frame;
+        Method* method;
+        Insn* insns;
+        Insn* ip;
+        CPEntry* cp;
+        StackSlot* locals;
+        StackSlot* base;
+        StackSlot* limit;
+        StackSlot* sp;
+
+// Loads the interpreter state of the top frame, resuming it where it left off.
+#define ENTER_FRAME() do { \
+            frame = &callStack.back(); \
+            method = frame->method; \
+            BIND_HANDLERS(method); \
+            insns = method->insns.data(); \
+            ip = frame->ip ? frame->ip : insns; \
+            cp = method->owner->constantPool.data(); \
+            locals = frame->locals; \
+            base = frame->operands.base; \
+            limit = frame->operands.limit; \
+            sp = frame->operands.sp; \
+            JIT_RUN(); \
+        } while (0)
+// The stack pointer lives in a register; helpers that work on the frame
+// see it through frame->operands.sp.
+#define SYNC_OUT() frame->operands.sp = sp
+#define SYNC_IN() sp = frame->operands.sp
+// Continues in compiled code, if the method has some and the stack is as
+// deep as the compiler expects here, until the next instruction it leaves
+// to the interpreter. Entered on calls, returns and taken branches.
+#if JVM_JIT
+#define JIT_RUN() \
+            if (JitCode* compiled = method->jit.load(memory_order_acquire)) { \
+                if (sp - base == compiled->depth[ip - insns]) { \
+                    SYNC_OUT(); \
+                    ip = insns + compiled->entry(locals, base, &frame->operands.sp, static_cast<uint32_t>(ip - insns)); \
+                    SYNC_IN(); \
+                } \
+            }
+#else
+#define JIT_RUN()
+#endif
+// Calls leave through the helper, which pushes a frame for bytecode targets.
+#define INVOKE(call) \
+            SYNC_OUT(); \
+            frame->ip = ip + 1; \
+            if (call) { ENTER_FRAME(); DISPATCH(); } \
+            SYNC_IN(); \
+            ++ip; DISPATCH();
+#define RETURN_TO_CALLER(...) \
+            popFrame(__VA_ARGS__); \
+            if (callStack.size() == stopDepth) return; \
+            ENTER_FRAME(); \
+            DISPATCH();
+// Throws a guest exception from the current instruction and continues at
+// the handler that catches it, without leaving the loop unless no frame
+// of this activation does.
+#define THROW(exception) { \
+            SYNC_OUT(); \
+            Object* thrown_ = (exception); \
+            frame->ip = ip + 1; \
+            throwException(thrown_, stopDepth); \
+            ENTER_FRAME(); \
+            DISPATCH(); }
+#define DIVIDE_BY_ZERO() THROW(newThrowable(errorClass(VMErrorKind::ArithmeticException), "/ by zero"))
+
+        // Errors raised below the loop, in helpers and natives, arrive here
+        // as C++ exceptions and are thrown on from the running instruction
+        // when they are guest exceptions. Nothing is paid until one is.
+        for (;;) try {
+        ENTER_FRAME();
+#define PUSH(v) do { \
+            StackSlot pushed_ = (v); \
+            if (sp == limit) { SYNC_OUT(); throw runtime_error("Operand stack overflow"); } \
+            *sp++ = pushed_; \
+        } while (0)
+#define DEPTH() (sp - base)
+// Room for n more operands.
+#define ROOM(n) \
+            if (limit - sp < (n)) { SYNC_OUT(); throw runtime_error("Operand stack overflow"); }
+#define INT_BINOP(expr) \
+        if (DEPTH() >= 2 && sp[-2].isInt() && sp[-1].isInt()) { \
+            jint a = sp[-2].asInt(), b = sp[-1].asInt(); \
+            sp[-2] = StackSlot(static_cast<jint>(expr)); \
+            --sp; \
+        } else if (DEPTH() >= 2) { \
+            sp -= 2; \
+        } \
+        ++ip; DISPATCH();
+// Taken branch. Backward ones are safepoint polls and budget steps, and
+// are counted per branch; once a loop is hot the method is compiled, and
+// entering it at the loop header replaces the running interpreter frame
+// mid-loop (on-stack replacement).
+#define BRANCH() { \
+            size_t from = ip - insns; \
+            ip = insns + ip->a; \
+            if (ip <= insns + from) { \
+                if (safepoint.requested) { SYNC_OUT(); frame->ip = insns + from + 1; parkAtPoll(); } \
+                if (!step()) { SYNC_OUT(); budgetTick(); } \
+                if (method->backedges[from].bump() >= options.jitBackedges && options.jit && !method->jitTried.load(memory_order_relaxed)) \
+                    compileMethod(*method, static_cast<int>(from)); \
+            } \
+            JIT_RUN(); }
+#define PRIMITIVE(op) sp = primitive<OP_##op>(sp); ++ip; DISPATCH();
+#define FAST_INT_BINOP(expr) { \
+            jint a = sp[-2].asInt(), b = sp[-1].asInt(); \
+            sp[-2] = StackSlot(static_cast<jint>(expr)); \
+            --sp; ++ip; DISPATCH(); }
+#define FAST_IF_INT(cond) { \
+            jint val = (--sp)->asInt(); \
+            if (cond) BRANCH() else { ++ip; } \
+            DISPATCH(); }
+#define FAST_IF_ICMP(cond) { \
+            sp -= 2; \
+            jint val1 = sp[0].asInt(), val2 = sp[1].asInt(); \
+            if (cond) BRANCH() else { ++ip; } \
+            DISPATCH(); }
+// A receiver the verifier proved of the field's class is only null-checked.
+#define FAST_RECEIVER(n) \
+            Object* obj = sp[-1 - (n)].asRef(); \
+            if (!obj) THROW(newThrowable(errorClass(VMErrorKind::NullPointerException))) \
+            if (ip->untypedReceiver && !isSubclassOf(obj->clazz, cp[ip->a].refClass)) \
+                THROW(newThrowable(errorClass(VMErrorKind::IncompatibleClassChangeError), fieldMismatch(obj, cp[ip->a])))
+#define IF_INT(cond) { \
+            bool jump = false; \
+            if (DEPTH() >= 1) { \
+                StackSlot slot = *--sp; \
+                jint val = slot.asInt(); \
+                jump = slot.isInt() && (cond); \
+            } \
+            if (jump) BRANCH() else { ++ip; } \
+            DISPATCH(); }
+#define IF_ICMP(cond) { \
+            bool jump = false; \
+            if (DEPTH() >= 2) { \
+                sp -= 2; \
+                jint val1 = sp[0].asInt(), val2 = sp[1].asInt(); \
+                jump = sp[0].isInt() && sp[1].isInt() && (cond); \
+            } \
+            if (jump) BRANCH() else { ++ip; } \
+            DISPATCH(); }
+// Field access on the receiver below n value slots; a null receiver, or one
+// of a class without the field (see fieldReceiver), throws.
+#define FIELD_RECEIVER(n) \
+            if (DEPTH() < (n) + 1) { ++ip; DISPATCH(); } \
+            if (!sp[-1 - (n)].isRef() || !sp[-1 - (n)].asRef()) \
+                THROW(newThrowable(errorClass(VMErrorKind::NullPointerException))) \
+            Object* obj = sp[-1 - (n)].asRef(); \
+            if (!isSubclassOf(obj->clazz, cp[ip->a].refClass)) \
+                THROW(newThrowable(errorClass(VMErrorKind::IncompatibleClassChangeError), fieldMismatch(obj, cp[ip->a])))
+// Element address for an array access with n value slots above the array
+// and index; anything but an in-bounds access to an array of T throws.
+#define ARRAY_ELEMENT(n, kind, T) \
+            if (DEPTH() < (n) + 2) { ++ip; DISPATCH(); } \
+            Object* array = sp[-2 - (n)].asRef(); \
+            jint index = sp[-1 - (n)].asInt(); \
+            if (!sp[-2 - (n)].isRef() || !array || array->kind != (kind) || array->clazz->elementSize != sizeof(T) || \
+                static_cast<uint32_t>(index) >= static_cast<uint32_t>(array->arrayLength())) \
+                THROW(arrayFault(sp[-2 - (n)], index, kind, sizeof(T))) \
+            char* element = array->elements() + static_cast<size_t>(index) * sizeof(T);
+#define ARRAY_LOAD(kind, T, make) { \
+            ARRAY_ELEMENT(0, kind, T) \
+            T v; memcpy(&v, element, sizeof(T)); \
+            sp[-2] = StackSlot(make); \
+            --sp; ++ip; DISPATCH(); }
+#define IF_ACMP(cond) { \
+            bool jump = false; \
+            if (DEPTH() >= 2) { \
+                sp -= 2; \
+                Object* ref1 = sp[0].asRef(); \
+                Object* ref2 = sp[1].asRef(); \
+                jump = sp[0].isRef() && sp[1].isRef() && (cond); \
+            } \
+            if (jump) BRANCH() else { ++ip; } \
+            DISPATCH(); }
+
+#if JVM_COMPUTED_GOTO
+        DISPATCH();
+    L_PROFILE:
+        self.insnProfile.count(method, ip);
+        goto *HANDLERS(method)[ip->opcode.load(memory_order_acquire)];
+#else
+        for (;;) switch ((options.profileInsns ? self.insnProfile.count(method, ip) : ip->opcode.load(memory_order_acquire)) | handlerSet) {
+#endif
+        TARGET(NOP) ++ip; DISPATCH();
+        CHECKED(ACONST_NULL) PUSH(StackSlot(nullptr)); ++ip; DISPATCH();
+        CHECKED(ICONST) PUSH(StackSlot(ip->a)); ++ip; DISPATCH();
+        CHECKED(LCONST) ROOM(2) sp[0] = StackSlot(ip->a); sp[1] = StackSlot(ip->b); sp += 2; ++ip; DISPATCH();
+
+        TARGET(LDC_STRING) {
+            SYNC_OUT(); // allocation may collect
+            Object* str = cp[ip->a].stringObject.load(memory_order_acquire);
+            if (!str) str = ldcString(method->owner->constantPool, ip->a);
+            PUSH(StackSlot(str));
+            ++ip; DISPATCH();
+        }
+        TARGET(LDC_CLASS) {
+            SYNC_OUT(); // loading and allocation may collect
+            Class* cls = cp[ip->a].resolved.load(memory_order_acquire) ? cp[ip->a].refClass : resolveClass(method->owner->constantPool, static_cast<uint16_t>(ip->a));
+            PUSH(StackSlot(classMonitor(*cls)));
+            ++ip; DISPATCH();
+        }
+        TARGET(LDC) SYNC_OUT(); unsupportedLdc(*method, static_cast<uint16_t>(ip->a));
+
+        CHECKED(LOAD) PUSH(locals[ip->a]); ++ip; DISPATCH();
+
+        // Superinstructions (see fuseInsns). Each runs its whole sequence
+        // when the operands have the expected types and the stack has room;
+        // otherwise it runs just its first instruction, and the rest of the
+        // sequence, still in the stream behind it, runs one by one.
+        CHECKED(LOAD_LOAD)
+            if (limit - sp >= 2) {
+                sp[0] = locals[ip->a];
+                sp[1] = locals[ip[1].a];
+                sp += 2; ip += 2; DISPATCH();
+            }
+            PUSH(locals[ip->a]); ++ip; DISPATCH();
+        CHECKED(LOAD_LOAD_IADD_STORE)
+            if (limit - sp >= 2 && locals[ip->a].isInt() && locals[ip[1].a].isInt()) {
+                locals[ip[3].a] = StackSlot(intAdd(locals[ip->a].asInt(), locals[ip[1].a].asInt()));
+                ip += 4; DISPATCH();
+            }
+            PUSH(locals[ip->a]); ++ip; DISPATCH();
+        CHECKED(LOAD_LOAD_IF_ICMP)
+            if (limit - sp >= 2 && locals[ip->a].isInt() && locals[ip[1].a].isInt()) {
+                jint val1 = locals[ip->a].asInt(), val2 = locals[ip[1].a].asInt();
+                ip += 2;
+                if (intCompare(ip->opcode, val1, val2)) BRANCH() else { ++ip; }
+                DISPATCH();
+            }
+            PUSH(locals[ip->a]); ++ip; DISPATCH();
+        CHECKED(LOAD_ICONST)
+            if (limit - sp >= 2) {
+                sp[0] = locals[ip->a];
+                sp[1] = StackSlot(ip[1].a);
+                sp += 2; ip += 2; DISPATCH();
+            }
+            PUSH(locals[ip->a]); ++ip; DISPATCH();
+        CHECKED(LOAD_ICONST_IF_ICMP)
+            if (limit - sp >= 2 && locals[ip->a].isInt()) {
+                jint val1 = locals[ip->a].asInt(), val2 = ip[1].a;
+                ip += 2;
+                if (intCompare(ip->opcode, val1, val2)) BRANCH() else { ++ip; }
+                DISPATCH();
+            }
+            PUSH(locals[ip->a]); ++ip; DISPATCH();
+        // Anything the getfield would throw for goes through it unfused.
+        CHECKED(LOAD_GETFIELD_REF)
+            if (sp != limit && locals[ip->a].isRef() && locals[ip->a].asRef() &&
+                isSubclassOf(locals[ip->a].asRef()->clazz, cp[ip[1].a].refClass)) {
+                *sp++ = StackSlot(locals[ip->a].asRef()->refs()[ip->b]);
+                ip += 2; DISPATCH();
+            }
+            PUSH(locals[ip->a]); ++ip; DISPATCH();
+        CHECKED(LOAD_GETFIELD_INT)
+            if (sp != limit && locals[ip->a].isRef() && locals[ip->a].asRef() &&
+                isSubclassOf(locals[ip->a].asRef()->clazz, cp[ip[1].a].refClass)) {
+                jint v; memcpy(&v, locals[ip->a].asRef()->data() + ip->b, 4);
+                *sp++ = StackSlot(v);
+                ip += 2; DISPATCH();
+            }
+            PUSH(locals[ip->a]); ++ip; DISPATCH();
+        CHECKED(IINC_GOTO)
+            if (locals[ip->a].isInt()) locals[ip->a] = StackSlot(intAdd(locals[ip->a].asInt(), ip->b));
+            ++ip; BRANCH(); DISPATCH();
+        CHECKED(STORE)
+            if (DEPTH() >= 1) locals[ip->a] = *--sp;
+            ++ip; DISPATCH();
+
+        CHECKED(LOAD2) ROOM(2) sp[0] = locals[ip->a]; sp[1] = locals[ip->a + 1]; sp += 2; ++ip; DISPATCH();
+        CHECKED(STORE2)
+            if (DEPTH() >= 2) { locals[ip->a] = sp[-2]; locals[ip->a + 1] = sp[-1]; sp -= 2; }
+            ++ip; DISPATCH();
+
+        CHECKED(POP) if (DEPTH() >= 1) --sp; ++ip; DISPATCH();
+        CHECKED(POP2) if (DEPTH() >= 2) sp -= 2; ++ip; DISPATCH();
+        CHECKED(DUP)
+            if (DEPTH() >= 1) PUSH(sp[-1]);
+            ++ip; DISPATCH();
+        CHECKED(DUP2)
+            if (DEPTH() >= 2) { ROOM(2) sp[0] = sp[-2]; sp[1] = sp[-1]; sp += 2; }
+            ++ip; DISPATCH();
+
+        CHECKED(IADD) INT_BINOP(intAdd(a, b))
+        CHECKED(ISUB) INT_BINOP(intSub(a, b))
+        CHECKED(IMUL) INT_BINOP(intMul(a, b))
+        CHECKED(IDIV)
+            if (DEPTH() >= 2 && sp[-2].isInt() && sp[-1].isInt()) {
+                if (sp[-1].asInt() == 0) DIVIDE_BY_ZERO()
+                sp[-2] = StackSlot(intDiv(sp[-2].asInt(), sp[-1].asInt()));
+                --sp;
+            } else if (DEPTH() >= 2) {
+                sp -= 2;
+            }
+            ++ip; DISPATCH();
+
+        CHECKED(IINC)
+            if (locals[ip->a].isInt()) locals[ip->a] = StackSlot(intAdd(locals[ip->a].asInt(), ip->b));
+            ++ip; DISPATCH();
+
+        // Long, float and double arithmetic, conversions and compares. The
+        // checked handlers test the operand slots, then run the same code
+        // as the fast ones.
+        CHECKED(LADD)
+        CHECKED(LSUB)
+        CHECKED(LMUL)
+        CHECKED(LDIV)
+        CHECKED(LREM)
+        CHECKED(LAND)
+        CHECKED(LOR)
+        CHECKED(LXOR)
+        CHECKED(LNEG)
+        CHECKED(LSHL)
+        CHECKED(LSHR)
+        CHECKED(LUSHR)
+        CHECKED(LCMP)
+        CHECKED(FADD)
+        CHECKED(FSUB)
+        CHECKED(FMUL)
+        CHECKED(FDIV)
+        CHECKED(FREM)
+        CHECKED(FNEG)
+        CHECKED(FCMPL)
+        CHECKED(FCMPG)
+        CHECKED(DADD)
+        CHECKED(DSUB)
+        CHECKED(DMUL)
+        CHECKED(DDIV)
+        CHECKED(DREM)
+        CHECKED(DNEG)
+        CHECKED(DCMPL)
+        CHECKED(DCMPG)
+        CHECKED(I2L)
+        CHECKED(I2F)
+        CHECKED(I2D)
+        CHECKED(L2I)
+        CHECKED(L2F)
+        CHECKED(L2D)
+        CHECKED(F2I)
+        CHECKED(F2L)
+        CHECKED(F2D)
+        CHECKED(D2I)
+        CHECKED(D2L)
+        CHECKED(D2F) {
+            int pops, pushes;
+            primitiveEffect(ip->opcode, pops, pushes);
+            bool ints = DEPTH() >= pops && limit - sp >= pushes - pops;
+            for (int i = 1; ints && i <= pops; ++i) ints = sp[-i].isInt();
+            SYNC_OUT();
+            if (!ints) throw VMError(VMErrorKind::VerifyError, "Bad operands for " + opName(ip->opcode) + " in " +
+                                           method->owner->name + "." + method->name + method->descriptor);
+            if ((ip->opcode == OP_LDIV || ip->opcode == OP_LREM) && wideAt(sp - 2) == 0) DIVIDE_BY_ZERO()
+            sp = primitiveOp(ip->opcode, sp);
+            ++ip; DISPATCH();
+        }
 
-                    uint16_t code_attr_count = mem.read_u2();
-                    for (int k = 0; k < code_attr_count; ++k) {
-                        uint16_t ca_name = mem.read_u2();
-                        uint32_t ca_len = mem.read_u4();
-                        mem.seek(mem.tell() + ca_len);
+        CHECKED(IFEQ) IF_INT(val == 0)
+        CHECKED(IFNE) IF_INT(val != 0)
+        CHECKED(IFLT) IF_INT(val < 0)
+        CHECKED(IFGE) IF_INT(val >= 0)
+        CHECKED(IFGT) IF_INT(val > 0)
+        CHECKED(IFLE) IF_INT(val <= 0)
+        CHECKED(IF_ICMPEQ) IF_ICMP(val1 == val2)
+        CHECKED(IF_ICMPNE) IF_ICMP(val1 != val2)
+        CHECKED(IF_ICMPLT) IF_ICMP(val1 < val2)
+        CHECKED(IF_ICMPGE) IF_ICMP(val1 >= val2)
+        CHECKED(IF_ICMPGT) IF_ICMP(val1 > val2)
+        CHECKED(IF_ICMPLE) IF_ICMP(val1 <= val2)
+        CHECKED(IF_ACMPEQ) IF_ACMP(ref1 == ref2)
+        CHECKED(IF_ACMPNE) IF_ACMP(ref1 != ref2)
+        TARGET(GOTO) BRANCH(); DISPATCH();
+
+        // Falls through to getstatic alone until both are resolved.
+        TARGET(GETSTATIC_LDC_STRING)
+            if (Object* str = cp[ip[1].a].stringObject.load(memory_order_acquire);
+                str && cp[ip->a].resolved.load(memory_order_acquire) && limit - sp >= 2) {
+                sp[0] = fieldValue(*cp[ip->a].field);
+                sp[1] = StackSlot(str);
+                sp += 2; ip += 2; DISPATCH();
+            }
+        TARGET(GETSTATIC) {
+            CPEntry& ref = cp[ip->a];
+            if (!ref.resolved.load(memory_order_acquire)) {
+                SYNC_OUT();
+                resolveRef(method->owner->constantPool, static_cast<uint16_t>(ip->a));
+            }
+            PUSH(fieldValue(*ref.field));
+            if (isWide(*ref.field)) PUSH(StackSlot(jint(0)));
+            ++ip; DISPATCH();
+        }
+
+        // First execution resolves the field and rewrites the instruction
+        // into the quick form for its type, which then runs. A thread that
+        // finds it already rewritten only makes sure its handler matches; a
+        // late BIND_HANDLERS may have stored the old one.
+        TARGET(GETFIELD)
+        TARGET(PUTFIELD) {
+            SYNC_OUT();
+            Field& field = instanceField(method->owner->constantPool, static_cast<uint16_t>(ip->a));
+            {
+                lock_guard<mutex> hold(rewriteLock);
+                uint8_t op = ip->opcode.load(memory_order_relaxed);
+                if (op == OP_GETFIELD || op == OP_PUTFIELD) {
+                    ip->b = static_cast<jint>(field.offset);
+                    uint8_t quick = quickFieldOp(field, op == OP_PUTFIELD);
+                    // aload; getfield only fuses now that the field type is known
+                    if (options.fuse && ip > insns && ip[-1].opcode.load(memory_order_relaxed) == OP_LOAD &&
+                        (quick == OP_GETFIELD_REF || quick == OP_GETFIELD_INT)) {
+                        ip[-1].b = ip->b;
+                        REWRITE(ip[-1], quick == OP_GETFIELD_REF ? OP_LOAD_GETFIELD_REF : OP_LOAD_GETFIELD_INT);
                     }
+                    op = quick;
                 }
-                else {
-                    mem.seek(mem.tell() + attr_len);
-                }
+                REWRITE(*ip, op);
             }
+            DISPATCH();
+        }
+        CHECKED(GETFIELD_REF) { FIELD_RECEIVER(0) sp[-1] = StackSlot(obj->refs()[ip->b]); ++ip; DISPATCH(); }
+        CHECKED(GETFIELD_INT) {
+            FIELD_RECEIVER(0)
+            jint v; memcpy(&v, obj->data() + ip->b, 4);
+            sp[-1] = StackSlot(v);
+            ++ip; DISPATCH();
+        }
+        CHECKED(GETFIELD_BYTE) {
+            FIELD_RECEIVER(0)
+            sp[-1] = StackSlot(static_cast<jint>(static_cast<int8_t>(obj->data()[ip->b])));
+            ++ip; DISPATCH();
+        }
+        CHECKED(GETFIELD_CHAR) {
+            FIELD_RECEIVER(0)
+            uint16_t v; memcpy(&v, obj->data() + ip->b, 2);
+            sp[-1] = StackSlot(static_cast<jint>(v));
+            ++ip; DISPATCH();
+        }
+        CHECKED(GETFIELD_SHORT) {
+            FIELD_RECEIVER(0)
+            int16_t v; memcpy(&v, obj->data() + ip->b, 2);
+            sp[-1] = StackSlot(static_cast<jint>(v));
+            ++ip; DISPATCH();
+        }
+        CHECKED(PUTFIELD_REF) {
+            FIELD_RECEIVER(1)
+            obj->refs()[ip->b] = sp[-1].isRef() ? sp[-1].asRef() : nullptr;
+            sp -= 2; ++ip; DISPATCH();
+        }
+        CHECKED(PUTFIELD_INT) {
+            FIELD_RECEIVER(1)
+            jint v = sp[-1].asInt();
+            memcpy(obj->data() + ip->b, &v, 4);
+            sp -= 2; ++ip; DISPATCH();
+        }
+        CHECKED(PUTFIELD_BYTE) {
+            FIELD_RECEIVER(1)
+            obj->data()[ip->b] = static_cast<char>(sp[-1].asInt());
+            sp -= 2; ++ip; DISPATCH();
+        }
+        CHECKED(PUTFIELD_SHORT) {
+            FIELD_RECEIVER(1)
+            uint16_t v = static_cast<uint16_t>(sp[-1].asInt());
+            memcpy(obj->data() + ip->b, &v, 2);
+            sp -= 2; ++ip; DISPATCH();
+        }
+        CHECKED(GETFIELD_LONG) {
+            FIELD_RECEIVER(0)
+            ROOM(1)
+            uint64_t v; memcpy(&v, obj->data() + ip->b, 8);
+            setWide(sp - 1, v);
+            ++sp; ++ip; DISPATCH();
+        }
+        CHECKED(PUTFIELD_LONG) {
+            FIELD_RECEIVER(2)
+            uint64_t v = wideAt(sp - 2);
+            memcpy(obj->data() + ip->b, &v, 8);
+            sp -= 3; ++ip; DISPATCH();
+        }
 
-            clazz->methods.push_back(m);
-            clazz->methodMap[m.name + m.descriptor] = clazz->methods.size() - 1;
+        TARGET(NEW) {
+            SYNC_OUT(); // allocation may collect
+            Class* cls = cp[ip->a].resolved.load(memory_order_acquire) ? cp[ip->a].refClass : resolveClass(method->owner->constantPool, static_cast<uint16_t>(ip->a));
+            PUSH(StackSlot(newInstance(cls)));
+            ++ip; DISPATCH();
         }
 
-        return clazz;
-    }
+        TARGET(NEWARRAY) {
+            SYNC_OUT(); // allocation may collect
+            if (DEPTH() >= 1) sp[-1] = StackSlot(newArray(primitiveArrays[ip->a], sp[-1].asInt()));
+            ++ip; DISPATCH();
+        }
+        TARGET(ANEWARRAY) {
+            SYNC_OUT();
+            Class* component = cp[ip->a].resolved.load(memory_order_acquire) ? cp[ip->a].refClass : resolveClass(method->owner->constantPool, static_cast<uint16_t>(ip->a));
+            if (DEPTH() >= 1) sp[-1] = StackSlot(newArray(arrayOf(component), sp[-1].asInt()));
+            ++ip; DISPATCH();
+        }
+        TARGET(ARRAYLENGTH)
+            if (DEPTH() >= 1) {
+                Object* array = sp[-1].asRef();
+                if (sp[-1].isRef() && !array) THROW(newThrowable(errorClass(VMErrorKind::NullPointerException)))
+                if (!sp[-1].isRef() || (array->kind != Object::ARRAY && array->kind != Object::OBJECT_ARRAY)) {
+                    SYNC_OUT(); arrayRef(sp[-1]);
+                }
+                sp[-1] = StackSlot(array->arrayLength());
+            }
+            ++ip; DISPATCH();
+        TARGET(ATHROW) {
+            Object* exception = DEPTH() >= 1 && sp[-1].isRef() ? sp[-1].asRef() : nullptr;
+            if (!exception && DEPTH() >= 1 && sp[-1].isRef()) THROW(newThrowable(errorClass(VMErrorKind::NullPointerException)))
+            if (!exception || !isSubclassOf(exception->clazz, throwableClass)) {
+                SYNC_OUT();
+                throw VMError(VMErrorKind::VerifyError, "Bad operand for athrow in " +
+                                    method->owner->name + "." + method->name + method->descriptor);
+            }
+            THROW(exception)
+        }
 
-    void runMain(const string& className) {
-        auto it = loadedClasses.find(className);
-        if (it == loadedClasses.end()) {
-            throw runtime_error("Class not loaded: " + className);
+        TARGET(MONITORENTER)
+            if (DEPTH() >= 1) {
+                SYNC_OUT();
+                monitorEnter(nonNullRef(sp[-1]));
+                --sp;
+            }
+            ++ip; DISPATCH();
+        TARGET(MONITOREXIT)
+            if (DEPTH() >= 1) {
+                SYNC_OUT();
+                monitorExit(nonNullRef(sp[-1]));
+                --sp;
+            }
+            ++ip; DISPATCH();
+
+        TARGET(IALOAD)
+        TARGET(FALOAD) ARRAY_LOAD(Object::ARRAY, jint, v)
+        TARGET(AALOAD) ARRAY_LOAD(Object::OBJECT_ARRAY, Object*, v)
+        TARGET(BALOAD) ARRAY_LOAD(Object::ARRAY, jbyte, static_cast<jint>(v))
+        TARGET(CALOAD) ARRAY_LOAD(Object::ARRAY, jchar, static_cast<jint>(v))
+        TARGET(SALOAD) ARRAY_LOAD(Object::ARRAY, jshort, static_cast<jint>(v))
+        TARGET(LALOAD) {
+            ARRAY_ELEMENT(0, Object::ARRAY, jlong)
+            uint64_t v; memcpy(&v, element, sizeof(v));
+            setWide(sp - 2, v);
+            ++ip; DISPATCH();
+        }
+        TARGET(IASTORE)
+        TARGET(FASTORE) {
+            ARRAY_ELEMENT(1, Object::ARRAY, jint)
+            jint v = sp[-1].asInt();
+            memcpy(element, &v, sizeof(v));
+            sp -= 3; ++ip; DISPATCH();
+        }
+        TARGET(LASTORE) {
+            ARRAY_ELEMENT(2, Object::ARRAY, jlong)
+            uint64_t v = wideAt(sp - 2);
+            memcpy(element, &v, sizeof(v));
+            sp -= 4; ++ip; DISPATCH();
+        }
+        TARGET(AASTORE) {
+            ARRAY_ELEMENT(1, Object::OBJECT_ARRAY, Object*)
+            Object* v = sp[-1].isRef() ? sp[-1].asRef() : nullptr;
+            memcpy(element, &v, sizeof(v));
+            sp -= 3; ++ip; DISPATCH();
+        }
+        TARGET(BASTORE) {
+            ARRAY_ELEMENT(1, Object::ARRAY, jbyte)
+            jint v = sp[-1].asInt();
+            *element = static_cast<char>(array->clazz->elementType == 'Z' ? v & 1 : v);
+            sp -= 3; ++ip; DISPATCH();
+        }
+        TARGET(CASTORE)
+        TARGET(SASTORE) {
+            ARRAY_ELEMENT(1, Object::ARRAY, jchar)
+            jchar v = static_cast<jchar>(sp[-1].asInt());
+            memcpy(element, &v, sizeof(v));
+            sp -= 3; ++ip; DISPATCH();
         }
 
-        auto clazz = it->second;
-        string mainKey = "main([Ljava/lang/String;)V";
+        TARGET(INVOKESTATIC) INVOKE(invokeStatic(*frame, static_cast<uint16_t>(ip->a)))
+        TARGET(INVOKESPECIAL) INVOKE(invokeSpecial(*frame, static_cast<uint16_t>(ip->a)))
+        TARGET(INVOKEVIRTUAL)
+        TARGET(INVOKEINTERFACE) INVOKE(invokeVirtual(*frame, static_cast<uint16_t>(ip->a), ip))
+
+        CHECKED(IRETURN)
+        CHECKED(LRETURN)
+        CHECKED(ARETURN)
+        CHECKED(RETURN)
+        CHECKED(END) {
+            int slots = ip->opcode == OP_LRETURN ? 2 : ip->opcode == OP_IRETURN || ip->opcode == OP_ARETURN ? 1 : 0;
+            StackSlot result[2];
+            if (DEPTH() >= slots) copy(sp - slots, sp, result);
+            if (callStack.size() >= 2 && callStack[callStack.size() - 2].method->verified)
+                slots = declaredResult(*method, result, slots);
+            RETURN_TO_CALLER(result, slots)
+        }
 
-        auto mit = clazz->methodMap.find(mainKey);
-        if (mit == clazz->methodMap.end()) {
-            throw runtime_error("Main method not found in class " + className);
+        // Verified methods. Every test left here (null receiver, division
+        // by zero) is one the verifier cannot decide.
+        FAST(ACONST_NULL) *sp++ = StackSlot(nullptr); ++ip; DISPATCH();
+        FAST(ICONST) *sp++ = StackSlot(ip->a); ++ip; DISPATCH();
+        FAST(LCONST) sp[0] = StackSlot(ip->a); sp[1] = StackSlot(ip->b); sp += 2; ++ip; DISPATCH();
+        FAST(LOAD) *sp++ = locals[ip->a]; ++ip; DISPATCH();
+        FAST(STORE) locals[ip->a] = *--sp; ++ip; DISPATCH();
+        FAST(LOAD2) sp[0] = locals[ip->a]; sp[1] = locals[ip->a + 1]; sp += 2; ++ip; DISPATCH();
+        FAST(STORE2) locals[ip->a] = sp[-2]; locals[ip->a + 1] = sp[-1]; sp -= 2; ++ip; DISPATCH();
+        FAST(POP) --sp; ++ip; DISPATCH();
+        FAST(POP2) sp -= 2; ++ip; DISPATCH();
+        FAST(DUP) sp[0] = sp[-1]; ++sp; ++ip; DISPATCH();
+        FAST(DUP2) sp[0] = sp[-2]; sp[1] = sp[-1]; sp += 2; ++ip; DISPATCH();
+        FAST(IADD) FAST_INT_BINOP(intAdd(a, b))
+        FAST(ISUB) FAST_INT_BINOP(intSub(a, b))
+        FAST(IMUL) FAST_INT_BINOP(intMul(a, b))
+        FAST(IDIV)
+            if (sp[-1].asInt() == 0) DIVIDE_BY_ZERO()
+            FAST_INT_BINOP(intDiv(a, b))
+        FAST(IINC) locals[ip->a] = StackSlot(intAdd(locals[ip->a].asInt(), ip->b)); ++ip; DISPATCH();
+        FAST(LADD) PRIMITIVE(LADD)
+        FAST(LSUB) PRIMITIVE(LSUB)
+        FAST(LMUL) PRIMITIVE(LMUL)
+        FAST(LDIV) if (wideAt(sp - 2) == 0) DIVIDE_BY_ZERO() PRIMITIVE(LDIV)
+        FAST(LREM) if (wideAt(sp - 2) == 0) DIVIDE_BY_ZERO() PRIMITIVE(LREM)
+        FAST(LAND) PRIMITIVE(LAND)
+        FAST(LOR) PRIMITIVE(LOR)
+        FAST(LXOR) PRIMITIVE(LXOR)
+        FAST(LNEG) PRIMITIVE(LNEG)
+        FAST(LSHL) PRIMITIVE(LSHL)
+        FAST(LSHR) PRIMITIVE(LSHR)
+        FAST(LUSHR) PRIMITIVE(LUSHR)
+        FAST(LCMP) PRIMITIVE(LCMP)
+        FAST(FADD) PRIMITIVE(FADD)
+        FAST(FSUB) PRIMITIVE(FSUB)
+        FAST(FMUL) PRIMITIVE(FMUL)
+        FAST(FDIV) PRIMITIVE(FDIV)
+        FAST(FREM) PRIMITIVE(FREM)
+        FAST(FNEG) PRIMITIVE(FNEG)
+        FAST(FCMPL) PRIMITIVE(FCMPL)
+        FAST(FCMPG) PRIMITIVE(FCMPG)
+        FAST(DADD) PRIMITIVE(DADD)
+        FAST(DSUB) PRIMITIVE(DSUB)
+        FAST(DMUL) PRIMITIVE(DMUL)
+        FAST(DDIV) PRIMITIVE(DDIV)
+        FAST(DREM) PRIMITIVE(DREM)
+        FAST(DNEG) PRIMITIVE(DNEG)
+        FAST(DCMPL) PRIMITIVE(DCMPL)
+        FAST(DCMPG) PRIMITIVE(DCMPG)
+        FAST(I2L) PRIMITIVE(I2L)
+        FAST(I2F) PRIMITIVE(I2F)
+        FAST(I2D) PRIMITIVE(I2D)
+        FAST(L2I) PRIMITIVE(L2I)
+        FAST(L2F) PRIMITIVE(L2F)
+        FAST(L2D) PRIMITIVE(L2D)
+        FAST(F2I) PRIMITIVE(F2I)
+        FAST(F2L) PRIMITIVE(F2L)
+        FAST(F2D) PRIMITIVE(F2D)
+        FAST(D2I) PRIMITIVE(D2I)
+        FAST(D2L) PRIMITIVE(D2L)
+        FAST(D2F) PRIMITIVE(D2F)
+        FAST(IFEQ) FAST_IF_INT(val == 0)
+        FAST(IFNE) FAST_IF_INT(val != 0)
+        FAST(IFLT) FAST_IF_INT(val < 0)
+        FAST(IFGE) FAST_IF_INT(val >= 0)
+        FAST(IFGT) FAST_IF_INT(val > 0)
+        FAST(IFLE) FAST_IF_INT(val <= 0)
+        FAST(IF_ICMPEQ) FAST_IF_ICMP(val1 == val2)
+        FAST(IF_ICMPNE) FAST_IF_ICMP(val1 != val2)
+        FAST(IF_ICMPLT) FAST_IF_ICMP(val1 < val2)
+        FAST(IF_ICMPGE) FAST_IF_ICMP(val1 >= val2)
+        FAST(IF_ICMPGT) FAST_IF_ICMP(val1 > val2)
+        FAST(IF_ICMPLE) FAST_IF_ICMP(val1 <= val2)
+        FAST(IF_ACMPEQ) { sp -= 2; if (sp[0].asRef() == sp[1].asRef()) BRANCH() else { ++ip; } DISPATCH(); }
+        FAST(IF_ACMPNE) { sp -= 2; if (sp[0].asRef() != sp[1].asRef()) BRANCH() else { ++ip; } DISPATCH(); }
+
+        FAST(GETFIELD_REF) { FAST_RECEIVER(0) sp[-1] = StackSlot(obj->refs()[ip->b]); ++ip; DISPATCH(); }
+        FAST(GETFIELD_INT) {
+            FAST_RECEIVER(0)
+            jint v; memcpy(&v, obj->data() + ip->b, 4);
+            sp[-1] = StackSlot(v);
+            ++ip; DISPATCH();
+        }
+        FAST(GETFIELD_BYTE) {
+            FAST_RECEIVER(0)
+            sp[-1] = StackSlot(static_cast<jint>(static_cast<int8_t>(obj->data()[ip->b])));
+            ++ip; DISPATCH();
+        }
+        FAST(GETFIELD_CHAR) {
+            FAST_RECEIVER(0)
+            uint16_t v; memcpy(&v, obj->data() + ip->b, 2);
+            sp[-1] = StackSlot(static_cast<jint>(v));
+            ++ip; DISPATCH();
+        }
+        FAST(GETFIELD_SHORT) {
+            FAST_RECEIVER(0)
+            int16_t v; memcpy(&v, obj->data() + ip->b, 2);
+            sp[-1] = StackSlot(static_cast<jint>(v));
+            ++ip; DISPATCH();
+        }
+        FAST(PUTFIELD_REF) { FAST_RECEIVER(1) obj->refs()[ip->b] = sp[-1].asRef(); sp -= 2; ++ip; DISPATCH(); }
+        FAST(PUTFIELD_INT) {
+            FAST_RECEIVER(1)
+            jint v = sp[-1].asInt();
+            memcpy(obj->data() + ip->b, &v, 4);
+            sp -= 2; ++ip; DISPATCH();
+        }
+        FAST(PUTFIELD_BYTE) {
+            FAST_RECEIVER(1)
+            obj->data()[ip->b] = static_cast<char>(sp[-1].asInt());
+            sp -= 2; ++ip; DISPATCH();
+        }
+        FAST(PUTFIELD_SHORT) {
+            FAST_RECEIVER(1)
+            uint16_t v = static_cast<uint16_t>(sp[-1].asInt());
+            memcpy(obj->data() + ip->b, &v, 2);
+            sp -= 2; ++ip; DISPATCH();
+        }
+        FAST(GETFIELD_LONG) {
+            FAST_RECEIVER(0)
+            uint64_t v; memcpy(&v, obj->data() + ip->b, 8);
+            setWide(sp - 1, v);
+            ++sp; ++ip; DISPATCH();
+        }
+        FAST(PUTFIELD_LONG) {
+            FAST_RECEIVER(2)
+            uint64_t v = wideAt(sp - 2);
+            memcpy(obj->data() + ip->b, &v, 8);
+            sp -= 3; ++ip; DISPATCH();
         }
 
-        auto& method = clazz->methods[mit->second];
-        Frame frame(&method);
-        callStack.push(frame);
+        FAST(IRETURN)
+        FAST(ARETURN) {
+            StackSlot result = sp[-1];
+            RETURN_TO_CALLER(&result)
+        }
+        FAST(LRETURN) {
+            StackSlot result[2] = { sp[-2], sp[-1] };
+            RETURN_TO_CALLER(result, 2)
+        }
+        FAST(RETURN)
+            RETURN_TO_CALLER(nullptr)
+
+        FAST(LOAD_LOAD)
+            sp[0] = locals[ip->a];
+            sp[1] = locals[ip[1].a];
+            sp += 2; ip += 2; DISPATCH();
+        FAST(LOAD_LOAD_IADD_STORE)
+            locals[ip[3].a] = StackSlot(intAdd(locals[ip->a].asInt(), locals[ip[1].a].asInt()));
+            ip += 4; DISPATCH();
+        FAST(LOAD_LOAD_IF_ICMP) {
+            jint val1 = locals[ip->a].asInt(), val2 = locals[ip[1].a].asInt();
+            ip += 2;
+            if (intCompare(ip->opcode, val1, val2)) BRANCH() else { ++ip; }
+            DISPATCH();
+        }
+        FAST(LOAD_ICONST)
+            sp[0] = locals[ip->a];
+            sp[1] = StackSlot(ip[1].a);
+            sp += 2; ip += 2; DISPATCH();
+        FAST(LOAD_ICONST_IF_ICMP) {
+            jint val1 = locals[ip->a].asInt(), val2 = ip[1].a;
+            ip += 2;
+            if (intCompare(ip->opcode, val1, val2)) BRANCH() else { ++ip; }
+            DISPATCH();
+        }
+        FAST(LOAD_GETFIELD_REF) {
+            Object* obj = locals[ip->a].asRef();
+            if (!obj || ip[1].untypedReceiver) { *sp++ = locals[ip->a]; ++ip; DISPATCH(); }  // the getfield checks
+            *sp++ = StackSlot(obj->refs()[ip->b]);
+            ip += 2; DISPATCH();
+        }
+        FAST(LOAD_GETFIELD_INT) {
+            Object* obj = locals[ip->a].asRef();
+            if (!obj || ip[1].untypedReceiver) { *sp++ = locals[ip->a]; ++ip; DISPATCH(); }
+            jint v; memcpy(&v, obj->data() + ip->b, 4);
+            *sp++ = StackSlot(v);
+            ip += 2; DISPATCH();
+        }
+        FAST(IINC_GOTO)
+            locals[ip->a] = StackSlot(intAdd(locals[ip->a].asInt(), ip->b));
+            ++ip; BRANCH(); DISPATCH();
+
+#if JVM_COMPUTED_GOTO
+        L_UNIMPLEMENTED:
+#else
+        default:
+#endif
+            cerr << "Unimplemented opcode: 0x" << hex << setfill('0') << setw(2)
+                 << (int)method->code[ip->pc] << dec << endl;
+            ++ip; DISPATCH();
+#if !JVM_COMPUTED_GOTO
+        }
+#endif
+        } catch (const runtime_error& e) {
+            size_t depth = static_cast<size_t>(frame - callStack.data()) + 1;
+            if (callStack.size() < depth) throw;     // thrown on by throwException()
+            while (callStack.size() > depth) dropFrame();   // pushed, not yet entered
+            Object* exception = guestException(e);
+            if (!exception) throw;
+            frame->ip = ip + 1;
+            throwException(exception, stopDepth);
+        }
 
-        execute();
+#undef BIND_HANDLERS
+#undef HANDLERS
+#undef HANDLER
+#undef REWRITE
+#undef ENTER_FRAME
+#undef SYNC_OUT
+#undef SYNC_IN
+#undef JIT_RUN
+#undef BRANCH
+#undef INVOKE
+#undef RETURN_TO_CALLER
+#undef THROW
+#undef DIVIDE_BY_ZERO
+#undef PUSH
+#undef DEPTH
+#undef ROOM
+#undef INT_BINOP
+#undef PRIMITIVE
+#undef FAST_INT_BINOP
+#undef FAST_IF_INT
+#undef FAST_IF_ICMP
+#undef FAST_RECEIVER
+#undef IF_INT
+#undef IF_ICMP
+#undef IF_ACMP
+#undef FIELD_RECEIVER
+#undef ARRAY_ELEMENT
+#undef ARRAY_LOAD
     }
 
-    void execute() {
-        while (!callStack.empty()) {
-            auto& frame = callStack.top();
-            if (!frame.method) {
-                callStack.pop();
-                continue;
-            }
-            auto& code = frame.method->code;
-
-            if (frame.pc >= (int)code.size()) {
-                callStack.pop();
-                continue;
-            }
+#undef TARGET
+#undef CHECKED
+#undef FAST
+#undef DISPATCH
 
-            uint8_t opcode = code[frame.pc++];
-            executeOpcode(frame, code, opcode);
-        }
+    // Taken branch of the switch interpreter from the instruction at pc.
+    void takeBranch(Frame& frame, int pc, jshort offset) {
+        if (offset <= 0 && !step()) budgetTick();
+        frame.pc = pc + offset;
     }
 
     void executeOpcode(Frame& frame, const vector<uint8_t>& code, uint8_t opcode) {
-        auto& locals = frame.locals;
+        StackSlot* locals = frame.locals;
+        size_t numLocals = frame.method->max_locals;
         auto& operands = frame.operands;
+        // n-slot loads and stores: one for int, float and references, two
+        // for long and double
+        auto load = [&](size_t idx, size_t n) {
+            for (size_t i = 0; i < n && idx + n <= numLocals; ++i) operands.push(locals[idx + i]);
+        };
+        auto store = [&](size_t idx, size_t n) {
+            if (operands.size() < n || idx + n > numLocals) return;
+            for (size_t i = n; i-- > 0;) { locals[idx + i] = operands.top(); operands.pop(); }
+        };
+        auto pushWide = [&](uint64_t v) {
+            operands.push(StackSlot(static_cast<jint>(static_cast<uint32_t>(v))));
+            operands.push(StackSlot(static_cast<jint>(v >> 32)));
+        };
 
         switch (opcode) {
             case 0x00: break; // nop
 
-            case 0x01: operands.push(StackSlot(ObjectPtr(nullptr))); break; // aconst_null
+            case 0x01: operands.push(StackSlot(nullptr)); break; // aconst_null
             case 0x02: operands.push(StackSlot(-1)); break; // iconst_m1
             case 0x03: operands.push(StackSlot(0)); break;  // iconst_0
             case 0x04: operands.push(StackSlot(1)); break;  // iconst_1
@@ -496,6 +6593,9 @@ struct JVMInstance {
             case 0x06: operands.push(StackSlot(3)); break;  // iconst_3
             case 0x07: operands.push(StackSlot(4)); break;  // iconst_4
             case 0x08: operands.push(StackSlot(5)); break;  // iconst_5
+            case 0x09: case 0x0A: pushWide(opcode - 0x09); break; // lconst_<n>
+            case 0x0B: case 0x0C: case 0x0D: operands.push(floatSlot(opcode - 0x0B)); break; // fconst_<n>
+            case 0x0E: case 0x0F: pushWide(doubleBits(opcode - 0x0E)); break; // dconst_<n>
 
             case 0x10: { // bipush
                 jbyte val = static_cast<jbyte>(code[frame.pc++]);
@@ -511,97 +6611,89 @@ struct JVMInstance {
                 break;
             }
 
-            case 0x12: { // ldc
-                uint8_t index = code[frame.pc++];
-                if (index < frame.method->owner->constantPool.size()) {
-                    auto& entry = frame.method->owner->constantPool[index];
-                    if (entry.tag == 8) { // String constant
-                        uint16_t utf8_index = entry.string_index;
-                        if (utf8_index < frame.method->owner->constantPool.size() && 
-                            frame.method->owner->constantPool[utf8_index].tag == 1) {
-                            string strValue = frame.method->owner->constantPool[utf8_index].utf8_value;
-                            auto strObj = createString(strValue);
-                            operands.push(StackSlot(strObj));
-                        }
-                    } else if (entry.tag == 3) { // Integer constant
-                        operands.push(StackSlot(static_cast<jint>(entry.int_value)));
-                    }
-                }
+            case 0x12: // ldc
+                ldc(frame, code[frame.pc++]);
                 break;
-            }
-            
+
             case 0x13: { // ldc_w
-                uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) | 
+                uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
                                 static_cast<uint16_t>(code[frame.pc + 1]);
                 frame.pc += 2;
-                if (index < frame.method->owner->constantPool.size()) {
-                    auto& entry = frame.method->owner->constantPool[index];
-                    if (entry.tag == 8) { // String constant
-                        uint16_t utf8_index = entry.string_index;
-                        if (utf8_index < frame.method->owner->constantPool.size() && 
-                            frame.method->owner->constantPool[utf8_index].tag == 1) {
-                            string strValue = frame.method->owner->constantPool[utf8_index].utf8_value;
-                            auto strObj = createString(strValue);
-                            operands.push(StackSlot(strObj));
-                        }
-                    } else if (entry.tag == 3) { // Integer constant
-                        operands.push(StackSlot(static_cast<jint>(entry.int_value)));
-                    }
-                }
+                ldc(frame, index);
+                break;
+            }
+            case 0x14: { // ldc2_w
+                uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
+                                static_cast<uint16_t>(code[frame.pc + 1]);
+                frame.pc += 2;
+                auto& cp = frame.method->owner->constantPool;
+                if (index < cp.size() && (cp[index].tag == 5 || cp[index].tag == 6)) pushWide(cp[index].long_value);
                 break;
             }
 
             case 0x15: { // iload
                 uint8_t idx = code[frame.pc++];
-                if (idx < locals.size()) {
+                if (idx < numLocals) {
                     operands.push(locals[idx]);
                 }
                 break;
             }
-            case 0x1A: if (locals.size() > 0) operands.push(locals[0]); break; // iload_0
-            case 0x1B: if (locals.size() > 1) operands.push(locals[1]); break; // iload_1
-            case 0x1C: if (locals.size() > 2) operands.push(locals[2]); break; // iload_2
-            case 0x1D: if (locals.size() > 3) operands.push(locals[3]); break; // iload_3
+            case 0x1A: if (numLocals > 0) operands.push(locals[0]); break; // iload_0
+            case 0x1B: if (numLocals > 1) operands.push(locals[1]); break; // iload_1
+            case 0x1C: if (numLocals > 2) operands.push(locals[2]); break; // iload_2
+            case 0x1D: if (numLocals > 3) operands.push(locals[3]); break; // iload_3
 
             case 0x19: { // aload
                 uint8_t idx = code[frame.pc++];
-                if (idx < locals.size()) {
+                if (idx < numLocals) {
                     operands.push(locals[idx]);
                 }
                 break;
             }
-            case 0x2A: if (locals.size() > 0) operands.push(locals[0]); break; // aload_0
-            case 0x2B: if (locals.size() > 1) operands.push(locals[1]); break; // aload_1
-            case 0x2C: if (locals.size() > 2) operands.push(locals[2]); break; // aload_2
-            case 0x2D: if (locals.size() > 3) operands.push(locals[3]); break; // aload_3
+            case 0x2A: if (numLocals > 0) operands.push(locals[0]); break; // aload_0
+            case 0x2B: if (numLocals > 1) operands.push(locals[1]); break; // aload_1
+            case 0x2C: if (numLocals > 2) operands.push(locals[2]); break; // aload_2
+            case 0x2D: if (numLocals > 3) operands.push(locals[3]); break; // aload_3
+
+            case 0x16: case 0x18: load(code[frame.pc++], 2); break; // lload, dload
+            case 0x17: load(code[frame.pc++], 1); break; // fload
+            case 0x1E: case 0x1F: case 0x20: case 0x21: load(opcode - 0x1E, 2); break; // lload_<n>
+            case 0x22: case 0x23: case 0x24: case 0x25: load(opcode - 0x22, 1); break; // fload_<n>
+            case 0x26: case 0x27: case 0x28: case 0x29: load(opcode - 0x26, 2); break; // dload_<n>
+            case 0x37: case 0x39: store(code[frame.pc++], 2); break; // lstore, dstore
+            case 0x38: store(code[frame.pc++], 1); break; // fstore
+            case 0x3F: case 0x40: case 0x41: case 0x42: store(opcode - 0x3F, 2); break; // lstore_<n>
+            case 0x43: case 0x44: case 0x45: case 0x46: store(opcode - 0x43, 1); break; // fstore_<n>
+            case 0x47: case 0x48: case 0x49: case 0x4A: store(opcode - 0x47, 2); break; // dstore_<n>
 
             case 0x36: { // istore
                 uint8_t idx = code[frame.pc++];
-                if (!operands.empty() && idx < locals.size()) {
+                if (!operands.empty() && idx < numLocals) {
                     locals[idx] = operands.top(); 
                     operands.pop();
                 }
                 break;
             }
-            case 0x3B: if (!operands.empty() && locals.size() > 0) { locals[0] = operands.top(); operands.pop(); } break; // istore_0
-            case 0x3C: if (!operands.empty() && locals.size() > 1) { locals[1] = operands.top(); operands.pop(); } break; // istore_1
-            case 0x3D: if (!operands.empty() && locals.size() > 2) { locals[2] = operands.top(); operands.pop(); } break; // istore_2
-            case 0x3E: if (!operands.empty() && locals.size() > 3) { locals[3] = operands.top(); operands.pop(); } break; // istore_3
+            case 0x3B: if (!operands.empty() && numLocals > 0) { locals[0] = operands.top(); operands.pop(); } break; // istore_0
+            case 0x3C: if (!operands.empty() && numLocals > 1) { locals[1] = operands.top(); operands.pop(); } break; // istore_1
+            case 0x3D: if (!operands.empty() && numLocals > 2) { locals[2] = operands.top(); operands.pop(); } break; // istore_2
+            case 0x3E: if (!operands.empty() && numLocals > 3) { locals[3] = operands.top(); operands.pop(); } break; // istore_3
 
             case 0x3A: { // astore
                 uint8_t idx = code[frame.pc++];
-                if (!operands.empty() && idx < locals.size()) {
+                if (!operands.empty() && idx < numLocals) {
                     locals[idx] = operands.top(); 
                     operands.pop();
                 }
                 break;
             }
-            case 0x4B: if (!operands.empty() && locals.size() > 0) { locals[0] = operands.top(); operands.pop(); } break; // astore_0
-            case 0x4C: if (!operands.empty() && locals.size() > 1) { locals[1] = operands.top(); operands.pop(); } break; // astore_1
-            case 0x4D: if (!operands.empty() && locals.size() > 2) { locals[2] = operands.top(); operands.pop(); } break; // astore_2
-            case 0x4E: if (!operands.empty() && locals.size() > 3) { locals[3] = operands.top(); operands.pop(); } break; // astore_3
+            case 0x4B: if (!operands.empty() && numLocals > 0) { locals[0] = operands.top(); operands.pop(); } break; // astore_0
+            case 0x4C: if (!operands.empty() && numLocals > 1) { locals[1] = operands.top(); operands.pop(); } break; // astore_1
+            case 0x4D: if (!operands.empty() && numLocals > 2) { locals[2] = operands.top(); operands.pop(); } break; // astore_2
+            case 0x4E: if (!operands.empty() && numLocals > 3) { locals[3] = operands.top(); operands.pop(); } break; // astore_3
 
             case 0x57: if (!operands.empty()) operands.pop(); break; // pop
+            case 0x58: if (operands.size() >= 2) { operands.pop(); operands.pop(); } break; // pop2
             case 0x59: { // dup
                 if (!operands.empty()) {
                     auto v = operands.top();
@@ -609,13 +6701,21 @@ struct JVMInstance {
                 }
                 break;
             }
+            case 0x5C: { // dup2
+                if (operands.size() >= 2) {
+                    StackSlot a = operands.sp[-2], b = operands.sp[-1];
+                    operands.push(a);
+                    operands.push(b);
+                }
+                break;
+            }
 
             case 0x60: { // iadd
                 if (operands.size() >= 2) {
                     auto b = operands.top(); operands.pop();
                     auto a = operands.top(); operands.pop();
-                    if (a.type == StackSlot::INT && b.type == StackSlot::INT) {
-                        operands.push(StackSlot(a.intValue + b.intValue));
+                    if (a.isInt() && b.isInt()) {
+                        operands.push(StackSlot(intAdd(a.asInt(), b.asInt())));
                     }
                 }
                 break;
@@ -624,8 +6724,8 @@ struct JVMInstance {
                 if (operands.size() >= 2) {
                     auto b = operands.top(); operands.pop();
                     auto a = operands.top(); operands.pop();
-                    if (a.type == StackSlot::INT && b.type == StackSlot::INT) {
-                        operands.push(StackSlot(a.intValue - b.intValue));
+                    if (a.isInt() && b.isInt()) {
+                        operands.push(StackSlot(intSub(a.asInt(), b.asInt())));
                     }
                 }
                 break;
@@ -634,8 +6734,8 @@ struct JVMInstance {
                 if (operands.size() >= 2) {
                     auto b = operands.top(); operands.pop();
                     auto a = operands.top(); operands.pop();
-                    if (a.type == StackSlot::INT && b.type == StackSlot::INT) {
-                        operands.push(StackSlot(a.intValue * b.intValue));
+                    if (a.isInt() && b.isInt()) {
+                        operands.push(StackSlot(intMul(a.asInt(), b.asInt())));
                     }
                 }
                 break;
@@ -648,28 +6748,20 @@ struct JVMInstance {
                 if (operands.size() >= 2) {
                     auto b = operands.top(); operands.pop();
                     auto a = operands.top(); operands.pop();
-                    if (a.type == StackSlot::INT && b.type == StackSlot::INT) {
-                        if (b.intValue == 0) throw runtime_error("Division by zero");
-                        operands.push(StackSlot(a.intValue / b.intValue));
+                    if (a.isInt() && b.isInt()) {
+                        if (b.asInt() == 0) throw VMError(VMErrorKind::ArithmeticException, "/ by zero");
+                        operands.push(StackSlot(intDiv(a.asInt(), b.asInt())));
                     }
                 }
                 break;
             }
 
 
-            case 0x0e: {
-                operands.push(StackSlot(ObjectPtr(nullptr)));
-                break; 
-            }
-                
-
-
-
             case 0x84: { // iinc
                 uint8_t idx = code[frame.pc++];
                 jbyte increment = static_cast<jbyte>(code[frame.pc++]);
-                if (idx < locals.size() && locals[idx].type == StackSlot::INT) {
-                    locals[idx].intValue += increment;
+                if (idx < numLocals && locals[idx].isInt()) {
+                    locals[idx] = StackSlot(intAdd(locals[idx].asInt(), increment));
                 }
                 break;
             }
@@ -677,8 +6769,8 @@ struct JVMInstance {
             case 0x99: case 0x9A: case 0x9B: case 0x9C: case 0x9D: case 0x9E: { // ifeq, ifne, etc.
                 if (!operands.empty()) {
                     auto slot = operands.top(); operands.pop();
-                    if (slot.type == StackSlot::INT) {
-                        jint val = slot.intValue;
+                    if (slot.isInt()) {
+                        jint val = slot.asInt();
                         uint16_t raw_offset = (static_cast<uint16_t>(code[frame.pc]) << 8) | 
                                              static_cast<uint16_t>(code[frame.pc + 1]);
                         jshort offset = static_cast<jshort>(raw_offset);
@@ -693,7 +6785,7 @@ struct JVMInstance {
                             case 0x9D: jump = (val > 0); break;  // ifgt
                             case 0x9E: jump = (val <= 0); break; // ifle
                         }
-                        if (jump) frame.pc = frame.pc - 3 + offset;
+                        if (jump) takeBranch(frame, frame.pc - 3, offset);
                     }
                 }
                 break;
@@ -703,9 +6795,9 @@ struct JVMInstance {
                 if (operands.size() >= 2) {
                     auto slot2 = operands.top(); operands.pop();
                     auto slot1 = operands.top(); operands.pop();
-                    if (slot1.type == StackSlot::INT && slot2.type == StackSlot::INT) {
-                        jint val1 = slot1.intValue;
-                        jint val2 = slot2.intValue;
+                    if (slot1.isInt() && slot2.isInt()) {
+                        jint val1 = slot1.asInt();
+                        jint val2 = slot2.asInt();
                         uint16_t raw_offset = (static_cast<uint16_t>(code[frame.pc]) << 8) | 
                                              static_cast<uint16_t>(code[frame.pc + 1]);
                         jshort offset = static_cast<jshort>(raw_offset);
@@ -720,7 +6812,7 @@ struct JVMInstance {
                             case 0xA3: jump = (val1 > val2); break;  // if_icmpgt
                             case 0xA4: jump = (val1 <= val2); break; // if_icmple
                         }
-                        if (jump) frame.pc = frame.pc - 3 + offset;
+                        if (jump) takeBranch(frame, frame.pc - 3, offset);
                     }
                 }
                 break;
@@ -731,9 +6823,9 @@ struct JVMInstance {
                 if (operands.size() >= 2) {
                     auto slot2 = operands.top(); operands.pop();
                     auto slot1 = operands.top(); operands.pop();
-                    if (slot1.type == StackSlot::REF && slot2.type == StackSlot::REF) {
-                        ObjectPtr ref1 = slot1.refValue;
-                        ObjectPtr ref2 = slot2.refValue;
+                    if (slot1.isRef() && slot2.isRef()) {
+                        Object* ref1 = slot1.asRef();
+                        Object* ref2 = slot2.asRef();
                         uint16_t raw_offset = (static_cast<uint16_t>(code[frame.pc]) << 8) | 
                                              static_cast<uint16_t>(code[frame.pc + 1]);
                         jshort offset = static_cast<jshort>(raw_offset);
@@ -744,7 +6836,7 @@ struct JVMInstance {
                             case 0xA5: jump = (ref1 == ref2); break; // if_acmpeq
                             case 0xA6: jump = (ref1 != ref2); break; // if_acmpne
                         }
-                        if (jump) frame.pc = frame.pc - 3 + offset;
+                        if (jump) takeBranch(frame, frame.pc - 3, offset);
                     }
                 }
                 break;
@@ -754,7 +6846,7 @@ struct JVMInstance {
                 uint16_t raw_offset = (static_cast<uint16_t>(code[frame.pc]) << 8) | 
                                      static_cast<uint16_t>(code[frame.pc + 1]);
                 jshort offset = static_cast<jshort>(raw_offset);
-                frame.pc = frame.pc - 1 + offset;
+                takeBranch(frame, frame.pc - 1, offset);
                 break;
             }
 
@@ -762,40 +6854,66 @@ struct JVMInstance {
                 uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) | 
                                 static_cast<uint16_t>(code[frame.pc + 1]);
                 frame.pc += 2;
-                operands.push(StackSlot(systemOut));
+                getStatic(frame, index);
                 break;
             }
-            case 0xB8: { // invokestatic
+            case 0xB4: { // getfield
                 uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
                     static_cast<uint16_t>(code[frame.pc + 1]);
                 frame.pc += 2;
+                getField(frame, index);
+                break;
+            }
+            case 0xB5: { // putfield
+                uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
+                    static_cast<uint16_t>(code[frame.pc + 1]);
+                frame.pc += 2;
+                putField(frame, index);
+                break;
+            }
+            case 0xBB: { // new
+                uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
+                    static_cast<uint16_t>(code[frame.pc + 1]);
+                frame.pc += 2;
+                newObject(frame, index);
+                break;
+            }
+            case 0xBC: // newarray
+                newPrimitiveArray(frame, code[frame.pc++]);
+                break;
+            case 0xBD: { // anewarray
+                uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
+                    static_cast<uint16_t>(code[frame.pc + 1]);
+                frame.pc += 2;
+                newObjectArray(frame, index);
+                break;
+            }
+            case 0xBE: // arraylength
+                if (!operands.empty()) operands.top() = StackSlot(arrayRef(operands.top())->arrayLength());
+                break;
+            case 0xC2: // monitorenter
+                monitorEnter(nonNullRef(operands.top())); operands.pop();
+                break;
+            case 0xC3: // monitorexit
+                monitorExit(nonNullRef(operands.top())); operands.pop();
+                break;
 
-                auto [methodName, methodDescriptor] = resolveMethodRef(frame.method->owner->constantPool, index);
-
-
-                if (methodName == "input" && methodDescriptor == "(Ljava/lang/String;)Ljava/lang/String;") {
-
-                    if (!frame.operands.empty()) {
-                        auto promptSlot = frame.operands.top(); frame.operands.pop();
-                        string promptText;
-                        if (promptSlot.type == StackSlot::REF && promptSlot.refValue &&
-                            promptSlot.refValue->clazz->name == "java/lang/String") {
-                            promptText = promptSlot.refValue->stringValue;
-                        }
-
-
-                        cout << promptText;
-                        string inputLine;
-                        getline(cin, inputLine);
-
-                        // string to Stack
-                        auto strObj = createString(inputLine);
-                        frame.operands.push(StackSlot(strObj));
-                    }
-                    break;
-                }
-
-                // you can add other static methods 
+            case 0x2E: case 0x30: arrayLoad(frame, 'I'); break; // iaload, faload
+            case 0x2F: case 0x31: arrayLoad(frame, 'J'); break; // laload, daload
+            case 0x32: arrayLoad(frame, 'L'); break; // aaload
+            case 0x33: arrayLoad(frame, 'B'); break; // baload
+            case 0x34: arrayLoad(frame, 'C'); break; // caload
+            case 0x35: arrayLoad(frame, 'S'); break; // saload
+            case 0x4F: case 0x51: arrayStore(frame, 'I'); break; // iastore, fastore
+            case 0x50: case 0x52: arrayStore(frame, 'J'); break; // lastore, dastore
+            case 0x53: arrayStore(frame, 'L'); break; // aastore
+            case 0x54: arrayStore(frame, 'B'); break; // bastore
+            case 0x55: case 0x56: arrayStore(frame, 'C'); break; // castore, sastore
+            case 0xB8: { // invokestatic
+                uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
+                    static_cast<uint16_t>(code[frame.pc + 1]);
+                frame.pc += 2;
+                invokeStatic(frame, index);
                 break;
             }
 
@@ -803,85 +6921,525 @@ struct JVMInstance {
                 uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
                     static_cast<uint16_t>(code[frame.pc + 1]);
                 frame.pc += 2;
+                invokeVirtual(frame, index);
+                break;
+            }
+            case 0xB7: { // invokespecial
+                uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
+                    static_cast<uint16_t>(code[frame.pc + 1]);
+                frame.pc += 2;
+                invokeSpecial(frame, index);
+                break;
+            }
+            case 0xB9: { // invokeinterface
+                uint16_t index = (static_cast<uint16_t>(code[frame.pc]) << 8) |
+                    static_cast<uint16_t>(code[frame.pc + 1]);
+                frame.pc += 4;  // count and zero bytes are unused
+                invokeVirtual(frame, index);
+                break;
+            }
 
-                auto [methodName, methodDescriptor] = resolveMethodRef(frame.method->owner->constantPool, index);
-
-
-                // println(String)
-                if (methodName == "println" && methodDescriptor == "(Ljava/lang/String;)V") {
-                    if (operands.size() >= 2) {
-                        auto argSlot = operands.top(); operands.pop();
-                        auto objSlot = operands.top(); operands.pop();
-                        if (argSlot.type == StackSlot::REF && argSlot.refValue &&
-                            argSlot.refValue->clazz->name == "java/lang/String") {
-                            cout << argSlot.refValue->stringValue << endl;
-                        }
-                    }
-                    break;
-                }
-
-                // println(int)
-                if (methodName == "println" && methodDescriptor == "(I)V") {
-                    if (operands.size() >= 2) {
-                        auto argSlot = operands.top(); operands.pop();
-                        auto objSlot = operands.top(); operands.pop();
-                        if (argSlot.type == StackSlot::INT) {
-                            cout << argSlot.intValue << endl;
-                        }
-                    }
-                    break;
-                }
+            case 0xAC: // ireturn
+            case 0xAE: // freturn
+            case 0xB0: { // areturn
+                StackSlot result = operands.empty() ? StackSlot() : operands.top();
+                popFrame(&result);
+                return;
+            }
+            case 0xAD: // lreturn
+            case 0xAF: { // dreturn
+                StackSlot result[2];
+                if (operands.size() >= 2) copy(operands.sp - 2, operands.sp, result);
+                popFrame(result, 2);
+                return;
+            }
+            case 0xB1: // return
+                popFrame(nullptr);
+                return;
 
-                if (methodName == "equals" && methodDescriptor == "(Ljava/lang/Object;)Z") {
-                    auto argSlot = operands.top(); operands.pop();
-                    auto objSlot = operands.top(); operands.pop();
+            case 0xBF: { // athrow, thrown on by execute()
+                if (operands.empty()) break;
+                Object* exception = operands.top().isRef() ? operands.top().asRef() : nullptr;
+                if (operands.top().isRef() && !exception) throw VMError(VMErrorKind::NullPointerException);
+                if (!exception || !isSubclassOf(exception->clazz, throwableClass))
+                    throw VMError(VMErrorKind::VerifyError, "Bad operand for athrow in " + frame.method->name);
+                currentThread->exception = exception;
+                throw GuestException(throwableString(exception));
+            }
 
-                    bool result = false;
-                    if (objSlot.type == StackSlot::REF && argSlot.type == StackSlot::REF &&
-                        objSlot.refValue && argSlot.refValue) {
-                        result = (objSlot.refValue->stringValue == argSlot.refValue->stringValue);
-                    }
-                    operands.push(StackSlot(result ? 1 : 0));
+            default: {
+                int pops, pushes;
+                if (primitiveEffect(opcode, pops, pushes)) {
+                    bool ints = operands.size() >= static_cast<size_t>(pops) && operands.limit - operands.sp >= pushes - pops;
+                    for (int i = 1; ints && i <= pops; ++i) ints = operands.sp[-i].isInt();
+                    if (ints) operands.sp = primitiveOp(opcode, operands.sp);
                     break;
                 }
+                cerr << "Unimplemented opcode: 0x" << hex << setfill('0') << setw(2) << (int)opcode << dec << endl;
                 break;
             }
+        }
+    }
+};
 
+// Parses sizes such as "512k", "64m" or "1g"; returns 0 if malformed.
+static size_t parseSize(const string& text) {
+    char* end = nullptr;
+    unsigned long long value = strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str()) return 0;
+    switch (*end) {
+        case 'k': case 'K': value <<= 10; ++end; break;
+        case 'm': case 'M': value <<= 20; ++end; break;
+        case 'g': case 'G': value <<= 30; ++end; break;
+    }
+    return *end ? 0 : static_cast<size_t>(value);
+}
+
+// Parses the <calls>[,<backedges>] of -Xjit:threshold=.
+static bool parseThresholds(const string& text, VMOptions& options) {
+    char* end = nullptr;
+    unsigned long calls = strtoul(text.c_str(), &end, 10);
+    if (end == text.c_str()) return false;
+    unsigned long backedges = options.jitBackedges;
+    if (*end == ',') {
+        const char* start = end + 1;
+        backedges = strtoul(start, &end, 10);
+        if (end == start) return false;
+    }
+    if (*end || calls > UINT32_MAX || backedges > UINT32_MAX) return false;
+    options.jitCalls = static_cast<uint32_t>(calls);
+    options.jitBackedges = static_cast<uint32_t>(backedges);
+    return true;
+}
+
+// Writes a class archive (see ClassArchive) holding the given class files;
+// the first one is the main class.
+static void packArchive(const string& outPath, const vector<string>& classFiles) {
+    struct Item {
+        string name;
+        vector<uint8_t> image;   // still encrypted, copied as is
+        uint32_t entry = 0, offset = 0;
+    };
+    vector<Item> items;
+    unordered_map<string, size_t> byName;
+    for (auto& path : classFiles) {
+        MappedFile file(path);
+        vector<uint8_t> plain(file.size);
+        decryptClassBytes(file.data, plain.data(), file.size);
+        MemoryFile mem(plain.data(), plain.size());
+        const uint8_t* header = mem.take(10);
+        if (MemoryFile::be32(header) != 0xCAFEBABE) throw runtime_error("Invalid magic number: " + path);
+        auto cp = JVMInstance::readConstantPool(mem, MemoryFile::be16(header + 8));
+        string name = JVMInstance::classNameAt(cp, MemoryFile::be16(mem.take(6) + 2));
+        if (name.empty()) throw runtime_error("Cannot determine class name: " + path);
+        if (!byName.emplace(name, items.size()).second) throw runtime_error("Duplicate class " + name);
+        items.push_back({ name, vector<uint8_t>(file.data, file.data + file.size) });
+    }
+    if (items.empty()) throw runtime_error("No classes to pack");
+
+    uint32_t buckets = 1;
+    while (buckets < items.size()) buckets <<= 1;
+    vector<uint8_t> index(ClassArchive::HEADER_SIZE + 4 * buckets);
+    auto put = [&](size_t pos, uint32_t v, int bytes) {
+        for (int i = bytes - 1; i >= 0; --i, v >>= 8) index[pos + i] = static_cast<uint8_t>(v);
+    };
+    for (auto& item : items) {
+        item.entry = static_cast<uint32_t>(index.size());
+        index.resize(index.size() + 14);
+        index.insert(index.end(), item.name.begin(), item.name.end());
+    }
+    size_t offset = index.size();
+    for (auto& item : items) {
+        offset = (offset + ClassArchive::IMAGE_ALIGN - 1) / ClassArchive::IMAGE_ALIGN * ClassArchive::IMAGE_ALIGN;
+        if (offset + item.image.size() > UINT32_MAX) throw runtime_error("Archive too large");
+        item.offset = static_cast<uint32_t>(offset);
+        offset += item.image.size();
+    }
+    put(0, ClassArchive::MAGIC, 4);
+    put(4, buckets, 4);
+    put(8, items[0].entry, 4);
+    for (auto& item : items) {
+        size_t bucket = ClassArchive::HEADER_SIZE + 4 * (ClassArchive::hashName(item.name) & (buckets - 1));
+        put(item.entry, MemoryFile::be32(&index[bucket]), 4);   // chain onto the bucket
+        put(bucket, item.entry, 4);
+        put(item.entry + 4, item.offset, 4);
+        put(item.entry + 8, static_cast<uint32_t>(item.image.size()), 4);
+        put(item.entry + 12, static_cast<uint32_t>(item.name.size()), 2);
+    }
+    decryptClassBytes(index.data(), index.data(), index.size());   // XOR both ways
+
+    ofstream out(outPath, ios::binary);
+    if (!out) throw runtime_error("Cannot create " + outPath);
+    out.write(reinterpret_cast<const char*>(index.data()), index.size());
+    size_t written = index.size();
+    for (auto& item : items) {
+        out.write(string(item.offset - written, '\0').data(), item.offset - written);
+        out.write(reinterpret_cast<const char*>(item.image.data()), item.image.size());
+        written = item.offset + item.image.size();
+    }
+    if (!out) throw runtime_error("Cannot write " + outPath);
+}
+
+// One line of a -Xbatch job file: <app> <stdin> <stdout> [args...], where
+// "-" means no input or discarded output.
+struct BatchJob {
+    string app, input, output;
+    vector<string> args;
+};
 
+static vector<BatchJob> readBatchJobs(const string& path) {
+    ifstream in(path);
+    if (!in) throw runtime_error("Cannot open file: " + path);
+    vector<BatchJob> jobs;
+    string line;
+    for (int number = 1; getline(in, line); ++number) {
+        istringstream fields(line);
+        BatchJob job;
+        if (!(fields >> job.app) || job.app[0] == '#') continue;
+        if (!(fields >> job.input >> job.output))
+            throw runtime_error(path + ":" + to_string(number) + ": expected <app> <stdin> <stdout> [args...]");
+        for (string arg; fields >> arg;) job.args.push_back(arg);
+        jobs.push_back(move(job));
+    }
+    return jobs;
+}
+
+// A job's stdin or stdout file; -1 for "-".
+static int openJobFile(const string& path, bool output) {
+    if (path == "-") return -1;
+#ifdef _WIN32
+    int fd = output ? _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE)
+                    : _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    int fd = output ? open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644) : open(path.c_str(), O_RDONLY);
+#endif
+    if (fd < 0) throw runtime_error("Cannot open file: " + path);
+    return fd;
+}
+
+static string jsonString(string_view text) {
+    static const char hex[] = "0123456789abcdef";
+    string out = "\"";
+    for (char c : text) {
+        auto byte = static_cast<unsigned char>(c);
+        if (c == '"' || c == '\\') out += { '\\', c };
+        else if (c == '\n') out += "\\n";
+        else if (byte < 0x20) out += { '\\', 'u', '0', '0', hex[byte >> 4], hex[byte & 15] };
+        else out += c;
+    }
+    return out + '"';
+}
+
+// Calls run(0) .. run(count - 1) on workers threads. The jobs are dealt out
+// in contiguous blocks; a worker runs its own from the front and, once they
+// are gone, steals from the back of another's, so a few slow jobs do not
+// leave the rest of the pool idle.
+static void runWorkStealing(size_t count, unsigned workers, const function<void(size_t)>& run) {
+    struct Queue {
+        mutex lock;
+        deque<size_t> jobs;
+    };
+    vector<Queue> queues(workers);
+    for (size_t i = 0; i < count; ++i) queues[i * workers / count].jobs.push_back(i);
+    auto take = [&](unsigned self, size_t& job) {
+        for (unsigned k = 0; k < workers; ++k) {
+            Queue& queue = queues[(self + k) % workers];
+            lock_guard<mutex> hold(queue.lock);
+            if (queue.jobs.empty()) continue;
+            if (k == 0) {
+                job = queue.jobs.front();
+                queue.jobs.pop_front();
+            } else {
+                job = queue.jobs.back();
+                queue.jobs.pop_back();
+            }
+            return true;
+        }
+        return false;
+    };
+    vector<std::thread> threads;
+    for (unsigned w = 0; w < workers; ++w)
+        threads.emplace_back([&, w] { for (size_t job; take(w, job);) run(job); });
+    for (auto& t : threads) t.join();
+}
+
+// -Xbatch: runs each job in a JVMInstance of its own, on threads workers,
+// and prints one JSON line per job to stdout as it finishes. Jobs of one
+// application share its shared image, mapped once up front.
+static void runBatch(const string& jobFile, unsigned threads, const VMOptions& batchOptions) {
+    vector<BatchJob> jobs = readBatchJobs(jobFile);
+    VMOptions options = batchOptions;
+    options.parseThreads = 1;   // the pool keeps every core busy already
+    options.sampleRate = 0;     // -Xprof:sample profiles single runs
+    unordered_map<string, shared_ptr<const SharedImage>> images;
+    if (options.share == ShareMode::Auto || options.share == ShareMode::On) {
+        for (auto& job : jobs) {
+            if (images.count(job.app)) continue;
+            auto& image = images[job.app];
+            try {
+                image = make_shared<const SharedImage>(SharedImage::pathFor(job.app), job.app);
+            } catch (const exception&) {
+                // each job reports it under -Xshare:on
+            }
+        }
+    }
 
-
-            case 0xB1: // return
-                callStack.pop();
-                return;
-
-            default:
-                cerr << "Unimplemented opcode: 0x" << hex << setfill('0') << setw(2) << (int)opcode << dec << endl;
-                break;
+    mutex reportLock;
+    runWorkStealing(jobs.size(), threads, [&](size_t i) {
+        const BatchJob& job = jobs[i];
+        auto start = chrono::steady_clock::now();
+        string status = "ok", error;
+        int in = -1, out = -1;
+        bool budget = false;
+        uint64_t steps = 0;
+        try {
+            in = openJobFile(job.input, false);
+            out = openJobFile(job.output, true);
+            JVMInstance vm(options, in, out);
+            auto image = images.find(job.app);
+            if (image != images.end()) vm.shared = image->second;
+            try {
+                vm.run(job.app, job.args);
+            } catch (const BudgetExceeded& e) {
+                status = "budget";
+                error = e.what();
+            } catch (const exception& e) {
+                status = "error";
+                error = e.what();
+            }
+            budget = vm.hasBudget();
+            steps = vm.stepsUsed();
+        } catch (const exception& e) {
+            status = "error";
+            error = e.what();
         }
+        if (in >= 0) JVM_CLOSE(in);
+        if (out >= 0) JVM_CLOSE(out);
+
+        double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        ostringstream line;
+        line << "{\"job\":" << i + 1 << ",\"app\":" << jsonString(job.app) << ",\"status\":\"" << status << '"';
+        if (!error.empty()) line << ",\"error\":" << jsonString(error);
+        if (budget) line << ",\"steps\":" << steps;
+        line << ",\"ms\":" << fixed << setprecision(3) << ms << "}\n";
+        lock_guard<mutex> hold(reportLock);
+        cout << line.str() << flush;
+    });
+}
+
+// What loading produced, for comparing parallel with serial loading: each
+// class with its supertypes, field layout and methods as linked.
+static string classFingerprint(const JVMInstance& vm) {
+    vector<const Class*> classes;
+    for (auto& entry : vm.loadedClasses) classes.push_back(entry.second.get());
+    sort(classes.begin(), classes.end(), [](const Class* a, const Class* b) { return a->name < b->name; });
+    ostringstream out;
+    for (const Class* c : classes) {
+        out << c->name << '<' << (c->superClass ? c->superClass->name : "");
+        for (auto& i : c->interfaces) out << ',' << i->name;
+        out << " refs=" << c->instanceRefs << " bytes=" << c->instanceBytes << '\n';
+        for (auto& f : c->fields) out << ' ' << f.name << f.descriptor << '@' << f.offset << '\n';
+        for (auto& m : c->methods) {
+            out << ' ' << m.name << m.descriptor << " v" << m.vtableIndex << " i" << m.itableIndex
+                << (m.verified ? " verified" : "") << (m.native ? " native" : "");
+            for (auto& insn : m.insns) out << ' ' << int(insn.opcode) << ':' << insn.a << ':' << insn.b;
+            out << '\n';
+        }
+        for (Method* m : c->vtable) out << " vt " << m->owner->name << '.' << m->name << m->descriptor << '\n';
     }
-};
+    return out.str();
+}
+
+// -Xparse:bench: time loading every class of an archive, in index order,
+// with 1, 2, 4 and 8 parse threads; best of five runs each.
+static void runParseBench(const string& path, const VMOptions& benchOptions) {
+    VMOptions options = benchOptions;
+    options.share = ShareMode::Off;
+    string serial;
+    double serialMs = 0;
+    cout << path << ", " << std::thread::hardware_concurrency() << " cores\n"
+         << "parse threads        ms  speedup  classes\n";
+    for (unsigned threads : { 1u, 2u, 4u, 8u }) {
+        options.parseThreads = threads;
+        double best = 0;
+        size_t classes = 0;
+        bool same = true;
+        for (int run = 0; run < 5; ++run) {
+            JVMInstance vm(options, -1, -1);
+            auto start = chrono::steady_clock::now();
+            vm.loadApplication(path);
+            if (!vm.archive) throw runtime_error("-Xparse:bench needs an archive: " + path);
+            auto entries = vm.archive->entries();
+            for (auto& e : entries) vm.loadClass(e.name);
+            vm.prefetcher.reset();
+            double ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            if (run == 0 || ms < best) best = ms;
+            classes = entries.size();
+            string fingerprint = classFingerprint(vm);
+            if (serial.empty()) serial = fingerprint;
+            same = same && fingerprint == serial;
+        }
+        if (threads == 1) serialMs = best;
+        cout << setw(13) << threads << "  " << setw(8) << fixed << setprecision(3) << best << "  "
+             << setw(6) << setprecision(2) << serialMs / best << "x  " << classes
+             << (same ? "" : "  differs from serial loading") << '\n';
+    }
+}
+
+static void printUsage(const char* prog) {
+    cerr << "Usage: " << prog << " [options] <classfile.class | archive> [args...]\n"
+         << "       " << prog << " -Xpack:<archive> <main.class> [more.class ...]\n"
+         << "       " << prog << " [options] -Xbatch:<jobs> [-Xbatch:threads=<n>]\n"
+         << "  -Xint:threaded   pre-decoded threaded interpreter (default)\n"
+         << "  -Xint:switch     original bytecode switch interpreter\n"
+         << "  -Xmx<size>       maximum heap size, e.g. -Xmx256m (default 64m)\n"
+         << "  -Xss<size>       VM stack size for frames (default 8m)\n"
+         << "  -Xlog:gc         log every garbage collection to stderr\n"
+         << "  -Xlog:class+load log classes loaded on demand to stderr\n"
+         << "  -Xverify:all     verify each method before its first run; verified\n"
+         << "                   methods run without per-instruction checks (default)\n"
+         << "  -Xverify:none    run everything with the checked handlers\n"
+         << "  -Xfuse:on|off    fuse common instruction sequences (default on)\n"
+         << "  -Xprof:insns     count adjacent instruction pairs and triples and list the\n"
+         << "                   most frequent on stderr at exit (no fusion, no JIT)\n"
+         << "  -Xprof:sample[=<hz>] sample guest stacks (default 100 a second) and write\n"
+         << "                   them to <app>.collapsed for flame graphs\n"
+         << "  -Xprof:hot       sample, and list the hottest methods and instructions on\n"
+         << "                   stderr at exit\n"
+         << "  -Xjit:on|off     compile hot integer code to x86-64 (default on where\n"
+         << "                   supported; needs the threaded interpreter)\n"
+         << "  -Xjit:threshold=<calls>[,<backedges>]\n"
+         << "                   calls, or taken loop branches, before a method is\n"
+         << "                   compiled (default 1000,10000; 0 compiles on first call)\n"
+         << "  -Xjit:dump       list each method compiled, and its code, on stderr\n"
+         << "  -Xshare:dump     write the parsed classes to <app>.jsa and exit\n"
+         << "  -Xshare:auto     start from <app>.jsa when it matches the app (default)\n"
+         << "  -Xshare:on|off   require / ignore the shared image\n"
+         << "  -Xio:flush=<p>   when console output is flushed: line, input (default,\n"
+         << "                   before reading stdin) or exit (only when full/at exit)\n"
+         << "  -Xbudget:steps=<n> stop a program after n calls and taken backward branches\n"
+         << "  -Xbudget:ms=<n>  stop a program after n milliseconds\n"
+         << "  -Xbatch:<jobs>   run each line <app> <stdin> <stdout> [args...] of the jobs\n"
+         << "                   file in its own VM, in parallel; one JSON result per line\n"
+         << "  -Xbatch:threads=<n> worker threads for -Xbatch (default: one per core)\n"
+         << "  -Xparse:threads=<n> threads parsing archive classes ahead of use (default:\n"
+         << "                   one per core; 1 parses each class when first loaded)\n"
+         << "  -Xparse:bench    time loading every class of the archive with 1, 2, 4 and\n"
+         << "                   8 parse threads, and check the classes match serial loading\n";
+}
 
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        cerr << "Usage: " << argv[0] << " <classfile.class>" << endl;
+    VMOptions options;
+    string filename;
+    string packTo;
+    vector<string> packFiles;
+    vector<string> appArgs;
+    string batchFile;
+    bool parseBench = false;
+    unsigned batchThreads = std::thread::hardware_concurrency();
+    bool usage = false;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (!filename.empty()) {    // everything after the class goes to main()
+            appArgs.push_back(arg);
+            continue;
+        }
+        if (arg == "-Xint:switch") options.switchInterpreter = true;
+        else if (arg == "-Xint:threaded") options.switchInterpreter = false;
+        else if (arg.rfind("-Xmx", 0) == 0) {
+            options.maxHeap = parseSize(arg.substr(4));
+            if (options.maxHeap == 0) usage = true;
+        }
+        else if (arg.rfind("-Xss", 0) == 0) {
+            options.stackSize = parseSize(arg.substr(4));
+            if (options.stackSize == 0) usage = true;
+        }
+        else if (arg == "-Xlog:gc") options.logGC = true;
+        else if (arg == "-Xlog:class+load") options.logClassLoad = true;
+        else if (arg == "-Xverify:all") options.verify = true;
+        else if (arg == "-Xverify:none") options.verify = false;
+        else if (arg == "-Xfuse:on") options.fuse = true;
+        else if (arg == "-Xfuse:off") options.fuse = false;
+        else if (arg == "-Xprof:insns") options.profileInsns = true;
+        else if (arg == "-Xprof:sample") options.sampleRate = 100;
+        else if (arg.rfind("-Xprof:sample=", 0) == 0) {
+            options.sampleRate = static_cast<uint32_t>(min<unsigned long>(strtoul(arg.c_str() + 14, nullptr, 10), 100000));
+            if (options.sampleRate == 0) usage = true;
+        }
+        else if (arg == "-Xprof:hot") options.profileHot = true;
+        else if (arg == "-Xjit:on") options.jit = true;
+        else if (arg == "-Xjit:off") options.jit = false;
+        else if (arg == "-Xjit:dump") options.jit = options.jitDump = true;
+        else if (arg.rfind("-Xjit:threshold=", 0) == 0) {
+            if (!parseThresholds(arg.substr(16), options)) usage = true;
+        }
+        else if (arg == "-Xshare:auto") options.share = ShareMode::Auto;
+        else if (arg == "-Xshare:on") options.share = ShareMode::On;
+        else if (arg == "-Xshare:off") options.share = ShareMode::Off;
+        else if (arg == "-Xshare:dump") options.share = ShareMode::Dump;
+        else if (arg == "-Xio:flush=line") options.flush = FlushPolicy::Line;
+        else if (arg == "-Xio:flush=input") options.flush = FlushPolicy::Input;
+        else if (arg == "-Xio:flush=exit") options.flush = FlushPolicy::Exit;
+        else if (arg.rfind("-Xbudget:steps=", 0) == 0) {
+            options.budgetSteps = min<uint64_t>(strtoull(arg.c_str() + 15, nullptr, 10), INT64_MAX);
+            if (options.budgetSteps == 0) usage = true;
+        }
+        else if (arg.rfind("-Xbudget:ms=", 0) == 0) {
+            options.budgetMillis = static_cast<uint32_t>(min<unsigned long>(strtoul(arg.c_str() + 12, nullptr, 10), UINT32_MAX));
+            if (options.budgetMillis == 0) usage = true;
+        }
+        else if (arg.rfind("-Xbatch:threads=", 0) == 0) {
+            batchThreads = static_cast<unsigned>(strtoul(arg.c_str() + 16, nullptr, 10));
+            if (batchThreads == 0) usage = true;
+        }
+        else if (arg.rfind("-Xbatch:", 0) == 0) batchFile = arg.substr(8);
+        else if (arg.rfind("-Xparse:threads=", 0) == 0) {
+            options.parseThreads = static_cast<unsigned>(strtoul(arg.c_str() + 16, nullptr, 10));
+            if (options.parseThreads == 0) usage = true;
+        }
+        else if (arg == "-Xparse:bench") parseBench = true;
+        else if (arg.rfind("-Xpack:", 0) == 0) packTo = arg.substr(7);
+        else if (!packTo.empty() && arg[0] != '-') packFiles.push_back(arg);
+        else if (filename.empty() && arg[0] != '-') filename = arg;
+        else usage = true;
+    }
+    if (options.profileHot && !options.sampleRate) options.sampleRate = 100;
+    if (!packTo.empty() && !usage && !packFiles.empty()) {
+        try {
+            packArchive(packTo, packFiles);
+        } catch (const exception& e) {
+            cerr << "err: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (!batchFile.empty() && !usage && filename.empty() && packTo.empty()) {
+        try {
+            runBatch(batchFile, max(batchThreads, 1u), options);
+        } catch (const exception& e) {
+            cerr << "err: " << e.what() << endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (usage || filename.empty() || !packTo.empty() || !batchFile.empty()) {
+        printUsage(argv[0]);
         return 1;
     }
 
     try {
-        JVMInstance jvm;
-        string filename = argv[1];
-        
-        
-        cout << "Starting JVM...\n";
-        Sleep(200); // sleep JIC
-        // load class
-        ClassPtr clazz = jvm.loadClassFromFile(filename);
-        string className = clazz->name;
+        if (parseBench) {
+            runParseBench(filename, options);
+            return 0;
+        }
+        JVMInstance jvm(options);
+        if (options.share == ShareMode::Dump) {
+            jvm.dumpSharedImage(filename, SharedImage::pathFor(filename));
+            return 0;
+        }
         
         
-        jvm.runMain(className);
-        Sleep(200);
-        cout << "JVM has been executed";
+        jvm.run(filename, appArgs);
     } catch (const exception& e) {
         cerr << "err: " << e.what() << endl;
         return 1;